@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+#include <memory>
+#include "log.h"
+#include "mapping.h"
+#include "random.h"
+#include "ruleset.h"
+
+#define EXPORT extern "C" __attribute__((visibility("default")))
+
+namespace cbmapper {
+
+static constexpr int F = 5;
+
+static const char *msg = NULL;
+
+struct cbmapper_ctx {
+    ruleset<F> rule_db;
+    mapping_options opts;
+    std::unique_ptr<mapping<F>> mp;
+};
+
+static void
+set_error(const char *what)
+{
+    free((void*)msg);
+    msg = strdup(what);
+}
+
+EXPORT const char *
+cbmapper_get_last_error()
+{
+    return msg;
+}
+
+/* Replaces the log callback to discard the messages */
+static void
+discard_log(const char*)
+{}
+
+EXPORT void
+cbmapper_set_log_callback(void (*callback)(const char *msg))
+{
+    log_config(NULL, callback ? callback : discard_log);
+}
+
+EXPORT cbmapper_ctx *
+cbmapper_init(const uint32_t *rules, const int *priorities, size_t rule_num)
+{
+    if (!rules) {
+        set_error("rules must not be NULL");
+        return NULL;
+    }
+    if (!rule_num) {
+        set_error("rule_num must not be zero");
+        return NULL;
+    }
+    try {
+        std::unique_ptr<cbmapper_ctx> out(new cbmapper_ctx);
+        for (size_t i=0; i<rule_num; ++i) {
+            rule<F> r;
+            r.unique_id = i + 1;
+            r.priority = priorities ? priorities[i] : i + 1;
+            for (int f=0; f<F; ++f) {
+                uint32_t low = rules[2*F*i + 2*f];
+                uint32_t high = rules[2*F*i + 2*f + 1];
+                if (low > high) {
+                    throw errorf("rule %lu: field %d is empty (%u-%u)",
+                                 i, f, low, high);
+                }
+                /* Bits shared by all values of the range */
+                uint32_t diff = low ^ high;
+                r[f] = {low, high,
+                        (uint8_t)(diff ? __builtin_clz(diff) : 32)};
+            }
+            out->rule_db.push_back(r);
+        }
+        return out.release();
+    } catch (std::exception &e) {
+        set_error(e.what());
+        return NULL;
+    }
+}
+
+EXPORT cbmapper_ctx *
+cbmapper_init_file(const char *filename, int reverse_priorities)
+{
+    if (!filename) {
+        set_error("filename must not be NULL");
+        return NULL;
+    }
+    try {
+        std::unique_ptr<cbmapper_ctx> out(new cbmapper_ctx);
+        out->rule_db = ruleset_read_classbench_file(filename,
+                                                    reverse_priorities);
+        if (!out->rule_db.size()) {
+            throw errorf("\"%s\" has no rules", filename);
+        }
+        return out.release();
+    } catch (std::exception &e) {
+        set_error(e.what());
+        return NULL;
+    }
+}
+
+EXPORT void
+cbmapper_destroy(cbmapper_ctx *cbm)
+{
+    if (!cbm) {
+        return;
+    }
+    delete cbm;
+}
+
+EXPORT size_t
+cbmapper_get_rule_num(cbmapper_ctx *cbm)
+{
+    if (!cbm) {
+        return 0;
+    }
+    return cbm->rule_db.size();
+}
+
+EXPORT int
+cbmapper_get_rule(cbmapper_ctx *cbm, size_t idx, uint32_t *data, int *prio)
+{
+    if (!cbm || !data || !prio || idx >= cbm->rule_db.size()) {
+        return -EINVAL;
+    }
+    const rule<F> &r = cbm->rule_db[idx];
+    *prio = r.priority;
+    for (int f=0; f<F; ++f) {
+        data[2*f] = r[f].low;
+        data[2*f+1] = r[f].high;
+    }
+    return 0;
+}
+
+EXPORT int
+cbmapper_set_threads(cbmapper_ctx *cbm, int threads)
+{
+    if (!cbm || threads < 0) {
+        return -EINVAL;
+    }
+    cbm->opts.thread_num = threads;
+    return 0;
+}
+
+EXPORT int
+cbmapper_set_miss_ratio(cbmapper_ctx *cbm, double ratio)
+{
+    if (!cbm || !(ratio >= 0 && ratio <= 1)) {
+        return -EINVAL;
+    }
+    cbm->opts.miss_ratio = ratio;
+    return 0;
+}
+
+EXPORT int
+cbmapper_set_exact_flows(cbmapper_ctx *cbm, int exact)
+{
+    if (!cbm) {
+        return -EINVAL;
+    }
+    cbm->opts.exact_flows = exact;
+    return 0;
+}
+
+EXPORT int
+cbmapper_set_rule_weights(cbmapper_ctx *cbm, const double *weights)
+{
+    if (!cbm) {
+        return -EINVAL;
+    }
+    if (!weights) {
+        cbm->opts.distribution = flow_distribution::uniform;
+        cbm->opts.rule_weights.clear();
+        return 0;
+    }
+    size_t n = cbm->rule_db.size();
+    for (size_t i=0; i<n; ++i) {
+        if (!(weights[i] >= 0)) {
+            return -EINVAL;
+        }
+    }
+    cbm->opts.distribution = flow_distribution::weights;
+    cbm->opts.rule_weights.assign(weights, weights + n);
+    return 0;
+}
+
+EXPORT int
+cbmapper_run(cbmapper_ctx *cbm, uint64_t flow_num, int seed)
+{
+    if (!cbm || !cbm->rule_db.size()) {
+        return -EINVAL;
+    }
+    try {
+        /* A new mapping per run, with the options set since the last */
+        cbm->mp.reset();
+        random_core::set_seed(seed);
+        std::unique_ptr<mapping<F>> mp(new mapping<F>(cbm->opts));
+        mp->run(cbm->rule_db, flow_num);
+        cbm->mp = std::move(mp);
+        return 0;
+    } catch (std::exception &e) {
+        set_error(e.what());
+        return -EAGAIN;
+    }
+}
+
+EXPORT size_t
+cbmapper_get_header_num(cbmapper_ctx *cbm)
+{
+    if (!cbm || !cbm->mp) {
+        return 0;
+    }
+    return cbm->mp->get_header_num();
+}
+
+EXPORT int64_t
+cbmapper_get_headers(cbmapper_ctx *cbm,
+                     size_t first,
+                     size_t num,
+                     uint32_t *headers,
+                     uint32_t *rules)
+{
+    if (!cbm) {
+        return -EINVAL;
+    }
+    if (!cbm->mp) {
+        return 0;
+    }
+    return cbm->mp->get_headers(first, num, headers, rules);
+}
+
+EXPORT int
+cbmapper_write_binary(cbmapper_ctx *cbm, const char *filename)
+{
+    if (!cbm || !cbm->mp || !filename) {
+        return -EINVAL;
+    }
+    try {
+        cbm->mp->save_binary_format(filename);
+        return 0;
+    } catch (std::exception &e) {
+        set_error(e.what());
+        return -EAGAIN;
+    }
+}
+
+};
@@ -0,0 +1,181 @@
+/* CBMapper library header. Generate packet headers that match N-tuple rules
+ * in-process, without files: load rules from memory or from a ClassBench
+ * file, map them to headers, and copy the headers to caller buffers. Use
+ * this library to generate fresh traffic per experiment in benchmarks.
+ *
+ * MIT License. Copyright (c) 2023 Alon Rashelbach.
+ *
+ * If you happen to use this library for an academic paper, please cite
+ * Scaling Open vSwitch with a Computational Cache, USENIX NSDI 2022.
+ *
+ * For source code and utilities, see
+ * https://github.com/alonrs/classbench-mapper. */
+
+#ifndef CBMAPPER_H
+#define CBMAPPER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct cbmapper_ctx;
+
+/* Number of fields per rule and header: protocol, source IP, destination
+ * IP, source port and destination port */
+#define CBMAPPER_FIELD_NUM 5
+
+/* The rule index of headers that match no rule */
+#define CBMAPPER_MISS 0xffffffffu
+
+/**
+ * @brief Returns a string representation of the last library error.
+ */
+const char * cbmapper_get_last_error();
+
+/**
+ * @brief Sets the function that receives the progress messages of the
+ * library. Messages are discarded by default, and after a call with NULL.
+ */
+void cbmapper_set_log_callback(void (*callback)(const char *msg));
+
+/**
+ * @brief Initiates a new cbmapper object with "rule_num" rules in priority
+ * order: when rules overlap, the one with the lower index matches.
+ * @param rules Rule "i" is rules[2F*i] ... rules[2F*i+2F-1], F =
+ * CBMAPPER_FIELD_NUM. Each two adjacent values are the inclusive lo and hi
+ * values per field. Copied by this.
+ * @param priorities The priority of each rule, as stored in binary files
+ * (see cbmapper_write_binary). Set to NULL for "i+1" per rule "i", as for
+ * ClassBench files.
+ * @param rule_num The number of rules. Must not be zero.
+ * @returns A new cbmapper object, or NULL in case of an error.
+ */
+struct cbmapper_ctx * cbmapper_init(const uint32_t *rules,
+                                    const int *priorities,
+                                    size_t rule_num);
+
+/**
+ * @brief Initiates a new cbmapper object with the rules of ClassBench file
+ * "filename". Set "reverse_priorities" as with the reverse-priorities
+ * argument of util.exe. The file must hold at least one rule.
+ * @returns A new cbmapper object, or NULL in case of an error.
+ */
+struct cbmapper_ctx * cbmapper_init_file(const char *filename,
+                                         int reverse_priorities);
+
+/**
+ * @brief Destroies the cbmapper object "cbm".
+ */
+void cbmapper_destroy(struct cbmapper_ctx *cbm);
+
+/**
+ * @brief Returns the number of rules of "cbm".
+ */
+size_t cbmapper_get_rule_num(struct cbmapper_ctx *cbm);
+
+/**
+ * @brief Returns a rule by its index.
+ * @param data Preallocated memory for holding the result. Must contain 2F
+ * elements. Each two adjacent values represent the lo and hi values per
+ * field.
+ * @param prio Set by this. The rule priority.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Zero on success.
+ */
+int cbmapper_get_rule(struct cbmapper_ctx *cbm,
+                      size_t idx,
+                      uint32_t *data,
+                      int *prio);
+
+/**
+ * @brief Sets the number of worker threads of the next cbmapper_run. Zero,
+ * the default, is the number of hardware threads.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Zero on success
+ */
+int cbmapper_set_threads(struct cbmapper_ctx *cbm, int threads);
+
+/**
+ * @brief Sets the share of the flows of the next cbmapper_run that match no
+ * rule, between 0 and 1. Zero by default.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Zero on success
+ */
+int cbmapper_set_miss_ratio(struct cbmapper_ctx *cbm, double ratio);
+
+/**
+ * @brief Sets whether the next cbmapper_run generates exactly the requested
+ * number of flows, by redistributing the flows of rules that cannot reach
+ * their share. Off by default.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Zero on success
+ */
+int cbmapper_set_exact_flows(struct cbmapper_ctx *cbm, int exact);
+
+/**
+ * @brief Divides the flows of the next cbmapper_run between the rules by
+ * "weights", one non-negative weight per rule. Copied by this. Set to NULL
+ * for a uniform division, the default.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Zero on success
+ */
+int cbmapper_set_rule_weights(struct cbmapper_ctx *cbm,
+                              const double *weights);
+
+/**
+ * @brief Generates "flow_num" headers with random seed "seed", replacing
+ * the headers of earlier runs. Internally parallel; calls on cbmapper
+ * objects must not overlap.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - -EAGAIN in case of internal error
+ *  - Zero on success
+ */
+int cbmapper_run(struct cbmapper_ctx *cbm, uint64_t flow_num, int seed);
+
+/**
+ * @brief Returns the number of headers the last cbmapper_run generated.
+ */
+size_t cbmapper_get_header_num(struct cbmapper_ctx *cbm);
+
+/**
+ * @brief Copies headers "first" ... "first+num-1" of the last cbmapper_run,
+ * grouped by rule with the headers that match no rule last.
+ * @param headers Preallocated memory for "num" headers of F values each,
+ * or NULL.
+ * @param rules Preallocated memory for the matching rule index per header,
+ * or CBMAPPER_MISS for headers that match no rule, or NULL.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Non-negative number in case of success. Number of copied headers,
+ *    fewer than "num" past the last header.
+ */
+int64_t cbmapper_get_headers(struct cbmapper_ctx *cbm,
+                             size_t first,
+                             size_t num,
+                             uint32_t *headers,
+                             uint32_t *rules);
+
+/**
+ * @brief Writes the rules and the headers of the last cbmapper_run to the
+ * binary file "filename", to be read by libcbreader.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - -EAGAIN in case of internal error
+ *  - Zero on success
+ */
+int cbmapper_write_binary(struct cbmapper_ctx *cbm, const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CBMAPPER_H */
@@ -1,7 +1,9 @@
 #include <atomic>
 #include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <exception>
+#include "perf-counters.h"
 #include "reader.h"
 
 #define EXPORT extern "C" __attribute__((visibility("default")))
@@ -19,6 +21,8 @@ struct cbreader {
     std::atomic<int> readers_v0;
     std::atomic<int> readers_v1;
     std::atomic<int> readers_v2;
+    /* Headers below this out of 2^32 are drawn from the misses */
+    std::atomic<uint64_t> miss_threshold;
 };
 
 /* Returns the pending set for updateing the rules. Must be in sync. */
@@ -87,6 +91,7 @@ cbreader_init(const char *filename, int seed)
         out = new cbreader;
         out->rdr.read(filename);
         out->version.store(0);
+        out->miss_threshold.store(0);
         random_core::set_seed(seed);
         return out;
     } catch (std::exception &e) {
@@ -155,6 +160,15 @@ cbreader_get_rule(cbreader *cbr, size_t idx, uint32_t *data, int *prio)
     }
 }
 
+EXPORT double
+cbreader_get_rule_weight(cbreader *cbr, size_t idx)
+{
+    if (!cbr || idx >= cbr->rdr.get_rule_num()) {
+        return -EINVAL;
+    }
+    return cbr->rdr.get_rule_weight(idx);
+}
+
 EXPORT int
 cbreader_prepare_rules(cbreader *cbr, int num_rules, uint32_t *data)
 {
@@ -288,7 +302,8 @@ cbreader_select_headers(cbreader *cbr,
                         const uint32_t **hdr_data,
                         uint32_t *results)
 {
-    int idx, rule_idx, hdr_idx, counter;
+    int idx, rule_idx, counter;
+    int64_t hdr_idx;
 
     if (!cbr) {
         return -EINVAL;
@@ -301,8 +316,18 @@ cbreader_select_headers(cbreader *cbr,
             return 0;
         }
 
+        uint64_t miss_threshold = cbr->rdr.get_miss_num() ?
+                                  cbr->miss_threshold.load() : 0;
         counter = 0;
         for (int i=0; i<hdr_num; ++i) {
+            if (miss_threshold &&
+                random_core::random_uint32() < miss_threshold) {
+                hdr_data[counter] = cbr->rdr.get_header(
+                                        cbr->rdr.get_miss_index());
+                results[counter] = reader::MISS_RULE_ID;
+                counter++;
+                continue;
+            }
             idx = random_core::random_uint32() % avaialble_rules.size();
             rule_idx = avaialble_rules[idx];
             hdr_idx = cbr->rdr.get_header_index(rule_idx);
@@ -310,8 +335,7 @@ cbreader_select_headers(cbreader *cbr,
                 continue;
             }
 
-            const reader::header &hdr = cbr->rdr.get_header(hdr_idx);
-            hdr_data[counter] = (const uint32_t*)&hdr[0];
+            hdr_data[counter] = cbr->rdr.get_header(hdr_idx);
             results[counter] = rule_idx;
             counter++;
         }
@@ -324,6 +348,86 @@ cbreader_select_headers(cbreader *cbr,
     }
 }
 
+EXPORT int
+cbreader_lookup_header(cbreader *cbr, const uint32_t *hdr, uint32_t *rule)
+{
+    if (!cbr || !hdr || !rule) {
+        return -EINVAL;
+    }
+    if (!cbr->rdr.has_header_hash()) {
+        return -ENOTSUP;
+    }
+    if (!cbr->rdr.lookup_header(hdr, *rule)) {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+EXPORT int
+cbreader_set_miss_ratio(cbreader *cbr, double ratio)
+{
+    if (!cbr || !(ratio >= 0 && ratio <= 1)) {
+        return -EINVAL;
+    }
+    cbr->miss_threshold.store(ratio * 4294967296.0);
+    return 0;
+}
+
+/* As "struct cbreader_benchmark" of cbreader.h */
+struct cbreader_benchmark {
+    uint64_t headers;
+    double seconds;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t llc_misses;
+    uint64_t branch_misses;
+};
+
+EXPORT int
+cbreader_benchmark_select(cbreader *cbr,
+                          int batch,
+                          int rounds,
+                          cbreader_benchmark *out)
+{
+    if (!cbr || batch <= 0 || rounds < 0 || !out) {
+        return -EINVAL;
+    }
+    try {
+        std::vector<const uint32_t*> hdr_data(batch);
+        std::vector<uint32_t> results(batch);
+        perf_counters counters(false);
+        perf_counters::sample first, last, delta;
+        uint64_t headers = 0;
+
+        counters.read(first);
+        auto start = std::chrono::steady_clock::now();
+        for (int r=0; r<rounds; ++r) {
+            int num = cbreader_select_headers(cbr, batch, hdr_data.data(),
+                                              results.data());
+            if (num < 0) {
+                return num;
+            }
+            headers += num;
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        counters.read(last);
+        perf_counters::difference(first, last, delta);
+
+        out->headers = headers;
+        out->seconds = elapsed.count();
+        out->cycles = delta.values[perf_counters::CYCLES];
+        out->instructions = delta.values[perf_counters::INSTRUCTIONS];
+        out->llc_misses = delta.values[perf_counters::LLC_MISSES];
+        out->branch_misses = delta.values[perf_counters::BRANCH_MISSES];
+        return 0;
+    } catch (std::exception &e) {
+        free((void*)msg);
+        msg = strdup(e.what());
+        return -EAGAIN;
+    }
+}
+
 EXPORT int
 cbreader_search_rule(cbreader *cbr, int rule_id)
 {
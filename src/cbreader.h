@@ -23,6 +23,22 @@ extern "C" {
 
 struct cbreader;
 
+/* The matching rule index of headers that match no rule */
+#define CBREADER_MISS 0xffffffffu
+
+/* The value of hardware counters that are not available */
+#define CBREADER_NO_COUNTER UINT64_MAX
+
+/* Results of cbreader_benchmark_select */
+struct cbreader_benchmark {
+    uint64_t headers;       /* Headers selected */
+    double seconds;         /* Wall time */
+    uint64_t cycles;        /* Hardware counters of the calling thread, */
+    uint64_t instructions;  /* in user space, or CBREADER_NO_COUNTER */
+    uint64_t llc_misses;
+    uint64_t branch_misses;
+};
+
 /**
  * @brief Returns a string representation of the last library error.
  */
@@ -73,6 +89,13 @@ int cbreader_get_rule(struct cbreader *cbr,
                       uint32_t *data,
                       int *prio);
 
+/**
+ * @brief Returns the normalized weight of rule "idx" in the flow distribution
+ * the file was generated with (1/N for uniform files with N rules), or a
+ * negative number in case of invalid arguments.
+ */
+double cbreader_get_rule_weight(struct cbreader *cbr, size_t idx);
+
 /**
  * @brief Select rules for insertion in the next classifier update.
  * Only a single writer thread may call this method.
@@ -133,7 +156,8 @@ int cbreader_update(struct cbreader *cbr);
  * each with F fields (F = cbreader_get_field_num(cbr)).
  * @param results Preallocated memory for holding the result. Must contain
  * "hdr_num" elements. This method populates "results" with the matching rule
- * index per generated header.
+ * index per generated header, or CBREADER_MISS for headers that match no rule
+ * (see cbreader_set_miss_ratio).
  * @returns
  *  - -EINVAL in case of invalid arguments
  *  - -EAGAIN in case of internal error
@@ -144,6 +168,50 @@ int cbreader_select_headers(struct cbreader *cbr,
                             const uint32_t **hdr_data,
                             uint32_t *results);
 
+/**
+ * @brief Finds the matching rule index of header "hdr", F values (F =
+ * cbreader_get_field_num(cbr)), in constant time by the minimal perfect hash
+ * the file holds. Thread safe.
+ * @param rule Set by this. The matching rule index, or CBREADER_MISS for
+ * headers that match no rule.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - -ENOTSUP if the file holds no header hash
+ *  - -ENOENT if "hdr" is not a header of the file
+ *  - Zero on success
+ */
+int cbreader_lookup_header(struct cbreader *cbr,
+                           const uint32_t *hdr,
+                           uint32_t *rule);
+
+/**
+ * @brief Sets the share of the headers that cbreader_select_headers draws
+ * from the headers that match no rule, between 0 and 1. Zero by default.
+ * Ignored when the file holds no such headers.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - Zero on success
+ */
+int cbreader_set_miss_ratio(struct cbreader *cbr, double ratio);
+
+/**
+ * @brief Calls cbreader_select_headers "rounds" times with "batch" headers
+ * each, and measures the loop with the hardware performance counters of the
+ * calling thread (cycles, instructions, last-level cache misses and branch
+ * mispredictions), by perf_event_open(2). Counters that cannot be opened,
+ * e.g., due to perf_event_paranoid, are set to CBREADER_NO_COUNTER. Thread
+ * safe, as cbreader_select_headers.
+ * @param out Set by this. The results of the loop.
+ * @returns
+ *  - -EINVAL in case of invalid arguments
+ *  - -EAGAIN in case of internal error
+ *  - Zero on success
+ */
+int cbreader_benchmark_select(struct cbreader *cbr,
+                              int batch,
+                              int rounds,
+                              struct cbreader_benchmark *out);
+
 /**
  * @brief Search "rule_id" in one of "cbr"'s internal data structues.
  * Returns a bit-mask with the data structure indices that hold "rule-id".
@@ -0,0 +1,242 @@
+#ifndef EXTERNAL_SORT_H
+#define EXTERNAL_SORT_H
+
+#include <cstdio>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "errorf.h"
+#include "ruleset.h"
+
+namespace cbmapper {
+
+/**
+ * @brief Sorts and deduplicates packet headers that do not fit in memory.
+ * Headers are added as sorted, duplicate-free runs that are written to
+ * temporary files; "merge" reads the runs back in order and removes
+ * duplicates between them.
+ * @tparam F Number of fields
+ */
+template <int F>
+class external_sorter {
+
+    using packet_hdr = packet_header<F>;
+
+    /* Headers per read buffer of a run during the merge */
+    static constexpr size_t READ_BUFFER = 1 << 14;
+
+    struct run_reader {
+        FILE *file;
+        std::vector<packet_hdr> buffer;
+        size_t position;
+
+        /* Returns false once the run is exhausted */
+        bool
+        fill()
+        {
+            buffer.resize(READ_BUFFER);
+            size_t count = fread(buffer.data(), sizeof(packet_hdr),
+                                 buffer.size(), file);
+            buffer.resize(count);
+            position = 0;
+            return count > 0;
+        }
+    };
+
+    std::string prefix;
+    std::vector<std::string> runs;
+    size_t header_num;
+
+public:
+
+    /**
+     * @brief Creates a new sorter whose run files are named "prefix.N"
+     */
+    external_sorter(const std::string &prefix)
+    : prefix(prefix),
+      header_num(0)
+    {}
+
+    ~external_sorter()
+    {
+        for (auto &name : runs) {
+            remove(name.c_str());
+        }
+    }
+
+    /**
+     * @brief Returns the number of headers in all runs, with duplicates
+     * between runs
+     */
+    size_t
+    size() const
+    {
+        return header_num;
+    }
+
+    /**
+     * @brief Writes [first, last), which must be sorted and free of
+     * duplicates, as a new run.
+     */
+    void
+    add_run(const packet_hdr *first, const packet_hdr *last)
+    {
+        std::string name = prefix + "." + std::to_string(runs.size());
+        FILE *file = fopen(name.c_str(), "wb");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.", name.c_str());
+        }
+        runs.push_back(name);
+        size_t count = last - first;
+        if (fwrite(first, sizeof(packet_hdr), count, file) != count) {
+            fclose(file);
+            throw errorf("cannot write to \"%s\".", name.c_str());
+        }
+        fclose(file);
+        header_num += count;
+    }
+
+    /**
+     * @brief Invokes "fn(hdr)" for each distinct header of all runs, in
+     * ascending order. Deletes the runs.
+     */
+    template <typename Fn>
+    void
+    merge(Fn fn)
+    {
+        std::vector<run_reader> readers(runs.size());
+        using entry = std::pair<packet_hdr, size_t>;
+        std::priority_queue<entry, std::vector<entry>, std::greater<entry>>
+            heap;
+
+        for (size_t r=0; r<runs.size(); ++r) {
+            readers[r].file = fopen(runs[r].c_str(), "rb");
+            if (!readers[r].file) {
+                throw errorf("cannot open \"%s\" for reading.",
+                             runs[r].c_str());
+            }
+            if (readers[r].fill()) {
+                heap.push({readers[r].buffer[0], r});
+            }
+        }
+
+        bool any = false;
+        packet_hdr previous{};
+        while (!heap.empty()) {
+            entry top = heap.top();
+            heap.pop();
+            if (!any || top.first != previous) {
+                fn(top.first);
+                previous = top.first;
+                any = true;
+            }
+            run_reader &rdr = readers[top.second];
+            if (++rdr.position < rdr.buffer.size() || rdr.fill()) {
+                heap.push({rdr.buffer[rdr.position], top.second});
+            }
+        }
+
+        for (size_t r=0; r<runs.size(); ++r) {
+            fclose(readers[r].file);
+            remove(runs[r].c_str());
+        }
+        runs.clear();
+        header_num = 0;
+    }
+};
+
+/**
+ * @brief A temporary file of 32-bit words that is written in pieces, read
+ * back once in order, and removed when closed or destroyed, also when an
+ * error unwinds past it. Write errors, e.g., of a full disk, throw.
+ */
+class spool_file {
+
+    std::string name;
+    FILE *file;
+
+public:
+
+    spool_file()
+    : file(nullptr)
+    {}
+
+    ~spool_file()
+    {
+        close();
+    }
+
+    spool_file(const spool_file&) = delete;
+    spool_file& operator=(const spool_file&) = delete;
+
+    /**
+     * @brief Creates (or truncates) "filename"
+     */
+    void
+    open(const std::string &filename)
+    {
+        close();
+        file = fopen(filename.c_str(), "w+b");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.", filename.c_str());
+        }
+        name = filename;
+    }
+
+    bool
+    is_open() const
+    {
+        return file != nullptr;
+    }
+
+    /**
+     * @brief Appends "count" words of "data"
+     */
+    void
+    write(const uint32_t *data, size_t count)
+    {
+        if (fwrite(data, sizeof(uint32_t), count, file) != count) {
+            throw errorf("cannot write to \"%s\".", name.c_str());
+        }
+    }
+
+    /**
+     * @brief Invokes "fn(data, bytes)" on the contents of the file in
+     * order, in pieces of up to 1 MB that hold whole units of "unit" bytes
+     */
+    template <typename Fn>
+    void
+    read_all(Fn fn, size_t unit = 1)
+    {
+        if (fflush(file) || fseek(file, 0, SEEK_SET)) {
+            throw errorf("cannot write to \"%s\".", name.c_str());
+        }
+        std::vector<char> buffer((1 << 20) / unit * unit);
+        size_t bytes;
+        while ((bytes = fread(buffer.data(), 1, buffer.size(), file)) > 0) {
+            fn(buffer.data(), bytes);
+        }
+        if (ferror(file)) {
+            throw errorf("cannot read from \"%s\".", name.c_str());
+        }
+    }
+
+    /**
+     * @brief Closes and removes the file
+     */
+    void
+    close()
+    {
+        if (!file) {
+            return;
+        }
+        fclose(file);
+        file = nullptr;
+        remove(name.c_str());
+    }
+};
+
+};
+
+#endif /* EXTERNAL_SORT_H */
@@ -0,0 +1,131 @@
+#ifndef HEADER_HASH_H
+#define HEADER_HASH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "memory.h"
+#include "ruleset.h"
+
+namespace cbmapper {
+
+/**
+ * @brief Returns a 64-bit hash of "hdr". The per-field products are
+ * independent, so the compiler can compute them with SIMD multiplies.
+ */
+template <int F>
+static inline uint64_t
+header_hash(const packet_header<F> &hdr)
+{
+    static constexpr uint64_t mult[8] = {
+        0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+        0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL,
+        0x85ebca77c2b2ae63ULL, 0x27d4eb2f165667c5ULL
+    };
+    uint64_t h = F;
+    for (int f=0; f<F; ++f) {
+        h += ((uint64_t)hdr[f] + f + 1) * mult[f % 8];
+    }
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 32);
+}
+
+/**
+ * @brief An open-addressing (linear probing) set of packet headers. The set
+ * does not own the headers; it holds indices into a header array that the
+ * caller provides on each operation. Meant to be reused between calls, e.g.
+ * one per thread.
+ */
+template <int F>
+class header_hash_set {
+
+    struct slot {
+        /* Upper hash bits, for cheap mismatch detection */
+        uint32_t tag;
+        /* Header index + 1; zero means an empty slot */
+        uint32_t index;
+    };
+
+    std::vector<slot, counting_allocator<slot, MEMORY_DEDUPE_SETS>> slots;
+    size_t mask;
+
+public:
+
+    header_hash_set()
+    : mask(0)
+    {}
+
+    /**
+     * @brief Clears this and makes room for at least "capacity" headers.
+     */
+    void
+    reset(size_t capacity)
+    {
+        size_t size = 16;
+        while (size < capacity * 2) {
+            size <<= 1;
+        }
+        if (slots.size() < size) {
+            slots.resize(size);
+        }
+        /* Only the prefix in use is cleared; larger old tables are kept */
+        mask = size - 1;
+        std::fill(slots.begin(), slots.begin() + size, slot{0, 0});
+    }
+
+    /**
+     * @brief Inserts "base[idx]" to this. Returns false if an identical
+     * header was already inserted.
+     */
+    bool
+    insert(const packet_header<F> *base, uint32_t idx)
+    {
+        const packet_header<F> &hdr = base[idx];
+        uint64_t h = header_hash<F>(hdr);
+        uint32_t tag = h >> 32;
+        size_t pos = h & mask;
+        while (slots[pos].index) {
+            if (slots[pos].tag == tag && base[slots[pos].index-1] == hdr) {
+                return false;
+            }
+            pos = (pos + 1) & mask;
+        }
+        slots[pos].tag = tag;
+        slots[pos].index = idx + 1;
+        return true;
+    }
+};
+
+/**
+ * @brief Removes duplicate headers from [first, last) in place using "set".
+ * Keeps the first occurrence of each header, in insertion order.
+ * @returns The new end of the range.
+ */
+template <int F>
+static packet_header<F> *
+dedupe_headers(packet_header<F> *first,
+               packet_header<F> *last,
+               header_hash_set<F> &set)
+{
+    size_t size = last - first;
+    size_t out = 0;
+    set.reset(size);
+    for (size_t i=0; i<size; ++i) {
+        /* The kept headers are moved below "i", so indices of headers that
+         * are already in the set stay valid */
+        if (out != i) {
+            first[out] = first[i];
+        }
+        if (set.insert(first, out)) {
+            out++;
+        }
+    }
+    return first + out;
+}
+
+};
+
+#endif /* HEADER_HASH_H */
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <list>
 #include <vector>
+#include "memory.h"
 #include "random.h"
 
 namespace cbmapper {
@@ -20,7 +23,10 @@ class integer_interval_set {
         {}
     };
 
-    std::list<range> intervals;
+    using range_list = std::list<range,
+        counting_allocator<range, MEMORY_INTERVAL_SETS>>;
+
+    range_list intervals;
 
     /**
      * @brief Initiate empty list
@@ -55,7 +61,7 @@ public:
         uint32_t left_cursor = low;
         uint32_t right_cursor = high;
         uint32_t maximum = high;
-        std::list<range>::iterator it;
+        range_list::iterator it;
 
         for (it = intervals.begin(); it != intervals.end(); ++it) {
             range& r = *it;
@@ -114,6 +120,19 @@ public:
         return val;
     }
 
+    /**
+     * @brief Invokes "fn(low, high)" for each interval in this, in
+     * ascending order.
+     */
+    template <typename Fn>
+    void
+    for_each(Fn fn) const
+    {
+        for (const range &r : intervals) {
+            fn(r.low, r.high);
+        }
+    }
+
     /**
      * @brief Returns the number of intervals in this
      */
@@ -150,4 +169,234 @@ public:
     }
 };
 
-};
\ No newline at end of file
+/**
+ * @brief A set of disjoint boxes in F dimensions, each an inclusive integer
+ * interval per dimension. Boxes are either exact, or partial boxes that
+ * hold points outside of the set as well.
+ * @tparam F Number of dimensions
+ */
+template <int F>
+class integer_box_set {
+public:
+    using box = std::array<std::array<uint32_t, 2>, F>;
+
+private:
+
+    std::vector<box> boxes;
+    std::vector<char> exact;
+    size_t exact_num;
+    /* Dimensions in splitting order */
+    std::array<int, F> order;
+    bool truncated;
+    size_t max_boxes;
+    size_t work_left;
+
+    /**
+     * @brief Returns true iff "cover" holds "b" in the dimensions from
+     * "order[level]" on
+     */
+    bool
+    holds(const box &cover, const box &b, int level) const
+    {
+        for (; level<F; ++level) {
+            int d = order[level];
+            if (cover[d][0] > b[d][0] || cover[d][1] < b[d][1]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Adds the part of "b" that none of "covers[ids]" holds. All
+     * "covers[ids]" intersect "b" and hold it in the dimensions before
+     * "order[level]". Dimension "order[level]" is split into the intervals
+     * no cover holds, which are added as is, and elementary intervals that
+     * some covers hold, which are split further by the next dimension.
+     */
+    void
+    subtract(const box &b,
+             const std::vector<box> &covers,
+             const std::vector<size_t> &ids,
+             int level)
+    {
+        if (ids.empty()) {
+            add(b, true);
+            return;
+        }
+        for (size_t id : ids) {
+            if (holds(covers[id], b, level)) {
+                return;
+            }
+        }
+        if (exact_num >= max_boxes || !work_left) {
+            truncated = true;
+            add(b, false);
+            return;
+        }
+        work_left--;
+        int d = order[level];
+
+        integer_interval_set free(b[d][0], b[d][1]);
+        std::vector<uint32_t> bounds(1, b[d][0]);
+        for (size_t id : ids) {
+            uint32_t lo = std::max(covers[id][d][0], b[d][0]);
+            uint32_t hi = std::min(covers[id][d][1], b[d][1]);
+            free.remove(lo, hi);
+            bounds.push_back(lo);
+            if (hi < b[d][1]) {
+                bounds.push_back(hi + 1);
+            }
+        }
+        free.for_each([&] (uint32_t lo, uint32_t hi) {
+            box g = b;
+            g[d] = {lo, hi};
+            add(g, true);
+        });
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        /* Sweep the elementary intervals, keeping the covers that hold the
+         * current one */
+        std::vector<size_t> order = ids;
+        std::sort(order.begin(), order.end(), [&] (size_t x, size_t y) {
+            return covers[x][d][0] < covers[y][d][0] ||
+                   (covers[x][d][0] == covers[y][d][0] && x < y);
+        });
+        std::vector<size_t> active;
+        size_t next = 0;
+        for (size_t k=0; k<bounds.size(); ++k) {
+            uint32_t lo = bounds[k];
+            uint32_t hi = (k+1 < bounds.size()) ? bounds[k+1] - 1 : b[d][1];
+            while (next < order.size() &&
+                   std::max(covers[order[next]][d][0], b[d][0]) <= lo) {
+                active.push_back(order[next++]);
+            }
+            active.erase(std::remove_if(active.begin(), active.end(),
+                         [&] (size_t id) {
+                return covers[id][d][1] < lo;
+            }), active.end());
+            if (active.empty()) {
+                continue;
+            }
+            std::vector<size_t> sub = active;
+            std::sort(sub.begin(), sub.end());
+            box g = b;
+            g[d] = {lo, hi};
+            subtract(g, covers, sub, level + 1);
+        }
+    }
+
+    void
+    add(const box &b, bool is_exact)
+    {
+        boxes.push_back(b);
+        exact.push_back(is_exact);
+        exact_num += is_exact;
+    }
+
+public:
+
+    integer_box_set()
+    : exact_num(0),
+      truncated(false)
+    {}
+
+    /**
+     * @brief Returns the part of the whole domain that none of "covers"
+     * holds, as disjoint boxes. Once "max_boxes" exact boxes are found or
+     * "max_work" boxes are split, the boxes left are added as partial boxes
+     * without splitting them further, and "is_truncated()" is set.
+     */
+    static integer_box_set
+    complement(const std::vector<box> &covers,
+               size_t max_boxes,
+               size_t max_work)
+    {
+        integer_box_set out;
+        out.max_boxes = max_boxes;
+        out.work_left = max_work;
+        box all;
+        for (int d=0; d<F; ++d) {
+            all[d] = {0, 0xffffffff};
+        }
+        std::vector<size_t> ids(covers.size());
+        for (size_t i=0; i<ids.size(); ++i) {
+            ids[i] = i;
+        }
+
+        /* Dimensions with fewer distinct bounds split into fewer boxes */
+        std::array<size_t, F> distinct;
+        std::vector<uint32_t> bounds;
+        for (int d=0; d<F; ++d) {
+            bounds.clear();
+            for (const box &c : covers) {
+                bounds.push_back(c[d][0]);
+                bounds.push_back(c[d][1]);
+            }
+            std::sort(bounds.begin(), bounds.end());
+            distinct[d] = std::unique(bounds.begin(), bounds.end()) -
+                          bounds.begin();
+            out.order[d] = d;
+        }
+        std::stable_sort(out.order.begin(), out.order.end(),
+        [&] (int a, int b) {
+            return distinct[a] < distinct[b];
+        });
+        out.subtract(all, covers, ids, 0);
+        return out;
+    }
+
+    /**
+     * @brief Returns the number of boxes in this
+     */
+    size_t
+    size() const
+    {
+        return boxes.size();
+    }
+
+    /**
+     * @brief Returns box "idx"
+     */
+    const box&
+    operator[](size_t idx) const
+    {
+        return boxes[idx];
+    }
+
+    /**
+     * @brief Returns true iff box "idx" is exact, i.e., holds only points
+     * of the set
+     */
+    bool
+    is_exact(size_t idx) const
+    {
+        return exact[idx];
+    }
+
+    /**
+     * @brief Returns the number of points in box "idx"
+     */
+    double
+    volume(size_t idx) const
+    {
+        double out = 1;
+        for (int d=0; d<F; ++d) {
+            out *= (double)boxes[idx][d][1] - boxes[idx][d][0] + 1;
+        }
+        return out;
+    }
+
+    /**
+     * @brief Returns true iff "complement" stopped splitting early, so that
+     * some boxes are partial
+     */
+    bool
+    is_truncated() const
+    {
+        return truncated;
+    }
+};
+
+};
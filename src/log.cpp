@@ -37,17 +37,23 @@ log_fmt_msg(const char* fmt, ...)
     va_list args;
     va_start(args, fmt);
     size_t size = vsnprintf(NULL, 0, fmt, args)+1;
+    va_end(args);
     if (position + size >= MAX_LOG_SIZE) {
         size = MAX_LOG_SIZE - position - 1;
     }
     va_start(args, fmt);
     vsnprintf(buffer+position, size, fmt, args);
+    va_end(args);
     position = (position + size - 1) % MAX_LOG_SIZE;
 }
 
 void
 log_flush() {
-    log_config(buffer, NULL);
+    /* Messages of other threads may be appended to "buffer" meanwhile */
+    const std::lock_guard<std::mutex> lock(lck);
+    if (position) {
+        log_config(buffer, NULL);
+    }
     position = 0;
 }
 
@@ -7,10 +7,15 @@
 #include <atomic>
 #include <iostream>
 #include <algorithm>
+#include <chrono>
+#include <future>
+#include <cmath>
+#include <unordered_set>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <string>
 #include <pthread.h>
 
 #include "arguments.h"
@@ -18,9 +23,13 @@
 #include "integer-interval-set.h"
 #include "log.h"
 #include "mapping.h"
+#include "memory.h"
 #include "random.h"
 #include "reader.h"
 #include "ruleset.h"
+#include "shard-merge.h"
+#include "stats.h"
+#include "trace.h"
 
 using namespace std;
 using namespace cbmapper;
@@ -37,6 +46,96 @@ static arguments args[] = {
                                         "flows to generate."},
 {"out-binary",         0, 0, NULL,      "(Mode Mapping) Generate binary file "
                                         "with rule and packet header data."},
+{"keep-order",         0, 1, NULL,      "(Mode Mapping) Keep the headers of "
+                                        "each rule in generation order "
+                                        "instead of sorting them by value."},
+{"verify-report",      0, 0, NULL,      "(Mode Mapping) Write the number of "
+                                        "headers dropped by verification per "
+                                        "rule, and the rule that matched them "
+                                        "first, to this file."},
+{"stream-budget",      0, 0, "0",       "(Mode Mapping) Process the rules in "
+                                        "blocks whose headers fit in this "
+                                        "many MB, writing each block before "
+                                        "generating the next (or meanwhile, "
+                                        "see pipeline-depth). Rules that do "
+                                        "not fit alone are spilled to disk "
+                                        "next to the output file."},
+{"time-budget",        0, 0, "0",       "(Mode Mapping) Stop sampling "
+                                        "headers after this many seconds: "
+                                        "unique rules in rule order, then "
+                                        "non-unique rules with the most "
+                                        "flows first. Reports the coverage. "
+                                        "The headers sampled are still "
+                                        "deduplicated and verified, which "
+                                        "may take longer than the budget. "
+                                        "Use 0 for no limit."},
+{"coverage-report",    0, 0, NULL,      "(Mode Mapping) Write the coverage "
+                                        "of a run with a time budget (see "
+                                        "time-budget) to this file."},
+{"pipeline-depth",     0, 0, "0",       "(Mode Mapping) Write the outputs "
+                                        "on their own threads while the "
+                                        "mapping continues, with up to this "
+                                        "many blocks waiting per output in "
+                                        "streaming mode (see stream-budget). "
+                                        "Without stream-budget, only 0 and 1 "
+                                        "are valid, and 1 writes the text "
+                                        "and binary outputs concurrently. "
+                                        "Use 0 to write after the mapping."},
+{"flow-dist",          0, 0, "uniform", "(Mode Mapping) Division of the flows "
+                                        "between the rules: uniform, zipf, or "
+                                        "weights (see weight-file)."},
+{"zipf-exponent",      0, 0, "1.0",     "(Mode Mapping) Exponent of the zipf "
+                                        "flow distribution."},
+{"weight-file",        0, 0, NULL,      "(Mode Mapping) File with a "
+                                        "non-negative weight per line for "
+                                        "each rule, in rule order, for the "
+                                        "weights flow distribution."},
+{"previous-binary",    0, 0, NULL,      "(Mode Mapping) Binary file (see "
+                                        "out-binary) of a mapping of an "
+                                        "earlier version of the ruleset. Only "
+                                        "rules whose first-match region "
+                                        "changed are regenerated; the headers "
+                                        "of the other rules are reused."},
+{"checkpoint-interval",0, 0, "0",       "(Mode Mapping) Save the progress to "
+                                        "OUT.ckpt every this many seconds, "
+                                        "so that an interrupted run can be "
+                                        "resumed. Use 0 to disable."},
+{"resume",             0, 1, NULL,      "(Mode Mapping) Continue from "
+                                        "OUT.ckpt of an interrupted run with "
+                                        "the same arguments. The output is "
+                                        "identical to an uninterrupted run."},
+{"exact-flows",        0, 1, NULL,      "(Mode Mapping) Generate exactly "
+                                        "num-of-flows flows: the quota that "
+                                        "saturated, shadowed or non-unique "
+                                        "rules miss is redistributed to "
+                                        "rules with free residual space."},
+{"quota-report",       0, 0, NULL,      "(Mode Mapping) Write the requested "
+                                        "and achieved number of flows per "
+                                        "rule to this file."},
+{"adversarial",        0, 0, "0",       "(Mode Mapping) Worst-case traffic: "
+                                        "sample this many candidate headers "
+                                        "per flow and keep the ones that "
+                                        "overlap the most rules. Use 0 to "
+                                        "disable."},
+{"miss-ratio",         0, 0, "0",       "(Mode Mapping) Share of the flows, "
+                                        "between 0 and 1, that match no "
+                                        "rule. They are tagged with rule id "
+                                        "4294967295."},
+{"multi-match",        0, 1, NULL,      "(Mode Mapping) Annotate each header "
+                                        "with the number of rules it matches "
+                                        "and their indices, in a section of "
+                                        "the binary file (see out-binary)."},
+{"multi-match-top",    0, 0, "0",       "(Mode Mapping) Keep only the first "
+                                        "this many matching rules per header "
+                                        "in priority order. Use 0 to keep "
+                                        "all."},
+{"shard",              0, 0, NULL,      "(Mode Mapping) Generate only the "
+                                        "headers of shard i/N: the i-th of N "
+                                        "consecutive rule ranges, counting "
+                                        "from 0. The text outputs of the N "
+                                        "shards concatenate into the output "
+                                        "of a full run; merge their binary "
+                                        "files with mode-merge-shards."},
 // Mode OVS flows
 {"mode-ovs-flows",     0, 1, NULL,      "(Mode OVS Flows) Generate OVS flows "
                                         "script from a ruleset."},
@@ -47,13 +146,66 @@ static arguments args[] = {
 {"mode-read-binary",   0, 0, NULL,      "(Mode Read Binary) Reads a binary data"
                                         "base with rules and packet headers. "
                                         "Prints contents to stdout."},
+// Mode merge shards
+{"mode-merge-shards",  0, 0, NULL,      "(Mode Merge Shards) Merges the "
+                                        "binary files of the shards of a "
+                                        "mapping (see shard), comma "
+                                        "separated in shard order, into the "
+                                        "binary file out."},
+// Mode trace
+{"mode-trace",         0, 0, NULL,      "(Mode Trace) Generates an ordered "
+                                        "packet trace from the headers of "
+                                        "this binary file (see out-binary) "
+                                        "and writes it to out."},
+{"trace-length",       0, 0, "1000000", "(Mode Trace) Number of packets."},
+{"trace-locality",     0, 0, "burst",   "(Mode Trace) Locality model: "
+                                        "uniform, lru (stack distance) or "
+                                        "burst (ON/OFF flows). uniform and "
+                                        "burst generate well over 100M "
+                                        "packets per second per core; the "
+                                        "exact lru is several times slower "
+                                        "with deep stacks."},
+{"trace-new-flow",     0, 0, "0.1",     "(Mode Trace) lru: probability that "
+                                        "a packet starts a new flow."},
+{"trace-stack-size",   0, 0, "1024",    "(Mode Trace) lru: LRU stack depth."},
+{"trace-stack-exponent", 0, 0, "1.5",   "(Mode Trace) lru: stack depth d is "
+                                        "drawn with probability proportional "
+                                        "to d^-exponent."},
+{"trace-active-flows", 0, 0, "64",      "(Mode Trace) burst: number of "
+                                        "concurrently active flows."},
+{"trace-burst-mean",   0, 0, "16",      "(Mode Trace) burst: mean ON period "
+                                        "in packets."},
+{"trace-burst-shape",  0, 0, "1.5",     "(Mode Trace) burst: Pareto shape of "
+                                        "the ON periods."},
+// Mode read trace
+{"mode-read-trace",    0, 0, NULL,      "(Mode Read Trace) Reads a trace file "
+                                        "and prints its statistics to "
+                                        "stdout."},
 // Others
 {"ruleset",            0, 0, NULL,      "ClassBench ruleset to analyze."},
 {"seed",               0, 0, "0",       "Random seed. Use 0 for randomized "
                                         "seed."},
+{"threads",            0, 0, "0",       "Number of worker threads. Use 0 for "
+                                        "the number of hardware threads."},
 {"reverse-priorities", 0, 1, NULL,      "Reverse rule priorities; e.g., rule "
                                         "#1 will have the highest priority, "
                                         "and rule #N will have priority = 1"},
+{"stats-out",          0, 0, NULL,      "Write the time, item count and rate "
+                                        "of each phase, and the utilization "
+                                        "of the worker threads, as JSON to "
+                                        "this file, also when the run "
+                                        "fails."},
+{"memory-budget",      0, 0, "0",       "Fail as soon as the accounted "
+                                        "structures, or the resident set on "
+                                        "large allocations, would take more "
+                                        "than this many MB, with the usage "
+                                        "per structure. Use 0 for no limit."},
+{"perf-counters",      0, 1, NULL,      "Count cycles, instructions, LLC "
+                                        "misses and branch misses of each "
+                                        "phase with the hardware performance "
+                                        "counters, and print the IPC and "
+                                        "misses per kilo-instruction. Added "
+                                        "to stats-out when given."},
 {NULL,                 0, 0, NULL,      "Analyzes ClassBench ruleset files. "
                                         "Generates either a unique packet to "
                                         "match per flow, or textual file with "
@@ -183,13 +335,87 @@ ovs_flows_create(const char* filename,
     fclose(file);
 }
 
+/**
+ * @brief Reads a weight per line from "filename"
+ */
+static std::vector<double>
+read_weight_file(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        throw errorf("Cannot open \"%s\" for reading", filename);
+    }
+    std::vector<double> out;
+    double weight;
+    int status;
+    while ((status = fscanf(file, "%lf", &weight)) == 1) {
+        out.push_back(weight);
+    }
+    fclose(file);
+    if (status != EOF) {
+        throw errorf("Invalid weight in \"%s\" after %lu weights",
+                     filename, out.size());
+    }
+    return out;
+}
+
 /**
  * @brief Operate in mapping mode
  */
 void
 mode_mapping()
 {
-    mapping<F> mp;
+    mapping_options opts;
+    opts.thread_num = ARG_INTEGER(args, "threads", 0);
+    opts.keep_order = ARG_BOOL(args, "keep-order", 0);
+    opts.verify_report = ARG_STRING(args, "verify-report", NULL);
+    opts.stream_budget = (size_t)ARG_INTEGER(args, "stream-budget", 0) << 20;
+    opts.exact_flows = ARG_BOOL(args, "exact-flows", 0);
+    opts.quota_report = ARG_STRING(args, "quota-report", NULL);
+    int64_t pipeline_depth = ARG_INTEGER(args, "pipeline-depth", 0);
+    if (pipeline_depth < 0) {
+        throw errorf("pipeline-depth must not be negative.");
+    }
+    if (pipeline_depth > 1 && !opts.stream_budget) {
+        throw errorf("pipeline-depth above 1 requires stream-budget.");
+    }
+    opts.pipeline_depth = pipeline_depth;
+    opts.time_budget = ARG_DOUBLE(args, "time-budget", 0);
+    if (!(opts.time_budget >= 0)) {
+        throw errorf("time-budget must not be negative.");
+    }
+    opts.coverage_report = ARG_STRING(args, "coverage-report", NULL);
+    int64_t adversarial = ARG_INTEGER(args, "adversarial", 0);
+    if (adversarial < 0) {
+        throw errorf("adversarial must not be negative.");
+    }
+    opts.adversarial = adversarial;
+    opts.miss_ratio = ARG_DOUBLE(args, "miss-ratio", 0);
+    bool multi_match = ARG_BOOL(args, "multi-match", 0);
+    int64_t match_limit = ARG_INTEGER(args, "multi-match-top", 0);
+    if (match_limit < 0) {
+        throw errorf("multi-match-top must not be negative.");
+    }
+    opts.match_limit = match_limit;
+    if (!(opts.miss_ratio >= 0 && opts.miss_ratio <= 1)) {
+        throw errorf("miss-ratio must be between 0 and 1.");
+    }
+
+    std::string dist = ARG_STRING(args, "flow-dist", "uniform");
+    if (dist == "zipf") {
+        opts.distribution = flow_distribution::zipf;
+        opts.zipf_exponent = ARG_DOUBLE(args, "zipf-exponent", 1.0);
+    } else if (dist == "weights") {
+        const char *weight_file = ARG_STRING(args, "weight-file", NULL);
+        if (!weight_file) {
+            throw errorf("Flow distribution weights requires weight-file "
+                         "argument.");
+        }
+        opts.distribution = flow_distribution::weights;
+        opts.rule_weights = read_weight_file(weight_file);
+    } else if (dist != "uniform") {
+        throw errorf("Unknown flow distribution \"%s\".", dist.c_str());
+    }
 
     MESSAGE("Mode mapping enabled\n");
     const char* in_fname     = ARG_STRING(args, "ruleset", NULL);
@@ -202,21 +428,117 @@ mode_mapping()
         throw errorf("Mode mapping requires out argument.");
     }
 
+    const char *out_binary   = ARG_STRING(args, "out-binary", NULL);
+    const char *prev_binary  = ARG_STRING(args, "previous-binary", NULL);
+
+    double checkpoint_interval = ARG_DOUBLE(args, "checkpoint-interval", 0);
+    std::string checkpoint_name = std::string(out_filename) + ".ckpt";
+    opts.resume = ARG_BOOL(args, "resume", 0);
+    if (checkpoint_interval > 0 || opts.resume) {
+        if (opts.stream_budget || prev_binary) {
+            throw errorf("Checkpoints cannot be combined with stream-budget "
+                         "or previous-binary.");
+        }
+        opts.checkpoint = checkpoint_name.c_str();
+        opts.checkpoint_interval = checkpoint_interval > 0 ?
+                                   checkpoint_interval : HUGE_VAL;
+    }
+    if ((opts.exact_flows || opts.quota_report) &&
+        (opts.stream_budget || prev_binary)) {
+        throw errorf("exact-flows and quota-report cannot be combined with "
+                     "stream-budget or previous-binary.");
+    }
+    if (opts.adversarial > 1 && opts.stream_budget) {
+        throw errorf("adversarial cannot be combined with stream-budget.");
+    }
+    if (multi_match && opts.stream_budget) {
+        throw errorf("multi-match cannot be combined with stream-budget.");
+    }
+    if (opts.miss_ratio > 0 && (opts.stream_budget || prev_binary)) {
+        throw errorf("miss-ratio cannot be combined with stream-budget or "
+                     "previous-binary.");
+    }
+    if (opts.time_budget > 0 &&
+        (opts.stream_budget || prev_binary || opts.checkpoint ||
+         opts.exact_flows)) {
+        throw errorf("time-budget cannot be combined with stream-budget, "
+                     "previous-binary, checkpoints or exact-flows.");
+    }
+    const char *shard = ARG_STRING(args, "shard", NULL);
+    if (shard) {
+        unsigned long index, num;
+        char end;
+        if (sscanf(shard, "%lu/%lu%c", &index, &num, &end) != 2 ||
+            index >= num) {
+            throw errorf("shard must be i/N with 0 <= i < N, got \"%s\".",
+                         shard);
+        }
+        if (opts.stream_budget || prev_binary || opts.checkpoint ||
+            opts.exact_flows || opts.quota_report || opts.adversarial > 1 ||
+            opts.miss_ratio > 0 || multi_match) {
+            throw errorf("shard cannot be combined with stream-budget, "
+                         "previous-binary, checkpoints, exact-flows, "
+                         "quota-report, adversarial, miss-ratio or "
+                         "multi-match.");
+        }
+        opts.shard_index = index;
+        opts.shard_num = num;
+    }
+    mapping<F> mp(opts);
+
     bool reverse = ARG_BOOL(args, "reverse-priorities", 0);
     MESSAGE("Reading ruleset from \"%s\"...\n", in_fname);
+    scoped_timer read_timer("read_ruleset");
     ruleset<F> rule_db = ruleset_read_classbench_file(in_fname, reverse);
+    read_timer.add_items(rule_db.size());
+    read_timer.stop();
 
-    int num_of_flows = ARG_INTEGER(args, "num-of-flows", 0);
+    int64_t num_of_flows = ARG_INTEGER(args, "num-of-flows", 0);
+    if (num_of_flows < 0) {
+        throw errorf("Number of flows must not be negative.");
+    }
 
     // Generate mapping
-    mp.run(rule_db, num_of_flows);
-
-    mp.save_text_mapping(out_filename);
+    if (prev_binary) {
+        if (opts.stream_budget) {
+            throw errorf("previous-binary cannot be combined with "
+                         "stream-budget.");
+        }
+        MESSAGE("Reading previous mapping from \"%s\"...\n", prev_binary);
+        reader prev;
+        scoped_timer read_timer("read_binary");
+        prev.read(prev_binary);
+        read_timer.add_items(prev.get_header_num());
+        read_timer.stop();
+        mp.run_incremental(rule_db, num_of_flows, prev);
+    } else if (opts.stream_budget) {
+        mp.run_streaming(rule_db, num_of_flows, out_filename, out_binary);
+        return;
+    } else {
+        mp.run(rule_db, num_of_flows);
+    }
+    if (multi_match) {
+        mp.annotate_matches();
+    }
 
-    const char *out_binary   = ARG_STRING(args, "out-binary", NULL);
-    if (out_binary) {
-        mp.save_binary_format(out_binary);
+    auto save_binary = [&] {
+        if (out_binary && opts.shard_num) {
+            mp.save_shard_binary(out_binary);
+        } else if (out_binary) {
+            mp.save_binary_format(out_binary);
+        }
+    };
+    // The outputs only read the mapping, so they are written concurrently
+    if (out_binary && opts.pipeline_depth) {
+        std::future<void> binary = std::async(std::launch::async,
+                                              save_binary);
+        mp.save_text_mapping(out_filename);
+        binary.get();
+    } else {
+        mp.save_text_mapping(out_filename);
+        save_binary();
     }
+    mp.remove_checkpoint();
 }
 
 /**
@@ -236,7 +558,10 @@ mode_ovs_flows()
 
     bool reverse = ARG_BOOL(args, "reverse-priorities", 0);
     MESSAGE("Reading ruleset from \"%s\"...\n", in_fname);
+    scoped_timer read_timer("read_ruleset");
     ruleset<F> rule_db = ruleset_read_classbench_file(in_fname, reverse);
+    read_timer.add_items(rule_db.size());
+    read_timer.stop();
 
     bool full_action = ARG_BOOL(args, "full-action", 0);
 
@@ -252,11 +577,21 @@ mode_read_binary()
         throw errorf("Filename was not proiveded.");
     }
     reader rdr;
+    scoped_timer read_timer("read_binary");
     rdr.read(name);
+    read_timer.add_items(rdr.get_header_num());
+    read_timer.stop();
     std::cout << "Rules: " << rdr.get_rule_num()
               << " fields: " << rdr.get_field_num()
               << " headers: " << rdr.get_header_num()
               << std::endl;
+    const reader::shard_info &shard = rdr.get_shard_info();
+    if (shard.num) {
+        std::cout << "Shard " << shard.index << " of " << shard.num
+                  << ": rules " << shard.first_rule << " to "
+                  << shard.first_rule + rdr.get_rule_num()
+                  << " of " << shard.rule_num << std::endl;
+    }
 
     std::cout << "Rule Table:" << std::endl;
     for (size_t i=0; i<rdr.get_rule_num(); ++i) {
@@ -265,21 +600,180 @@ mode_read_binary()
         for (int f=0; f<rdr.get_field_num(); ++f) {
             std::cout << r[f][0] << "-" << r[f][1] << " ";
         }
-        std::cout << "prio: " << rdr.get_rule_prio(i) << std::endl;
+        std::cout << "prio: " << rdr.get_rule_prio(i);
+        if (rdr.has_rule_weights()) {
+            std::cout << " weight: " << rdr.get_rule_weight(i);
+        }
+        std::cout << std::endl;
     }
 
     std::cout << "Header Table" << std::endl;
     for (size_t i=0; i<rdr.get_header_num(); ++i) {
-        const reader::header &h = rdr.get_header(i);
+        const uint32_t *h = rdr.get_header(i);
         std::cout << "idx " << i << " matches "
                   << rdr.get_header_match(i) << " : ";
         for (int f=0; f<rdr.get_field_num(); ++f) {
             std::cout << h[f] << " ";
         }
+        if (rdr.has_header_matches()) {
+            size_t num;
+            const uint32_t *rules = rdr.get_header_matches(i, num);
+            std::cout << "overlaps " << rdr.get_header_match_count(i)
+                      << " :";
+            for (size_t k=0; k<num; ++k) {
+                std::cout << " " << rules[k];
+            }
+        }
         std::cout << std::endl;
     }
 }
 
+/**
+ * @brief Merges the binary files of shards into a single binary file
+ */
+static void
+mode_merge_shards()
+{
+    const char* list = ARG_STRING(args, "mode-merge-shards", NULL);
+    const char* out_filename = ARG_STRING(args, "out", NULL);
+    if (!list || !out_filename) {
+        throw errorf("Mode merge shards requires shard files and out "
+                     "argument.");
+    }
+    std::vector<std::string> names;
+    std::string name;
+    for (const char *c = list; ; ++c) {
+        if (*c == ',' || !*c) {
+            if (!name.empty()) {
+                names.push_back(name);
+            }
+            name.clear();
+            if (!*c) {
+                break;
+            }
+        } else {
+            name += *c;
+        }
+    }
+    shard_merger merger;
+    merger.merge(names, out_filename);
+}
+
+/**
+ * @brief Operate in trace mode
+ */
+static void
+mode_trace()
+{
+    const char* in_fname = ARG_STRING(args, "mode-trace", NULL);
+    const char* out_filename = ARG_STRING(args, "out", NULL);
+    if (!in_fname || !out_filename) {
+        throw errorf("Mode trace requires a binary file and out argument.");
+    }
+
+    trace_options opts;
+    std::string locality = ARG_STRING(args, "trace-locality", "burst");
+    if (locality == "uniform") {
+        opts.locality = trace_locality::uniform;
+    } else if (locality == "lru") {
+        opts.locality = trace_locality::lru;
+        MESSAGE("Warning: the lru locality model is exact and generates "
+                "well below 100M packets per second per core with deep "
+                "stacks; use burst for multi-billion-packet traces.\n");
+    } else if (locality == "burst") {
+        opts.locality = trace_locality::burst;
+    } else {
+        throw errorf("Unknown trace locality \"%s\".", locality.c_str());
+    }
+    opts.new_flow_prob = ARG_DOUBLE(args, "trace-new-flow", 0.1);
+    opts.stack_size = ARG_INTEGER(args, "trace-stack-size", 1024);
+    opts.stack_exponent = ARG_DOUBLE(args, "trace-stack-exponent", 1.5);
+    opts.active_flows = ARG_INTEGER(args, "trace-active-flows", 64);
+    opts.burst_mean = ARG_DOUBLE(args, "trace-burst-mean", 16);
+    opts.burst_shape = ARG_DOUBLE(args, "trace-burst-shape", 1.5);
+    int64_t length = ARG_INTEGER(args, "trace-length", 0);
+    if (length < 0) {
+        throw errorf("Trace length must not be negative.");
+    }
+
+    MESSAGE("Reading headers from \"%s\"...\n", in_fname);
+    reader rdr;
+    scoped_timer read_timer("read_binary");
+    rdr.read(in_fname);
+    read_timer.add_items(rdr.get_header_num());
+    read_timer.stop();
+    size_t field_num = rdr.get_field_num();
+
+    trace_generator gen(opts, rdr.get_header_num(), random_core::get_seed());
+    trace_writer writer;
+    writer.open(out_filename, field_num, rdr.get_header_num(),
+    [&] (uint64_t i, uint32_t *record) {
+        const uint32_t *hdr = rdr.get_header(i);
+        std::copy(hdr, hdr + field_num, record);
+        record[field_num] = rdr.get_header_match(i);
+    });
+
+    /* Generation is timed apart from writing */
+    std::vector<uint32_t> buffer(1 << 20);
+    std::chrono::duration<double> gen_time(0);
+    for (int64_t done=0; done<length; ) {
+        size_t n = std::min<int64_t>(buffer.size(), length - done);
+        scoped_timer gen_timer("trace_generate", n);
+        auto start = std::chrono::steady_clock::now();
+        gen.generate(buffer.data(), n);
+        gen_time += std::chrono::steady_clock::now() - start;
+        gen_timer.stop();
+        scoped_timer write_timer("trace_write", n);
+        writer.write(buffer.data(), n);
+        write_timer.stop();
+        done += n;
+        print_progress("Generating trace", done / buffer.size(),
+                       (length + buffer.size() - 1) / buffer.size());
+    }
+    print_progress("Generating trace", 0, 0);
+    writer.close();
+
+    MESSAGE("Generated %ld packets in %.3f seconds (%.1f Mpps)\n",
+            length, gen_time.count(),
+            gen_time.count() > 0 ? length / gen_time.count() / 1e6 : 0.0);
+}
+
+/**
+ * @brief Prints the statistics of a trace file
+ */
+static void
+mode_read_trace()
+{
+    const char* name = ARG_STRING(args, "mode-read-trace", NULL);
+    if (!name) {
+        throw errorf("Filename was not proiveded.");
+    }
+    trace_reader rdr;
+    rdr.open(name);
+
+    std::vector<uint32_t> buffer(1 << 20);
+    std::unordered_set<uint32_t> distinct;
+    uint64_t repeats = 0;
+    uint32_t last = 0;
+    size_t n;
+    bool first = true;
+    while ((n = rdr.read(buffer.data(), buffer.size())) > 0) {
+        for (size_t i=0; i<n; ++i) {
+            distinct.insert(buffer[i]);
+            repeats += !first && buffer[i] == last;
+            last = buffer[i];
+            first = false;
+        }
+    }
+
+    uint64_t packets = rdr.get_packet_num();
+    std::cout << "Packets: " << packets
+              << " pool: " << rdr.get_pool_size()
+              << " fields: " << rdr.get_field_num() << std::endl
+              << "Distinct headers: " << distinct.size() << std::endl
+              << "Back-to-back repeats: " << repeats << std::endl;
+}
+
 /**
  * @brief Application entry point
  */
@@ -296,14 +790,50 @@ main(int argc, char** argv)
     MESSAGE("Running with seed %d\n", seed);
     random_core::set_seed(seed);
 
+    const char *stats_out = ARG_STRING(args, "stats-out", NULL);
+    bool counters = ARG_BOOL(args, "perf-counters", 0);
+    if (stats_out || counters) {
+        run_stats::enable();
+    }
+    int64_t memory_budget = ARG_INTEGER(args, "memory-budget", 0);
+    if (memory_budget < 0) {
+        MESSAGE("Error: memory budget must not be negative.\n");
+        return 1;
+    }
+    // Before any accounted allocation
+    if (stats_out || memory_budget) {
+        memory_tracker::enable((size_t)memory_budget << 20);
+    }
+    // Before any thread is created, so that the counters include them
+    std::string error;
+    if (counters && !run_stats::enable_counters(error)) {
+        MESSAGE("Hardware performance counters are not available: %s\n",
+                error.c_str());
+    }
+
+    std::string mode;
+    std::string status = "ok";
+    int result = 0;
     try {
         // Act according to mode
         if (ARG_BOOL(args, "mode-mapping", 0)) {
+            mode = "mapping";
             mode_mapping();
         } else if(ARG_BOOL(args, "mode-ovs-flows", 0)) {
+            mode = "ovs-flows";
             mode_ovs_flows();
         } else if (ARG_BOOL(args, "mode-read-binary", 0)) {
+            mode = "read-binary";
             mode_read_binary();
+        } else if (ARG_BOOL(args, "mode-merge-shards", 0)) {
+            mode = "merge-shards";
+            mode_merge_shards();
+        } else if (ARG_BOOL(args, "mode-trace", 0)) {
+            mode = "trace";
+            mode_trace();
+        } else if (ARG_BOOL(args, "mode-read-trace", 0)) {
+            mode = "read-trace";
+            mode_read_trace();
         } else {
             MESSAGE("Please specify operation mode. "
                     "Run with --help for more info.\n");
@@ -311,8 +841,26 @@ main(int argc, char** argv)
         }
     } catch (std::exception & e) {
         MESSAGE("Error: %s\n", e.what());
-        return 1;
+        status = e.what();
+        result = 1;
+    }
+
+    /* One row per message, as the table may exceed the log buffer */
+    std::string table = run_stats::counter_table();
+    for (size_t pos=0; pos<table.size(); ) {
+        size_t end = std::min(table.find('\n', pos), table.size() - 1) + 1;
+        MESSAGE("%s", table.substr(pos, end - pos).c_str());
+        pos = end;
+    }
+
+    if (stats_out) {
+        try {
+            run_stats::write_json(stats_out, mode, status);
+        } catch (std::exception & e) {
+            MESSAGE("Error: %s\n", e.what());
+            return 1;
+        }
     }
 
-    return 0;
+    return result;
 }
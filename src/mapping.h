@@ -1,25 +1,180 @@
 #ifndef MAPPING_H
 #define MAPPING_H
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
-#include <set>
-#include <map>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <numeric>
+#include <string>
 #include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
 
+#include "errorf.h"
+#include "external-sort.h"
+#include "header-hash.h"
+#include "integer-interval-set.h"
+#include "log.h"
+#include "memory.h"
+#include "overlap-index.h"
+#include "perfect-hash.h"
+#include "pipeline.h"
 #include "random.h"
+#include "reader.h"
+#include "rule-index.h"
 #include "ruleset.h"
+#include "stats.h"
+#include "text-writer.h"
+#include "thread-pool.h"
 #include "zstream.h"
 
 namespace cbmapper {
 
+/**
+ * @brief How the total number of flows is divided between the rules
+ */
+enum class flow_distribution {
+    /// Every rule gets flow_num / rule_num flows
+    uniform,
+    /// Rule weights follow a Zipf law over a random ranking of the rules
+    zipf,
+    /// Rule weights are given by mapping_options::rule_weights
+    weights
+};
+
+/**
+ * @brief Tunables of a mapping run
+ */
+struct mapping_options {
+    /// Number of threads; 0 for the number of hardware threads
+    int thread_num = 0;
+    /// Keep the headers of each rule in generation order instead of sorting
+    bool keep_order = false;
+    /// When set, the per-rule verification mismatches are written here
+    const char *verify_report = nullptr;
+    /// Memory budget in bytes for the headers of a block in streaming mode.
+    /// Rules whose headers exceed it are spilled to sorted runs on disk.
+    size_t stream_budget = 0;
+    /// Division of the flows between the rules
+    flow_distribution distribution = flow_distribution::uniform;
+    /// Exponent "s" of flow_distribution::zipf
+    double zipf_exponent = 1.0;
+    /// Non-negative weight per rule for flow_distribution::weights
+    std::vector<double> rule_weights;
+    /// When set, "run" saves its progress to this file (and a ".headers"
+    /// file next to it) at most every "checkpoint_interval" seconds
+    const char *checkpoint = nullptr;
+    double checkpoint_interval = 300;
+    /// Continue "run" from the last checkpoint
+    bool resume = false;
+    /// Top up "run" to exactly the requested number of flows (see
+    /// mapping::fill_quota)
+    bool exact_flows = false;
+    /// When set, the requested and achieved flows per rule are written here
+    const char *quota_report = nullptr;
+    /// When above 1, unique rules sample this many candidates per flow and
+    /// keep the ones that overlap the most rules (see mapping::keep_hardest)
+    size_t adversarial = 0;
+    /// Share of the flows that match no rule (see mapping::generate_misses)
+    double miss_ratio = 0;
+    /// Rules kept per header by mapping::annotate_matches, in priority
+    /// order; 0 for all of them
+    size_t match_limit = 0;
+    /// When "shard_num" is set, "run" generates only the headers of the
+    /// rules of shard "shard_index" (see mapping::shard_range)
+    size_t shard_index = 0;
+    size_t shard_num = 0;
+    /// When set, the blocks of "run_streaming" are written by text and
+    /// binary stages on their own threads while the next blocks are
+    /// generated, with up to this many blocks waiting per stage
+    size_t pipeline_depth = 0;
+    /// When above 0, "run" stops generating headers for non-unique rules
+    /// after this many seconds, and reports its coverage (see
+    /// mapping::report_coverage)
+    double time_budget = 0;
+    /// When set, the coverage of a run with a time budget is written here
+    const char *coverage_report = nullptr;
+};
+
 template <int F>
 class mapping {
 
     static constexpr int TRIES = 5;
+    /* Random stream domains, one per randomized phase. The fields take
+     * STREAM_FIELD ... STREAM_FIELD+F-1. */
+    static constexpr uint32_t STREAM_RANKING = 0;
+    static constexpr uint32_t STREAM_NON_UNIQUE = 1;
+    static constexpr uint32_t STREAM_FIELD = 2;
+    static constexpr uint32_t STREAM_MISS = STREAM_FIELD + F;
+    /* Minimal number of rule boundaries per field domain segment */
+    static constexpr size_t SEGMENT_BOUNDS = 64;
+    /* Maximal number of domain segments per field and pool thread */
+    static constexpr size_t SEGMENTS_PER_THREAD = 4;
+    /* Values per sampling chunk, the unit of parallel sampling */
+    static constexpr size_t VALUE_CHUNK = 1 << 16;
+    /* Rounds in a row without new headers after which "fill_quota" takes
+     * a rule as exhausted, and the least share of its samples a rule is
+     * assumed to keep when it is oversampled */
+    static constexpr int FILL_ROUNDS = 8;
+    static constexpr double FILL_MIN_YIELD = 0.25;
+    /* Limits of the uncovered complement: boxes, and boxes visited while
+     * splitting; the sampling rounds of the miss headers, and the least
+     * share of a round assumed to be kept */
+    static constexpr size_t MISS_MAX_BOXES = 1 << 20;
+    static constexpr size_t MISS_MAX_WORK = 1 << 24;
+    static constexpr int MISS_ROUNDS = 8;
+    static constexpr double MISS_MIN_YIELD = 0.01;
+    /* Seeds tried when building the header hash */
+    static constexpr uint32_t HASH_SEEDS = 8;
+    /* Values per block of a checkpointed run */
+    static constexpr size_t CHECKPOINT_BLOCK = 1 << 22;
+    /* Maximal number of headers per spilled run, bound by the hash set */
+    static constexpr size_t MAX_RUN_HEADERS = 1UL << 31;
+    /* Headers packed at a time when writing packet records */
+    static constexpr size_t RECORD_CHUNK = 1 << 16;
+    /* Unchanged rules between two changed ones up to which
+     * "run_incremental" generates both in one block */
+    static constexpr size_t INCREMENTAL_GAP = 1024;
     using packet_hdr = packet_header<F>;
-    using field_mapping = std::map<int, std::vector<uint32_t>>;
-    using rule_mapping = std::map<int, std::vector<packet_hdr>>;
+    using value_range = std::array<uint32_t, 2>;
+    /* Values of a single field, consecutive values per rule */
+    using field_mapping = std::vector<uint32_t,
+        counting_allocator<uint32_t, MEMORY_FIELD_VALUES>>;
+    /* Headers of a rule mapping */
+    using header_vector = std::vector<packet_hdr,
+        counting_allocator<packet_hdr, MEMORY_RULE_MAPPING>>;
+
+    /**
+     * @brief Packet headers grouped by rule index and stored contiguously.
+     * The headers of rule "i" are headers[offsets[i]] ...
+     * headers[offsets[i+1]-1].
+     */
+    struct rule_mapping {
+        header_vector headers;
+        std::vector<size_t> offsets;
+    };
+
+    /* Values "first" ... "first+count-1" of rule "rule_idx", stored from
+     * "offset" in the field values of a block */
+    struct value_chunk {
+        size_t rule_idx;
+        size_t first;
+        size_t count;
+        size_t offset;
+    };
+
+    /* A range within a field that rule "rule_idx" matches first */
+    struct exclusive_range {
+        int rule_idx;
+        uint32_t low;
+        uint32_t high;
+    };
 
     /**
      * @brief Returns true iff "rule_idx" matches "hdr"
@@ -42,34 +197,29 @@ class mapping {
     /**
      * @brief Populates "out" with a new packet. Tries to generate packet that
      * matches "rule_idx", but this might not succeed. Returns true if "out" is
-     * valid.
+     * valid. Try "i" uses words "i*F" ... "i*F+F-1" of the samples of
+     * "rule_idx" in "rng", four words per sample.
      */
     static bool
-    gen_packet(const ruleset<F>& rule_db, int rule_idx, packet_hdr &out)
+    gen_packet(const ruleset<F>& rule_db,
+               const rule_index<F>& index,
+               int rule_idx,
+               const random_counter &rng,
+               packet_hdr &out)
     {
         const rule<F>& rule = rule_db[rule_idx];
-        bool previous_match;
 
         for (int i=0; i<TRIES; ++i) {
 
             for (int j=0; j<F; ++j) {
-                out[j] = random_core::random_uint32(rule[j].low,
-                                                    rule[j].high);
-                if ((out[j] < rule[j].low) || (out[j] > rule[j].high)) {
-                    return false;
-                }
-            }
-
-            previous_match = false;
-            for (int r=0; r<rule_idx-1; ++r) {
-                if (!hdr_matches_rule(rule_db, r, out)) {
-                    continue;
-                }
-                previous_match = true;
-                break;
+                int word = i * F + j;
+                out[j] = random_counter::uniform(rng(rule_idx, word / 4,
+                                                     word % 4),
+                                                 rule[j].low, rule[j].high);
             }
 
-            if (!previous_match) {
+            /* No rule with a higher priority matches */
+            if (index.first_match(out, rule_idx) < 0) {
                 return true;
             }
         }
@@ -77,50 +227,193 @@ class mapping {
     }
 
     /**
-     * @brief Processes the rules in field "f". Generates "num" values per rule,
-     * fills "out" with results.
-    */
+     * @brief Splits the domain of field "f" into at most "max_segments"
+     * segments that hold similar numbers of rule boundaries. Returns the low
+     * value of each segment; the last segment ends at 0xffffffff.
+     */
+    static std::vector<uint32_t>
+    split_field_domain(const ruleset<F>& rule_db, int f, size_t max_segments)
+    {
+        std::vector<uint32_t> bounds;
+        bounds.reserve(rule_db.size() * 2);
+        for (size_t i=0; i<rule_db.size(); ++i) {
+            bounds.push_back(rule_db[i].fields[f].low);
+            if (rule_db[i].fields[f].high != 0xffffffff) {
+                bounds.push_back(rule_db[i].fields[f].high + 1);
+            }
+        }
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        size_t segments = std::max<size_t>(1, std::min(max_segments,
+                                           bounds.size() / SEGMENT_BOUNDS));
+        std::vector<uint32_t> out(1, 0);
+        for (size_t s=1; s<segments; ++s) {
+            uint32_t low = bounds[s * bounds.size() / segments];
+            if (low > out.back()) {
+                out.push_back(low);
+            }
+        }
+        return out;
+    }
+
+    /**
+     * @brief Subtracts the rules of field "f" from the segment [low, high] in
+     * priority order. Appends to "out" the ranges that each rule exclusively
+     * holds within the segment, ordered by rule index.
+     */
     static void
-    process_field(const ruleset<F>& rule_db,
-                  int f,
-                  int num,
-                  std::set<int> &non_unique,
-                  field_mapping &out,
-                  std::atomic<int> &percent)
+    process_segment(const ruleset<F>& rule_db,
+                    int f,
+                    uint32_t low,
+                    uint32_t high,
+                    std::vector<exclusive_range> &out)
     {
-        integer_interval_set interval(0, 0xffffffff);
-        bool can_guarantee;
+        integer_interval_set interval(low, high);
 
         for (size_t i=0; i<rule_db.size(); ++i) {
+            uint32_t lo = std::max(rule_db[i].fields[f].low, low);
+            uint32_t hi = std::min(rule_db[i].fields[f].high, high);
+            if (lo > hi) {
+                continue;
+            }
+            interval.remove(lo, hi).for_each([&](uint32_t l, uint32_t h) {
+                out.push_back({(int)i, l, h});
+            });
+        }
+    }
 
-            uint32_t lo = rule_db[i].fields[f].low;
-            uint32_t hi = rule_db[i].fields[f].high;
+    /**
+     * @brief Returns the position of rule "first" in each of "segments".
+     */
+    static std::vector<size_t>
+    seek_ranges(const std::vector<std::vector<exclusive_range>> &segments,
+                size_t first)
+    {
+        std::vector<size_t> cursor(segments.size());
+        for (size_t s=0; s<segments.size(); ++s) {
+            cursor[s] = std::lower_bound(segments[s].begin(),
+                                         segments[s].end(),
+                                         first,
+            [] (const exclusive_range &r, size_t idx) {
+                return (size_t)r.rule_idx < idx;
+            }) - segments[s].begin();
+        }
+        return cursor;
+    }
 
-            if (out.find(i) == out.end()) {
-                out[i].resize(num);
+    /**
+     * @brief Sets "ranges" to the exclusive ranges of rule "i" in domain
+     * order, and advances "cursor" (see "seek_ranges") past the rule, which
+     * must not be below the rule of the previous call. Ranges that were split
+     * by a segment boundary are merged.
+     */
+    static void
+    collect_ranges(const std::vector<std::vector<exclusive_range>> &segments,
+                   size_t i,
+                   std::vector<size_t> &cursor,
+                   std::vector<value_range> &ranges)
+    {
+        ranges.clear();
+        for (size_t s=0; s<segments.size(); ++s) {
+            const std::vector<exclusive_range> &seg = segments[s];
+            while (cursor[s] < seg.size() &&
+                   (size_t)seg[cursor[s]].rule_idx < i) {
+                ++cursor[s];
             }
+            for (; cursor[s] < seg.size() &&
+                   (size_t)seg[cursor[s]].rule_idx == i; ++cursor[s]) {
+                const exclusive_range &r = seg[cursor[s]];
+                if (!ranges.empty() && ranges.back()[1] + 1 == r.low) {
+                    ranges.back()[1] = r.high;
+                } else {
+                    ranges.push_back({r.low, r.high});
+                }
+            }
+        }
+    }
 
-            integer_interval_set sub_interval = interval.remove(lo, hi);
-            can_guarantee = sub_interval.size() > 0;
-
-            for (int j=0; j<num; ++j) {
-                out[i][j] = can_guarantee ?
-                               sub_interval.random_value() :
-                               random_core::random_uint32(lo, hi);
+    /**
+     * @brief Sets "out[j]" to value "first+j" of rule "rule_idx", for "j" <
+     * "n". Values are drawn from a range of "ranges" picked uniformly, or
+     * from [lo, hi] when "ranges" is empty. Value "k" depends only on "rng",
+     * the rule and "k": word 0 of its sample picks the range and word 1 the
+     * value.
+     */
+    static void
+    draw_values(const random_counter &rng,
+                size_t rule_idx,
+                size_t first,
+                size_t n,
+                const std::vector<value_range> &ranges,
+                uint32_t lo,
+                uint32_t hi,
+                uint32_t *out)
+    {
+        if (ranges.size() <= 1) {
+            if (!ranges.empty()) {
+                lo = ranges[0][0];
+                hi = ranges[0][1];
+            }
+            uint32_t *words[4] = {nullptr, out, nullptr, nullptr};
+            rng.generate(rule_idx, first, n, words);
+            for (size_t j=0; j<n; ++j) {
+                out[j] = random_counter::uniform(out[j], lo, hi);
             }
+            return;
+        }
 
-            /* We cannot guarantee a unique mapping */
-            if (!can_guarantee) {
-                non_unique.insert(i);
+        static constexpr size_t BLOCK = 1024;
+        uint32_t picks[BLOCK];
+        for (size_t b=0; b<n; b+=BLOCK) {
+            size_t count = std::min(BLOCK, n - b);
+            uint32_t *words[4] = {picks, out + b, nullptr, nullptr};
+            rng.generate(rule_idx, first + b, count, words);
+            for (size_t j=0; j<count; ++j) {
+                const value_range &r = ranges[random_counter::uniform(
+                                              picks[j], 0, ranges.size()-1)];
+                out[b+j] = random_counter::uniform(out[b+j], r[0], r[1]);
             }
+        }
+    }
+
+    /**
+     * @brief Generates the values of field "f" for the chunks [first, last),
+     * which are ordered by rule index. Values are drawn from the ranges the
+     * rule exclusively holds in "segments" when such exist. Values are drawn
+     * from a counter-based generator, so chunks can be sampled in any order.
+     * The values of a chunk are written from "out + chunk.offset".
+     */
+    static void
+    sample_field(const ruleset<F>& rule_db,
+                 int f,
+                 const std::vector<std::vector<exclusive_range>> &segments,
+                 const value_chunk *first,
+                 const value_chunk *last,
+                 uint32_t *out)
+    {
+        if (first == last) {
+            return;
+        }
+        std::vector<size_t> cursor = seek_ranges(segments, first->rule_idx);
+        std::vector<value_range> ranges;
+        random_counter rng(random_core::get_seed(), STREAM_FIELD + f);
+        size_t current = SIZE_MAX;
 
-            percent.store(i*100.0/rule_db.size());
+        for (const value_chunk *c=first; c<last; ++c) {
+            if (c->rule_idx != current) {
+                current = c->rule_idx;
+                collect_ranges(segments, current, cursor, ranges);
+            }
+            draw_values(rng, current, c->first, c->count, ranges,
+                        rule_db[current].fields[f].low,
+                        rule_db[current].fields[f].high,
+                        out + c->offset);
         }
-        percent.store(100);
     }
 
     /**
-     * @brief Prints the status of all "process_field" threads to stdout.
+     * @brief Prints the field processing status to stdout.
     */
     bool
     print_status(const std::array<std::atomic<int>, F> &status)
@@ -135,236 +428,2589 @@ class mapping {
         return finished;
     }
 
-    const ruleset<F> *rule_db;
-    rule_mapping rmap;
+    /**
+     * @brief Returns true iff "process_block" generates the headers of rule
+     * "rule_idx"
+     */
+    inline bool
+    is_selected(size_t rule_idx) const
+    {
+        return selected.empty() || selected[rule_idx];
+    }
 
-public:
+    /**
+     * @brief Returns a pool grain size for "n" items.
+     */
+    size_t
+    grain_size(size_t n) const
+    {
+        return std::max<size_t>(64, n / (pool.size() * 8));
+    }
 
     /**
-     * @brief Processes "rule_db" and generates a total "flow_num" packets.
-    */
+     * @brief Invokes "fn(begin, end)" on the pool over sub-ranges of [0, n)
+     * that hold similar total "weight(i)", so that heavy items do not share
+     * a task.
+     */
+    template <typename W, typename Fn>
+    void
+    balanced_for(size_t n, W weight, Fn fn)
+    {
+        size_t total = 0;
+        for (size_t i=0; i<n; ++i) {
+            total += weight(i) + 1;
+        }
+        size_t target = std::max<size_t>(1, total / (pool.size() * 8));
+        std::vector<size_t> bounds(1, 0);
+        size_t acc = 0;
+        for (size_t i=0; i<n; ++i) {
+            acc += weight(i) + 1;
+            if (acc >= target) {
+                bounds.push_back(i + 1);
+                acc = 0;
+            }
+        }
+        if (bounds.back() != n) {
+            bounds.push_back(n);
+        }
+        pool.parallel_for(0, bounds.size() - 1, 1, [&] (size_t b, size_t e) {
+            for (size_t t=b; t<e; ++t) {
+                fn(bounds[t], bounds[t+1]);
+            }
+        });
+    }
+
+    /**
+     * @brief Sets "out[i]" to the share of "total" by the normalized weight
+     * "weight[i]". Shares are rounded by largest remainder: every item gets
+     * the floor of its share, then the items with the largest fractions get
+     * one more each, so the shares sum to "total".
+     */
+    static void
+    split_shares(const std::vector<double> &weight,
+                 uint64_t total,
+                 std::vector<size_t> &out)
+    {
+        size_t n = weight.size();
+        std::vector<std::pair<double, size_t>> rest(n);
+        uint64_t assigned = 0;
+        out.resize(n);
+        for (size_t i=0; i<n; ++i) {
+            double exact = weight[i] * total;
+            out[i] = exact;
+            assigned += out[i];
+            rest[i] = {exact - out[i], i};
+        }
+        size_t left = std::min<uint64_t>(n, total - assigned);
+        std::partial_sort(rest.begin(), rest.begin() + left, rest.end(),
+        [] (const std::pair<double, size_t> &a,
+            const std::pair<double, size_t> &b) {
+            return a.first > b.first ||
+                   (a.first == b.first && a.second < b.second);
+        });
+        for (size_t k=0; k<left; ++k) {
+            out[rest[k].second]++;
+        }
+    }
+
+    /**
+     * @brief Divides "flow_num" flows between the rules by
+     * "opts.distribution" into "quota", and sets "weights" to the
+     * normalized rule weights.
+     */
+    void
+    assign_quotas(uint64_t flow_num)
+    {
+        size_t n = rule_db->size();
+        quota.assign(n, 0);
+        weights.assign(n, 1.0 / n);
+
+        if (opts.distribution == flow_distribution::uniform) {
+            /* The remainder flows are not generated */
+            std::fill(quota.begin(), quota.end(), flow_num / n);
+            return;
+        }
+
+        if (opts.distribution == flow_distribution::zipf) {
+            /* Heavy rules are spread randomly over the priority order */
+            std::vector<size_t> rank(n);
+            std::iota(rank.begin(), rank.end(), 0);
+            random_stream rng(random_core::get_seed(), STREAM_RANKING, 0);
+            for (size_t i=n; i>1; --i) {
+                std::swap(rank[i-1], rank[rng.random_uint32() % i]);
+            }
+            for (size_t i=0; i<n; ++i) {
+                weights[rank[i]] = 1.0 / std::pow(i + 1.0, opts.zipf_exponent);
+            }
+        } else {
+            if (opts.rule_weights.size() != n) {
+                throw errorf("expected %lu rule weights, got %lu.",
+                             n, opts.rule_weights.size());
+            }
+            weights = opts.rule_weights;
+        }
+
+        double total = 0;
+        for (double w : weights) {
+            if (!(w >= 0)) {
+                throw errorf("rule weights must not be negative.");
+            }
+            total += w;
+        }
+        if (!(total > 0)) {
+            throw errorf("rule weights must have a positive sum.");
+        }
+
+        for (size_t i=0; i<n; ++i) {
+            weights[i] /= total;
+        }
+        split_shares(weights, flow_num, quota);
+
+        auto range = std::minmax_element(quota.begin(), quota.end());
+        MESSAGE("Flows per rule: %lu to %lu\n", *range.first, *range.second);
+    }
+
+    /**
+     * @brief Generates the headers of the rules of shard "opts.shard_index"
+     * into "rmap". The other rules keep no headers and no quota, so the
+     * reports cover the shard. As blocks do, the shard draws the same
+     * headers per rule as a full run.
+     */
+    void
+    process_shard()
+    {
+        size_t n = rule_db->size();
+        size_t first, last;
+        shard_range(n, opts.shard_index, opts.shard_num, first, last);
+        MESSAGE("Shard %lu of %lu: rules %lu to %lu\n", opts.shard_index,
+                opts.shard_num, first, last);
+
+        rule_mapping block;
+        process_block(first, last, block, true);
+        rmap.headers.swap(block.headers);
+        rmap.offsets.assign(n + 1, 0);
+        for (size_t i=first; i<n; ++i) {
+            rmap.offsets[i+1] = block.offsets[std::min(i + 1, last) - first];
+        }
+        for (size_t i=0; i<n; ++i) {
+            if (i < first || i >= last) {
+                quota[i] = 0;
+            }
+        }
+    }
+
+    /**
+     * @brief Finds the ranges each rule exclusively holds per field, marks
+     * the non-unique rules and builds the rule index. Must run before any
+     * block is processed. With "opts.checkpoint", the ranges of each field
+     * are saved once it is swept (see "save_field_checkpoint").
+     */
     void
-    run(const ruleset<F> &rule_db, int flow_num)
+    prepare(const ruleset<F> &rule_db, uint64_t flow_num)
     {
-        std::array<std::set<int>,   F> non_unqiue_field;
-        std::array<field_mapping,   F> field_values;
-        std::array<std::thread,     F> threads;
-        std::array<std::atomic<int>,F> status;
-        typename rule_mapping::const_iterator it;
-        typename rule_mapping::iterator it2;
-        packet_header<F> packet;
-        bool valid;
+        std::array<std::vector<uint32_t>, F> segment_lows;
+        std::array<std::atomic<int>, F> segments_done;
+        std::array<std::atomic<int>, F> status;
+        std::atomic<int> fields_left(F);
 
         this->rule_db = &rule_db;
+        assign_quotas(flow_num);
+        mismatches.assign(rule_db.size(), 0);
+        culprits.assign(rule_db.size(), -1);
+        unreachable_rules = 0;
+
+        /* With checkpoints, each field is saved once swept, and a resumed
+         * run restores the fields saved before */
+        uint64_t fields_saved = 0;
+        if (opts.checkpoint && opts.resume) {
+            fields_saved = load_field_checkpoint(flow_num);
+        }
+        std::exception_ptr save_error;
+
+        /* Each field is split into domain segments that are processed in
+         * parallel. All tasks share the pool, so the threads that finish the
+         * small fields move on to the large ones. */
+        MESSAGE("Starting packet header mapping on %lu threads...\n",
+                pool.size());
+        scoped_timer ranges_timer("exclusive_ranges", rule_db.size());
 
-        int num = flow_num / rule_db.size();
+        for (uint32_t f=0; f<F; ++f) {
+            if (fields_saved >> f & 1) {
+                segments_done[f].store(segments[f].size());
+                status[f].store(100);
+                fields_left--;
+                continue;
+            }
+            segment_lows[f] = split_field_domain(rule_db, f,
+                                         pool.size() * SEGMENTS_PER_THREAD);
+            segments[f].clear();
+            segments[f].resize(segment_lows[f].size());
+            segments_done[f].store(0);
+            status[f].store(0);
+        }
 
-        MESSAGE("Starting packet header mapping threads...\n");
         for (uint32_t f=0; f<F; ++f) {
-            std::thread current(process_field,
-                                std::cref(rule_db),
-                                f,
-                                num,
-                                std::ref(non_unqiue_field[f]),
-                                std::ref(field_values[f]),
-                                std::ref(status[f]));
-            threads[f].swap(current);
+            if (fields_saved >> f & 1) {
+                continue;
+            }
+            for (size_t s=0; s<segment_lows[f].size(); ++s) {
+                pool.submit([&, f, s] {
+                    uint32_t low = segment_lows[f][s];
+                    uint32_t high = (s+1 < segment_lows[f].size()) ?
+                                    segment_lows[f][s+1] - 1 :
+                                    0xffffffff;
+                    process_segment(rule_db, f, low, high, segments[f][s]);
+                    int total = segments[f].size();
+                    int done = ++segments_done[f];
+                    status[f].store(done * 100 / total);
+                    if (done == total) {
+                        fields_left--;
+                    }
+                });
+            }
         }
 
         /* Print status */
-        do {
-            std::this_thread::sleep_for(std::chrono::milliseconds(700));
-        } while (!print_status(status));
+        auto last_print = std::chrono::steady_clock::now();
+        pool.wait_until([&] {
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_print >= std::chrono::milliseconds(700)) {
+                print_status(status);
+                last_print = now;
+            }
+            uint64_t swept = fields_saved;
+            for (uint32_t f=0; f<F; ++f) {
+                if ((size_t)segments_done[f].load() == segments[f].size()) {
+                    swept |= 1ULL << f;
+                }
+            }
+            if (opts.checkpoint && swept != fields_saved && !save_error) {
+                try {
+                    save_field_checkpoint(swept, flow_num);
+                } catch (...) {
+                    save_error = std::current_exception();
+                }
+                fields_saved = swept;
+            }
+            return fields_left.load() == 0;
+        });
+        print_status(status);
+        if (save_error) {
+            std::rethrow_exception(save_error);
+        }
 
+        /* We cannot guarantee a unique mapping for rules that do not
+         * exclusively hold a range in any of the fields */
+        std::vector<char> guaranteed(rule_db.size());
         for (uint32_t f=0; f<F; ++f) {
-            threads[f].join();
+            for (auto &seg : segments[f]) {
+                for (const exclusive_range &r : seg) {
+                    guaranteed[r.rule_idx] = 1;
+                }
+            }
         }
-
-        std::set<int> non_unique = std::move(non_unqiue_field[0]);
-        for (uint32_t f=1; f<F; ++f) {
-            std::set<int> intersect;
-            set_intersection(non_unique.begin(),
-                             non_unique.end(),
-                             non_unqiue_field[f].begin(),
-                             non_unqiue_field[f].end(),
-                             std::inserter(intersect, intersect.begin()));
-            non_unique = intersect;
+        is_non_unique.resize(rule_db.size());
+        size_t non_unique_num = 0;
+        for (size_t i=0; i<rule_db.size(); ++i) {
+            is_non_unique[i] = !guaranteed[i];
+            non_unique_num += is_non_unique[i];
         }
+        MESSAGE("\nNon-unique rules: %lu\n", non_unique_num);
+        ranges_timer.stop();
+
+        MESSAGE("Building rule index...\n");
+        scoped_timer index_timer("rule_index", rule_db.size());
+        index.reset(new rule_index<F>(rule_db, &pool));
+    }
+
+    /**
+     * @brief Generates the headers of rules [first, last) into "out", whose
+     * offsets are relative to rule "first". Headers are deduplicated and
+     * verified. Set "verbose" to print the phases.
+     */
+    void
+    process_block(size_t first, size_t last, rule_mapping &out, bool verbose)
+    {
+        const ruleset<F> &rule_db = *this->rule_db;
+        size_t rule_num = last - first;
+        std::array<field_mapping, F> field_values;
 
-        /* Update unique packets */
-        MESSAGE("\nUpdating unique packet headers... \n");
-        for (int i=0; i<rule_db.size(); i++) {
-            if (non_unique.find(i) != non_unique.end()) {
+        /* Split the values of the unique rules into chunks, so the values of
+         * heavy rules are sampled in parallel */
+        std::vector<value_chunk> chunks;
+        std::vector<size_t> rule_chunks(rule_num + 1);
+        size_t value_num = 0;
+        for (size_t i=0; i<rule_num; ++i) {
+            rule_chunks[i] = chunks.size();
+            if (is_non_unique[first + i] || !is_selected(first + i)) {
                 continue;
             }
-            /* Count the number of valid mappings */
-            std::vector<int> valid_indices;
-            valid_indices.reserve(num);
+            size_t base = sample_base.empty() ? 0 : sample_base[first + i];
+            size_t samples = quota[first + i] * std::max<size_t>(1,
+                                                        opts.adversarial);
+            for (size_t j=0; j<samples; j+=VALUE_CHUNK) {
+                size_t count = std::min(VALUE_CHUNK, samples - j);
+                chunks.push_back({first + i, base + j, count, value_num});
+                value_num += count;
+            }
+        }
+        rule_chunks[rule_num] = chunks.size();
+        size_t chunk_num = chunks.size();
+        auto chunk_weight = [&] (size_t k) {
+            return chunks[k % chunk_num].count;
+        };
 
-            for (int j=0; j<num; j++) {
-                for (uint32_t f=0; f<F; ++f) {
-                    if (field_values[f][i][j]) {
-                        valid_indices.push_back(j);
-                        break;
-                    }
+        /* Sample field values. With a time budget, the chunks are sampled
+         * in steps of about a percent, and no step starts past the
+         * deadline; the values of the chunks left stay zero, which no
+         * valid sample is, so their rules get fewer or no headers. */
+        scoped_timer sample_timer("sample", value_num);
+        for (uint32_t f=0; f<F; ++f) {
+            field_values[f].resize(value_num);
+        }
+        size_t sample_step = opts.time_budget > 0 ?
+                             std::max<size_t>(4 * pool.size(),
+                                              (chunk_num + 99) / 100) :
+                             chunk_num;
+        size_t sampled = 0;
+        while (sampled < chunk_num && !past_deadline()) {
+            size_t s = sampled;
+            size_t step = std::min(sample_step, chunk_num - s);
+            auto step_weight = [&] (size_t k) {
+                return chunks[s + k % step].count;
+            };
+            balanced_for(F * step, step_weight, [&] (size_t b, size_t e) {
+                /* Items are (field, chunk) pairs; a sub-range may span
+                 * fields */
+                while (b < e) {
+                    size_t f = b / step;
+                    size_t stop = std::min(e, (f + 1) * step);
+                    sample_field(rule_db, f, segments[f],
+                                 chunks.data() + s + b - f * step,
+                                 chunks.data() + s + stop - f * step,
+                                 field_values[f].data());
+                    b = stop;
                 }
+            });
+            sampled += step;
+        }
+        for (size_t i=0; i<rule_num; ++i) {
+            if (rule_chunks[i] < rule_chunks[i+1] &&
+                rule_chunks[i] >= sampled) {
+                skipped_rules++;
             }
+        }
+
+        /* Update unique packets. Non-unique rules get a single slot. */
+        if (verbose) {
+            MESSAGE("Updating unique packet headers... \n");
+        }
 
-            rmap[i].reserve(num);
-            rmap[i].resize(valid_indices.size());
-            for (size_t j=0; j<valid_indices.size(); ++j) {
-                size_t idx = valid_indices[j];
-                for (uint32_t f=0; f<F; ++f) {
-                    rmap[i][j][f] = field_values[f][i][idx];
+        auto is_valid = [&] (size_t k) {
+            for (uint32_t f=0; f<F; ++f) {
+                if (field_values[f][k]) {
+                    return true;
                 }
             }
-        }
+            return false;
+        };
 
-        /* Update mapping for non-unique rules */
-        MESSAGE("Non-unique rules: %lu\n", non_unique.size());
-        int unreachable_rules = 0;
+        /* Count the number of valid mappings per chunk */
+        std::vector<size_t> chunk_pos(chunk_num);
+        balanced_for(sampled, chunk_weight, [&] (size_t b, size_t e) {
+            for (size_t k=b; k<e; ++k) {
+                size_t count = 0;
+                for (size_t j=0; j<chunks[k].count; ++j) {
+                    count += is_valid(chunks[k].offset + j);
+                }
+                chunk_pos[k] = count;
+            }
+        });
 
-        /* Handle non-unique rules... */
-        int counter = 0;
-        for (auto idx : non_unique) {
-            print_progress("Handling non-unique rules", counter++,
-                           non_unique.size());
-            valid = gen_packet(rule_db, idx, packet);
-            if (valid) {
-                rmap[idx].push_back(packet);
-            } else {
-                unreachable_rules++;
+        std::vector<size_t> sizes(rule_num);
+        out.offsets.resize(rule_num + 1);
+        out.offsets[0] = 0;
+        for (size_t i=0; i<rule_num; ++i) {
+            size_t size = is_non_unique[first + i] &&
+                          is_selected(first + i);
+            for (size_t k=rule_chunks[i]; k<rule_chunks[i+1]; ++k) {
+                size_t count = chunk_pos[k];
+                chunk_pos[k] = out.offsets[i] + size;
+                size += count;
             }
+            sizes[i] = size;
+            out.offsets[i+1] = out.offsets[i] + size;
         }
-        print_progress("Handling non-unique rules", 0, 0);
+        out.headers.resize(out.offsets.back());
 
-        if (unreachable_rules > 0) {
-            MESSAGE("Could not generate mapping for %d rules.\n",
-                unreachable_rules);
-        }
-
-        /* Remove duplicate headers */
-        MESSAGE("Removing duplicate headers...\n");
-        for (it2 = rmap.begin(); it2 != rmap.end(); ++it2) {
-            std::vector<packet_hdr> &hdr_vec = it2->second;
-            std::sort(hdr_vec.begin(), hdr_vec.end(),
-            [] (const packet_hdr &a, const packet_hdr &b) {
-                for (int i=0; i<F; ++i) {
-                    if (a[i] < b[i]) {
-                        return true;
-                    } else if (a[i] > b[i]) {
-                        return false;
+        balanced_for(sampled, chunk_weight, [&] (size_t b, size_t e) {
+            for (size_t k=b; k<e; ++k) {
+                packet_hdr *hdr = &out.headers[chunk_pos[k]];
+                for (size_t j=0; j<chunks[k].count; ++j) {
+                    size_t v = chunks[k].offset + j;
+                    if (!is_valid(v)) {
+                        continue;
                     }
+                    for (uint32_t f=0; f<F; ++f) {
+                        (*hdr)[f] = field_values[f][v];
+                    }
+                    hdr++;
                 }
-                return &a < &b;
+            }
+        });
+
+        for (uint32_t f=0; f<F; ++f) {
+            field_mapping().swap(field_values[f]);
+        }
+        sample_timer.stop();
+
+        /* Handle non-unique rules. Each rule draws from its own counters,
+         * so the results do not depend on the number of threads. */
+        std::vector<int> non_unique;
+        for (size_t i=first; i<last; ++i) {
+            if (is_non_unique[i] && is_selected(i)) {
+                non_unique.push_back(i);
+            }
+        }
+        /* With a time budget, the rules with the most flows go first, and
+         * higher priorities, which fewer rules shadow, break ties */
+        if (opts.time_budget > 0) {
+            std::stable_sort(non_unique.begin(), non_unique.end(),
+            [&] (int a, int b) {
+                return quota[a] > quota[b];
             });
+        }
+
+        /* Per rule: 0 unreachable, 1 valid, 2 skipped at the deadline */
+        std::vector<char> valid(non_unique.size());
+        random_counter rng(random_core::get_seed(), STREAM_NON_UNIQUE);
+        scoped_timer non_unique_timer("non_unique", non_unique.size());
 
-            auto it3 = std::unique(hdr_vec.begin(), hdr_vec.end(),
-            [] (const packet_hdr &a, const packet_hdr &b) {
-                for (int i=0; i<F; ++i) {
-                    if (a[i] != b[i]) {
-                        return false;
+        /* Rules are handled in steps of about a percent, so that the
+         * progress is printed by this thread alone */
+        size_t step = std::max<size_t>(64 * pool.size(),
+                                       (non_unique.size() + 99) / 100);
+        for (size_t s=0; s<non_unique.size(); s+=step) {
+            size_t end = std::min(non_unique.size(), s + step);
+            pool.parallel_for(s, end, 64, [&] (size_t b, size_t e) {
+                for (size_t i=b; i<e; ++i) {
+                    int idx = non_unique[i];
+                    if (past_deadline()) {
+                        valid[i] = 2;
+                        continue;
                     }
+                    valid[i] = gen_packet(rule_db, *index, idx, rng,
+                                   out.headers[out.offsets[idx - first]]);
                 }
-                /* Identical headers */
-                return true;
             });
-            size_t size = std::distance(hdr_vec.begin(), it3);
-            hdr_vec.resize(size);
+            if (verbose) {
+                print_progress("Handling non-unique rules",
+                               end * 100 / non_unique.size(), 100);
+            }
+        }
+        non_unique_timer.stop();
+        if (verbose) {
+            print_progress("Handling non-unique rules", 0, 0);
+        }
+
+        for (size_t i=0; i<non_unique.size(); ++i) {
+            if (valid[i] != 1) {
+                sizes[non_unique[i] - first] = 0;
+            }
+            if (!valid[i]) {
+                unreachable_rules++;
+            } else if (valid[i] == 2) {
+                skipped_rules++;
+            }
         }
 
-        /* Check that mapping is correct */
-        MESSAGE("Checking that the generated mapping is correct...\n");
-        for (it = rmap.begin(); it != rmap.end(); ++it) {
-            const std::vector<packet_hdr> &hdr_vec = it->second;
-            const int &id = it->first;
-            for (const packet_hdr &hdr : hdr_vec) {
-                if (!hdr_matches_rule(rule_db, id, hdr)) {
-                    MESSAGE("Error! \n");
-                    exit(1);
+        /* Remove duplicate headers, one hash set per thread */
+        if (verbose) {
+            MESSAGE("Removing duplicate headers...\n");
+        }
+        auto rule_weight = [&] (size_t i) {
+            return sizes[i];
+        };
+        scoped_timer dedupe_timer("dedupe", out.headers.size());
+        balanced_for(rule_num, rule_weight, [&] (size_t b, size_t e) {
+            static thread_local header_hash_set<F> set;
+            for (size_t i=b; i<e; ++i) {
+                packet_hdr *begin = out.headers.data() + out.offsets[i];
+                packet_hdr *end = dedupe_headers<F>(begin,
+                                                    begin + sizes[i],
+                                                    set);
+                if (!opts.keep_order) {
+                    std::sort(begin, end);
                 }
+                sizes[i] = end - begin;
+            }
+        });
+        dedupe_timer.stop();
+
+        if (verbose) {
+            MESSAGE("Checking that the generated mapping is correct...\n");
+        }
+        verify(first, out, sizes);
+        if (opts.adversarial > 1) {
+            if (verbose) {
+                MESSAGE("Keeping the headers with the deepest overlap...\n");
             }
+            keep_hardest(first, out, sizes);
         }
+
+        /* Compact the per-rule ranges */
+        size_t cursor = 0;
+        for (size_t i=0; i<rule_num; ++i) {
+            size_t start = out.offsets[i];
+            out.offsets[i] = cursor;
+            std::move(out.headers.begin() + start,
+                      out.headers.begin() + start + sizes[i],
+                      out.headers.begin() + cursor);
+            cursor += sizes[i];
+        }
+        out.offsets[rule_num] = cursor;
+        out.headers.resize(cursor);
+        out.headers.shrink_to_fit();
     }
 
     /**
-     * @brief Saves the packet mapping into a textual file in format
-     * RULE-ID: FIELD0 FIELD1 ...
-    */
+     * @brief Checks that the first rule to match each header in "block" is
+     * the rule it was generated for. "block" holds rules from "first", and
+     * "sizes" holds the number of headers per rule. Headers that fail are
+     * dropped and "sizes" is updated. Mismatches are accumulated for
+     * "report()".
+     */
     void
-    save_text_mapping(const char *filename)
+    verify(size_t first, rule_mapping &block, std::vector<size_t> &sizes)
     {
-        typename rule_mapping::const_iterator it;
+        size_t rule_num = sizes.size();
+        scoped_timer timer("verify", block.headers.size());
 
-        MESSAGE("Writing mapping to file \"%s\"...\n", filename);
-        FILE* file_desc = fopen(filename, "w");
-        if (!file_desc) {
-            throw errorf("cannot open output filename for writing.");
+        /* Headers are checked in pieces, so heavy rules are split between
+         * threads */
+        std::vector<std::array<size_t, 2>> pieces;
+        for (size_t i=0; i<rule_num; ++i) {
+            for (size_t k=0; k<sizes[i]; k+=VALUE_CHUNK) {
+                pieces.push_back({i, k});
+            }
         }
-
-        for (it = rmap.begin(); it != rmap.end(); ++it) {
-            const std::vector<packet_hdr> &hdr_vec = it->second;
-            const int &id = it->first;
-
-            for (const packet_hdr &hdr : hdr_vec) {
-                fprintf(file_desc, "%d:", id);
-                for (int f=0; f<F; ++f) {
-                    fprintf(file_desc, " %u", hdr[f]);
+        std::vector<char> valid(block.headers.size());
+        balanced_for(pieces.size(), [&] (size_t p) {
+            return std::min(VALUE_CHUNK, sizes[pieces[p][0]] - pieces[p][1]);
+        },
+        [&] (size_t b, size_t e) {
+            for (size_t p=b; p<e; ++p) {
+                size_t i = pieces[p][0];
+                size_t rule_idx = first + i;
+                size_t start = block.offsets[i] + pieces[p][1];
+                size_t stop = start + std::min(VALUE_CHUNK,
+                                               sizes[i] - pieces[p][1]);
+                for (size_t k=start; k<stop; ++k) {
+                    valid[k] = index->first_match(block.headers[k],
+                                                  rule_idx + 1) ==
+                               (int)rule_idx;
                 }
-                fprintf(file_desc, "\n");
             }
-        }
+        });
 
-        fclose(file_desc);
+        balanced_for(rule_num, [&] (size_t i) {
+            return sizes[i];
+        },
+        [&] (size_t b, size_t e) {
+            for (size_t i=b; i<e; ++i) {
+                size_t rule_idx = first + i;
+                packet_hdr *hdrs = block.headers.data() + block.offsets[i];
+                const char *ok = valid.data() + block.offsets[i];
+                size_t out = 0;
+                for (size_t k=0; k<sizes[i]; ++k) {
+                    if (ok[k]) {
+                        hdrs[out++] = hdrs[k];
+                    } else if (culprits[rule_idx] < 0) {
+                        culprits[rule_idx] = index->first_match(hdrs[k],
+                                                                rule_idx + 1);
+                    }
+                }
+                mismatches[rule_idx] += sizes[i] - out;
+                sizes[i] = out;
+            }
+        });
     }
 
     /**
-     * @brief Saves the rule-db and packet data into a compreseed bunary-file
-     * that can be loaded later in order to replay packets.
+     * @brief Keeps at most "quota" headers of each unique rule in "block",
+     * those that match the most rules, i.e., that overlap the deepest in the
+     * classifier. Ties go to the earlier header, and the kept headers stay
+     * in their order. "block" holds rules from "first", and "sizes" holds
+     * the number of headers per rule, which is updated.
      */
     void
-    save_binary_format(const char *filename)
+    keep_hardest(size_t first, rule_mapping &block, std::vector<size_t> &sizes)
     {
-        zstream file;
-        typename rule_mapping::const_iterator it;
+        size_t rule_num = sizes.size();
+        scoped_timer timer("adversarial", block.headers.size());
 
-        MESSAGE("Writing bianry data to file %s... ", filename);
-        file.open_write(filename);
+        /* Overlap depth per header, in pieces as in "verify" */
+        std::vector<std::array<size_t, 2>> pieces;
+        for (size_t i=0; i<rule_num; ++i) {
+            if (sizes[i] <= quota[first + i]) {
+                continue;
+            }
+            for (size_t k=0; k<sizes[i]; k+=VALUE_CHUNK) {
+                pieces.push_back({i, k});
+            }
+        }
+        std::vector<uint32_t> depth(block.headers.size());
+        balanced_for(pieces.size(), [&] (size_t p) {
+            return std::min(VALUE_CHUNK, sizes[pieces[p][0]] - pieces[p][1]);
+        },
+        [&] (size_t b, size_t e) {
+            for (size_t p=b; p<e; ++p) {
+                size_t i = pieces[p][0];
+                size_t start = block.offsets[i] + pieces[p][1];
+                size_t stop = start + std::min(VALUE_CHUNK,
+                                               sizes[i] - pieces[p][1]);
+                for (size_t k=start; k<stop; ++k) {
+                    depth[k] = index->match_count(block.headers[k]);
+                }
+            }
+        });
 
-        /* Write rule database */
-        file << "ruledb"
-             << rule_db->size()
-             << F;
+        balanced_for(rule_num, [&] (size_t i) {
+            return sizes[i] > quota[first + i] ? sizes[i] : 0;
+        },
+        [&] (size_t b, size_t e) {
+            std::vector<size_t> order;
+            std::vector<char> keep;
+            for (size_t i=b; i<e; ++i) {
+                size_t count = quota[first + i];
+                if (sizes[i] <= count) {
+                    continue;
+                }
+                const uint32_t *d = depth.data() + block.offsets[i];
+                order.resize(sizes[i]);
+                for (size_t k=0; k<sizes[i]; ++k) {
+                    order[k] = k;
+                }
+                std::nth_element(order.begin(), order.begin() + count,
+                                 order.end(), [&] (size_t x, size_t y) {
+                    return d[x] > d[y] || (d[x] == d[y] && x < y);
+                });
+                keep.assign(sizes[i], 0);
+                for (size_t k=0; k<count; ++k) {
+                    keep[order[k]] = 1;
+                }
+                packet_hdr *hdrs = block.headers.data() + block.offsets[i];
+                size_t out = 0;
+                for (size_t k=0; k<sizes[i]; ++k) {
+                    if (keep[k]) {
+                        hdrs[out++] = hdrs[k];
+                    }
+                }
+                sizes[i] = out;
+            }
+        });
+    }
 
-        for (size_t i=0; i<rule_db->size(); ++i) {
-            file << rule_db->at(i).priority;
-            for (int f=0; f<F; ++f) {
-                file << rule_db->at(i).fields[f].low
-                     << rule_db->at(i).fields[f].high;
+    /**
+     * @brief Generates the headers of rule "rule_idx" when they exceed the
+     * stream budget. Headers are generated in batches of at most "batch";
+     * each batch is deduplicated, sorted and spilled as a run to files named
+     * "spill_prefix.N". The runs are then merged, verified and passed to
+     * "sink(hdr)" in ascending order, which matches the in-memory output
+     * unless "opts.keep_order" is set. Returns the number of headers passed
+     * to "sink".
+     */
+    template <typename Sink>
+    size_t
+    process_large_rule(size_t rule_idx,
+                       size_t batch,
+                       const std::string &spill_prefix,
+                       Sink sink)
+    {
+        const ruleset<F> &rule_db = *this->rule_db;
+        int seed = random_core::get_seed();
+        std::vector<packet_hdr> headers;
+        size_t out = 0;
+
+        /* Keeps the headers that match "rule_idx" first, then passes them
+         * to "sink" */
+        auto flush = [&] {
+            std::vector<char> valid(headers.size());
+            pool.parallel_for(0, headers.size(), grain_size(headers.size()),
+            [&] (size_t b, size_t e) {
+                for (size_t k=b; k<e; ++k) {
+                    valid[k] = index->first_match(headers[k], rule_idx + 1) ==
+                               (int)rule_idx;
+                }
+            });
+            for (size_t k=0; k<headers.size(); ++k) {
+                if (valid[k]) {
+                    sink(headers[k]);
+                    out++;
+                    continue;
+                }
+                mismatches[rule_idx]++;
+                if (culprits[rule_idx] < 0) {
+                    culprits[rule_idx] = index->first_match(headers[k],
+                                                            rule_idx + 1);
+                }
             }
-        }
+            headers.clear();
+        };
 
-        size_t header_num = 0;
-        for (it = rmap.begin(); it != rmap.end(); ++it) {
-            header_num += it->second.size();
+        if (is_non_unique[rule_idx]) {
+            random_counter rng(seed, STREAM_NON_UNIQUE);
+            headers.resize(1);
+            if (!gen_packet(rule_db, *index, rule_idx, rng, headers[0])) {
+                unreachable_rules++;
+                return 0;
+            }
+            flush();
+            return out;
         }
-        MESSAGE("total packet headers: %lu \n", header_num);
-
-        /* Write packet database */
-        file << "packetdb"
-             << header_num;
 
-        for (it = rmap.begin(); it != rmap.end(); ++it) {
-            const std::vector<packet_hdr> &hdr_vec = it->second;
-            const int &id = it->first;
+        std::array<std::vector<value_range>, F> ranges;
+        std::vector<random_counter> rng;
+        for (int f=0; f<F; ++f) {
+            rng.emplace_back(seed, STREAM_FIELD + f);
+            std::vector<size_t> cursor = seek_ranges(segments[f], rule_idx);
+            collect_ranges(segments[f], rule_idx, cursor, ranges[f]);
+        }
 
-            for (const packet_hdr &hdr : hdr_vec) {
+        /* Values depend only on their position, so batches are sampled in
+         * parallel and yield the same values as "sample_field" */
+        external_sorter<F> sorter(spill_prefix);
+        batch = std::max<size_t>(1, std::min(batch, MAX_RUN_HEADERS));
+        header_hash_set<F> set;
+        size_t num = quota[rule_idx];
+        for (size_t j=0; j<num; ) {
+            size_t count = std::min(batch, num - j);
+            headers.resize(count);
+            pool.parallel_for(0, count, VALUE_CHUNK, [&] (size_t b, size_t e) {
+                std::vector<uint32_t> values(e - b);
+                for (int f=0; f<F; ++f) {
+                    draw_values(rng[f], rule_idx, j + b, e - b, ranges[f],
+                                rule_db[rule_idx].fields[f].low,
+                                rule_db[rule_idx].fields[f].high,
+                                values.data());
+                    for (size_t k=b; k<e; ++k) {
+                        headers[k][f] = values[k - b];
+                    }
+                }
+            });
+            size_t valid = 0;
+            for (size_t k=0; k<count; ++k) {
+                uint32_t any = 0;
                 for (int f=0; f<F; ++f) {
-                    file << hdr[f];
+                    any |= headers[k][f];
+                }
+                if (any) {
+                    headers[valid++] = headers[k];
                 }
-                file << id;
             }
+            j += count;
+            packet_hdr *end = dedupe_headers<F>(headers.data(),
+                                                headers.data() + valid,
+                                                set);
+            std::sort(headers.data(), end);
+            sorter.add_run(headers.data(), end);
         }
+        headers.clear();
+        headers.shrink_to_fit();
+
+        sorter.merge([&] (const packet_hdr &hdr) {
+            headers.push_back(hdr);
+            if (headers.size() >= batch) {
+                flush();
+            }
+        });
+        flush();
+        return out;
+    }
+
+    /**
+     * @brief Returns the fields of "r" as a box of "overlap_index"
+     */
+    static typename overlap_index<F>::box
+    rule_box(const rule<F> &r)
+    {
+        typename overlap_index<F>::box out;
+        for (int f=0; f<F; ++f) {
+            out[f] = {r.fields[f].low, r.fields[f].high};
+        }
+        return out;
+    }
+
+    /**
+     * @brief Matches the rules of "rule_db" with the rules of the previous
+     * mapping "prev" that have the same fields, such that the matched rules
+     * keep their relative priority order and as many rules as possible are
+     * matched. Sets "previous[i]" to the previous index of rule "i", or -1
+     * if it was added. Returns the previous indices of the removed rules.
+     */
+    static std::vector<size_t>
+    diff_rules(const ruleset<F> &rule_db,
+               reader &prev,
+               std::vector<int64_t> &previous)
+    {
+        using rule_key = std::array<uint32_t, 2 * F>;
+        struct key_hash {
+            size_t
+            operator()(const rule_key &key) const
+            {
+                uint64_t h = 0;
+                for (uint32_t v : key) {
+                    h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+                }
+                return h ^ (h >> 32);
+            }
+        };
+
+        std::unordered_map<rule_key, std::vector<size_t>, key_hash> by_key;
+        for (size_t j=0; j<prev.get_rule_num(); ++j) {
+            rule_key key;
+            for (int f=0; f<F; ++f) {
+                key[2*f] = prev.get_rule(j)[f][0];
+                key[2*f+1] = prev.get_rule(j)[f][1];
+            }
+            by_key[key].push_back(j);
+        }
+
+        /* Longest increasing chain of (new, previous) index pairs with equal
+         * fields (Hunt-Szymanski). "tails[l]" is the pair that ends the
+         * chain of length l+1 with the lowest previous index. */
+        struct pair_link {
+            size_t rule_idx;
+            size_t prev_idx;
+            int64_t link;
+        };
+        std::vector<pair_link> pairs;
+        std::vector<size_t> tails;
+        for (size_t i=0; i<rule_db.size(); ++i) {
+            rule_key key;
+            for (int f=0; f<F; ++f) {
+                key[2*f] = rule_db[i].fields[f].low;
+                key[2*f+1] = rule_db[i].fields[f].high;
+            }
+            auto it = by_key.find(key);
+            if (it == by_key.end()) {
+                continue;
+            }
+            /* Descending, so that a chain holds one pair per new rule */
+            for (auto j=it->second.rbegin(); j!=it->second.rend(); ++j) {
+                size_t l = std::lower_bound(tails.begin(), tails.end(), *j,
+                [&] (size_t p, size_t value) {
+                    return pairs[p].prev_idx < value;
+                }) - tails.begin();
+                pairs.push_back({i, *j, l ? (int64_t)tails[l-1] : -1});
+                if (l == tails.size()) {
+                    tails.push_back(pairs.size() - 1);
+                } else {
+                    tails[l] = pairs.size() - 1;
+                }
+            }
+        }
+
+        previous.assign(rule_db.size(), -1);
+        std::vector<char> kept(prev.get_rule_num());
+        for (int64_t p = tails.empty() ? -1 : tails.back(); p >= 0;
+             p = pairs[p].link) {
+            previous[pairs[p].rule_idx] = pairs[p].prev_idx;
+            kept[pairs[p].prev_idx] = 1;
+        }
+
+        std::vector<size_t> removed;
+        for (size_t j=0; j<kept.size(); ++j) {
+            if (!kept[j]) {
+                removed.push_back(j);
+            }
+        }
+        return removed;
+    }
+
+    /**
+     * @brief Returns the rules of "rule_db" whose first-match region may
+     * differ from the previous mapping "prev", in ascending order: the added
+     * rules, and the kept rules below an added or removed rule that overlap
+     * it. "previous" and "removed" are set by "diff_rules", and "overlaps"
+     * indexes "rule_db". Runs a query per added or removed rule.
+     */
+    std::vector<size_t>
+    changed_rules(const overlap_index<F> &overlaps,
+                  reader &prev,
+                  const std::vector<int64_t> &previous,
+                  const std::vector<size_t> &removed)
+    {
+        const ruleset<F> &rule_db = *this->rule_db;
+        size_t n = rule_db.size();
+        std::vector<size_t> added;
+        std::vector<size_t> kept;
+        for (size_t i=0; i<n; ++i) {
+            if (previous[i] < 0) {
+                added.push_back(i);
+            } else {
+                kept.push_back(i);
+            }
+        }
+
+        /* Kept rules keep their order, so the ones below removed rule "r"
+         * start at the first with a previous index above "r" */
+        size_t query_num = added.size() + removed.size();
+        std::vector<std::vector<size_t>> found(query_num);
+        pool.parallel_for(0, query_num, 1, [&] (size_t b, size_t e) {
+            for (size_t q=b; q<e; ++q) {
+                typename overlap_index<F>::box box;
+                size_t first;
+                if (q < added.size()) {
+                    box = rule_box(rule_db[added[q]]);
+                    first = added[q] + 1;
+                } else {
+                    size_t r = removed[q - added.size()];
+                    for (int f=0; f<F; ++f) {
+                        box[f] = prev.get_rule(r)[f];
+                    }
+                    auto it = std::upper_bound(kept.begin(), kept.end(), r,
+                    [&] (size_t value, size_t i) {
+                        return (int64_t)value < previous[i];
+                    });
+                    first = it == kept.end() ? n : *it;
+                }
+                overlaps.for_each_overlap(box, first, n, [&] (size_t i) {
+                    if (previous[i] >= 0) {
+                        found[q].push_back(i);
+                    }
+                    return true;
+                });
+            }
+        });
+
+        std::vector<size_t> out = added;
+        for (const std::vector<size_t> &rules : found) {
+            out.insert(out.end(), rules.begin(), rules.end());
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+        return out;
+    }
+
+    /**
+     * @brief Does what "prepare" does for the rules "rules" alone, in
+     * ascending order, and with interval queries instead of a sweep over
+     * the ruleset. Finds the ranges each of them exclusively holds per field
+     * and marks the non-unique ones; both match "prepare". Builds the rule
+     * index over them and the rules above them that overlap them, which
+     * decide their first matches, and with "opts.adversarial" over all the
+     * rules that overlap them. "prepare" must not run before.
+     */
+    void
+    prepare_rules(const overlap_index<F> &overlaps,
+                  const std::vector<size_t> &rules)
+    {
+        const ruleset<F> &rule_db = *this->rule_db;
+        size_t n = rule_db.size();
+        size_t grain = grain_size(rules.size());
+        size_t piece_num = (rules.size() + grain - 1) / grain;
+        std::vector<std::array<std::vector<exclusive_range>, F>>
+            piece_ranges(piece_num);
+        std::vector<std::vector<size_t>> piece_context(piece_num);
+        is_non_unique.assign(n, 0);
+
+        scoped_timer ranges_timer("exclusive_ranges", rules.size());
+        pool.parallel_for(0, piece_num, 1, [&] (size_t b, size_t e) {
+            for (size_t p=b; p<e; ++p) {
+                size_t stop = std::min(rules.size(), (p + 1) * grain);
+                for (size_t k=p*grain; k<stop; ++k) {
+                    size_t i = rules[k];
+                    bool guaranteed = false;
+                    /* The rules above "i" in ascending order of their low
+                     * bound, until none of its range is left */
+                    for (int f=0; f<F; ++f) {
+                        uint32_t lo = rule_db[i].fields[f].low;
+                        uint32_t hi = rule_db[i].fields[f].high;
+                        integer_interval_set space(lo, hi);
+                        overlaps.for_each_field_overlap(f, lo, hi, 0, i,
+                        [&] (size_t j) {
+                            space.remove(
+                                std::max(rule_db[j].fields[f].low, lo),
+                                std::min(rule_db[j].fields[f].high, hi));
+                            return space.size() > 0;
+                        });
+                        space.for_each([&] (uint32_t l, uint32_t h) {
+                            piece_ranges[p][f].push_back({(int)i, l, h});
+                            guaranteed = true;
+                        });
+                    }
+                    is_non_unique[i] = !guaranteed;
+
+                    size_t last = opts.adversarial > 1 ? n : i;
+                    overlaps.for_each_overlap(rule_box(rule_db[i]), 0, last,
+                    [&] (size_t j) {
+                        piece_context[p].push_back(j);
+                        return true;
+                    });
+                    piece_context[p].push_back(i);
+                }
+            }
+        });
+
+        /* A single segment per field holds the ranges in rule order */
+        size_t non_unique_num = 0;
+        for (int f=0; f<F; ++f) {
+            segments[f].assign(1, std::vector<exclusive_range>());
+            for (size_t p=0; p<piece_num; ++p) {
+                segments[f][0].insert(segments[f][0].end(),
+                                      piece_ranges[p][f].begin(),
+                                      piece_ranges[p][f].end());
+            }
+        }
+        for (size_t i : rules) {
+            non_unique_num += is_non_unique[i];
+        }
+        MESSAGE("Non-unique rules: %lu\n", non_unique_num);
+        ranges_timer.stop();
+
+        std::vector<size_t> context;
+        for (const std::vector<size_t> &c : piece_context) {
+            context.insert(context.end(), c.begin(), c.end());
+        }
+        std::sort(context.begin(), context.end());
+        context.erase(std::unique(context.begin(), context.end()),
+                      context.end());
+        MESSAGE("Building rule index over %lu rules...\n", context.size());
+        scoped_timer index_timer("rule_index", context.size());
+        index.reset(new rule_index<F>(rule_db, std::move(context), &pool));
+    }
+
+    /**
+     * @brief Returns a hash of everything the output of "run" depends on:
+     * the rules, "flow_num", the seed and the options.
+     */
+    uint64_t
+    checkpoint_fingerprint(uint64_t flow_num) const
+    {
+        uint64_t h = F;
+        auto mix = [&] (uint64_t v) {
+            h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 32;
+        };
+        auto mix_double = [&] (double v) {
+            uint64_t bits;
+            memcpy(&bits, &v, sizeof(bits));
+            mix(bits);
+        };
+        mix(rule_db->size());
+        for (size_t i=0; i<rule_db->size(); ++i) {
+            for (int f=0; f<F; ++f) {
+                mix(((uint64_t)rule_db->at(i).fields[f].low << 32) |
+                    rule_db->at(i).fields[f].high);
+            }
+        }
+        mix(flow_num);
+        mix((uint32_t)random_core::get_seed());
+        mix(opts.keep_order);
+        mix(opts.adversarial);
+        mix((int)opts.distribution);
+        mix_double(opts.zipf_exponent);
+        for (double w : opts.rule_weights) {
+            mix_double(w);
+        }
+        return h;
+    }
+
+    /**
+     * @brief Writes the exclusive ranges of field "f" with "put(data,
+     * size)": the number of segments, and the number of ranges and the
+     * ranges of each
+     */
+    template <typename Put>
+    void
+    put_segments(int f, Put put) const
+    {
+        uint64_t segment_num = segments[f].size();
+        put(&segment_num, sizeof(segment_num));
+        for (auto &seg : segments[f]) {
+            uint64_t range_num = seg.size();
+            put(&range_num, sizeof(range_num));
+            put(seg.data(), seg.size() * sizeof(exclusive_range));
+        }
+    }
+
+    /**
+     * @brief Reads the exclusive ranges of field "f" as written by
+     * "put_segments" with "get(data, size)", which sets "ok" on failure
+     */
+    template <typename Get>
+    void
+    get_segments(int f, Get get, const bool &ok)
+    {
+        uint64_t segment_num = 0;
+        get(&segment_num, sizeof(segment_num));
+        segments[f].assign(ok ? segment_num : 0, {});
+        for (auto &seg : segments[f]) {
+            uint64_t range_num = 0;
+            get(&range_num, sizeof(range_num));
+            seg.resize(ok ? range_num : 0);
+            get(seg.data(), seg.size() * sizeof(exclusive_range));
+        }
+    }
+
+    /**
+     * @brief Saves the exclusive ranges of the fields swept so far, bit "f"
+     * of "fields" for field "f", to the ".fields" file of "opts.checkpoint",
+     * which is replaced atomically. "prepare" resumes the sweep from it.
+     */
+    void
+    save_field_checkpoint(uint64_t fields, uint64_t flow_num)
+    {
+        scoped_timer timer("checkpoint", 0);
+        std::string name = std::string(opts.checkpoint) + ".fields";
+        std::string temp_name = name + ".tmp";
+        FILE *file = fopen(temp_name.c_str(), "wb");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.",
+                         temp_name.c_str());
+        }
+        bool ok = true;
+        auto put = [&] (const void *data, size_t size) {
+            ok = ok && fwrite(data, 1, size, file) == size;
+        };
+        uint64_t values[] = {checkpoint_fingerprint(flow_num), fields};
+        put("cbfield1", 8);
+        put(values, sizeof(values));
+        for (int f=0; f<F; ++f) {
+            if (fields >> f & 1) {
+                put_segments(f, put);
+            }
+        }
+        ok = ok && !fflush(file) && !fsync(fileno(file));
+        fclose(file);
+        if (!ok || rename(temp_name.c_str(), name.c_str())) {
+            throw errorf("cannot write to \"%s\".", temp_name.c_str());
+        }
+    }
+
+    /**
+     * @brief Restores the exclusive ranges saved by "save_field_checkpoint"
+     * into "segments". Returns the fields restored, none if there is no
+     * ".fields" file.
+     */
+    uint64_t
+    load_field_checkpoint(uint64_t flow_num)
+    {
+        std::string name = std::string(opts.checkpoint) + ".fields";
+        FILE *file = fopen(name.c_str(), "rb");
+        if (!file) {
+            return 0;
+        }
+        bool ok = true;
+        auto get = [&] (void *data, size_t size) {
+            ok = ok && fread(data, 1, size, file) == size;
+        };
+        char magic[8];
+        uint64_t values[2];
+        get(magic, sizeof(magic));
+        get(values, sizeof(values));
+        if (!ok || memcmp(magic, "cbfield1", 8)) {
+            fclose(file);
+            throw errorf("\"%s\" is not a checkpoint.", name.c_str());
+        }
+        if (values[0] != checkpoint_fingerprint(flow_num)) {
+            fclose(file);
+            throw errorf("checkpoint \"%s\" was saved with different rules, "
+                         "number of flows, seed or options.", name.c_str());
+        }
+        uint64_t fields = values[1];
+        for (int f=0; f<F && ok; ++f) {
+            if (fields >> f & 1) {
+                get_segments(f, get, ok);
+            }
+        }
+        fclose(file);
+        if (!ok) {
+            throw errorf("checkpoint \"%s\" is truncated.", name.c_str());
+        }
+        MESSAGE("Resuming the field sweep with %d of %d fields done\n",
+                __builtin_popcountll(fields), F);
+        return fields;
+    }
+
+    /**
+     * @brief Saves the state of a checkpointed run whose rules before
+     * "cursor" are done: the exclusive ranges, the headers and the
+     * verification state. Headers that are not in the ".headers" file yet
+     * are appended to it; the state file is then replaced atomically.
+     */
+    void
+    save_checkpoint(size_t cursor, uint64_t flow_num)
+    {
+        scoped_timer timer("checkpoint", cursor);
+        std::string headers_name = std::string(opts.checkpoint) + ".headers";
+        FILE *file = fopen(headers_name.c_str(), "r+b");
+        if (!file) {
+            file = fopen(headers_name.c_str(), "w+b");
+        }
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.",
+                         headers_name.c_str());
+        }
+        size_t count = rmap.headers.size() - saved_headers;
+        bool ok = !fseek(file, saved_headers * sizeof(packet_hdr), SEEK_SET) &&
+                  fwrite(rmap.headers.data() + saved_headers,
+                         sizeof(packet_hdr), count, file) == count &&
+                  !fflush(file) && !fsync(fileno(file));
+        fclose(file);
+        if (!ok) {
+            throw errorf("cannot write to \"%s\".", headers_name.c_str());
+        }
+        saved_headers = rmap.headers.size();
+
+        std::string temp_name = std::string(opts.checkpoint) + ".tmp";
+        file = fopen(temp_name.c_str(), "wb");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.",
+                         temp_name.c_str());
+        }
+        auto put = [&] (const void *data, size_t size) {
+            ok = ok && fwrite(data, 1, size, file) == size;
+        };
+        uint64_t fingerprint = checkpoint_fingerprint(flow_num);
+        uint64_t values[] = {fingerprint, cursor, saved_headers,
+                             unreachable_rules.load()};
+        put("cbckpt1", 7);
+        put(values, sizeof(values));
+        put(rmap.offsets.data(), (cursor + 1) * sizeof(size_t));
+        put(mismatches.data(), cursor * sizeof(size_t));
+        put(culprits.data(), cursor * sizeof(int));
+        put(is_non_unique.data(), is_non_unique.size());
+        for (int f=0; f<F; ++f) {
+            put_segments(f, put);
+        }
+        ok = ok && !fflush(file) && !fsync(fileno(file));
+        fclose(file);
+        if (!ok || rename(temp_name.c_str(), opts.checkpoint)) {
+            throw errorf("cannot write to \"%s\".", temp_name.c_str());
+        }
+    }
+
+    /**
+     * @brief Restores the state saved by "save_checkpoint" for "rule_db" and
+     * "flow_num", and builds the rule index. Returns the index of the first
+     * rule that is not done.
+     */
+    size_t
+    load_checkpoint(const ruleset<F> &rule_db, uint64_t flow_num)
+    {
+        this->rule_db = &rule_db;
+        assign_quotas(flow_num);
+        mismatches.assign(rule_db.size(), 0);
+        culprits.assign(rule_db.size(), -1);
+
+        FILE *file = fopen(opts.checkpoint, "rb");
+        if (!file) {
+            throw errorf("cannot open checkpoint \"%s\" for reading.",
+                         opts.checkpoint);
+        }
+        bool ok = true;
+        auto get = [&] (void *data, size_t size) {
+            ok = ok && fread(data, 1, size, file) == size;
+        };
+        char magic[7];
+        uint64_t values[4];
+        get(magic, sizeof(magic));
+        get(values, sizeof(values));
+        if (!ok || memcmp(magic, "cbckpt1", 7)) {
+            fclose(file);
+            throw errorf("\"%s\" is not a checkpoint.", opts.checkpoint);
+        }
+        if (values[0] != checkpoint_fingerprint(flow_num)) {
+            fclose(file);
+            throw errorf("checkpoint \"%s\" was saved with different rules, "
+                         "number of flows, seed or options.",
+                         opts.checkpoint);
+        }
+        size_t cursor = values[1];
+        saved_headers = values[2];
+        unreachable_rules = values[3];
+
+        rmap.offsets.resize(cursor + 1);
+        is_non_unique.resize(rule_db.size());
+        get(rmap.offsets.data(), (cursor + 1) * sizeof(size_t));
+        get(mismatches.data(), cursor * sizeof(size_t));
+        get(culprits.data(), cursor * sizeof(int));
+        get(is_non_unique.data(), is_non_unique.size());
+        for (int f=0; f<F && ok; ++f) {
+            get_segments(f, get, ok);
+        }
+        fclose(file);
+        if (!ok || rmap.offsets.back() != saved_headers) {
+            throw errorf("checkpoint \"%s\" is truncated.", opts.checkpoint);
+        }
+
+        /* The headers file may hold headers of an unfinished checkpoint */
+        std::string headers_name = std::string(opts.checkpoint) + ".headers";
+        file = fopen(headers_name.c_str(), "rb");
+        rmap.headers.resize(saved_headers);
+        if (!file || fread(rmap.headers.data(), sizeof(packet_hdr),
+                           saved_headers, file) != saved_headers) {
+            if (file) {
+                fclose(file);
+            }
+            throw errorf("cannot read \"%s\".", headers_name.c_str());
+        }
+        fclose(file);
+
+        MESSAGE("Resuming from checkpoint at rule %lu of %lu\n", cursor,
+                rule_db.size());
+        MESSAGE("Building rule index...\n");
+        index.reset(new rule_index<F>(rule_db, &pool));
+        return cursor;
+    }
+
+    /**
+     * @brief Like "run", but generates the headers in blocks of rules and
+     * saves a checkpoint after a block when "opts.checkpoint_interval"
+     * seconds have passed since the last one. Blocks do not change the
+     * output, as each rule draws from its own random streams.
+     */
+    void
+    run_checkpointed(const ruleset<F> &rule_db, uint64_t flow_num)
+    {
+        size_t first = 0;
+        saved_headers = 0;
+        /* A run stopped during "prepare" left only the ".fields" file */
+        if (opts.resume && !access(opts.checkpoint, F_OK)) {
+            first = load_checkpoint(rule_db, flow_num);
+        } else {
+            prepare(rule_db, flow_num);
+            rmap = rule_mapping();
+            rmap.offsets.assign(1, 0);
+            save_checkpoint(0, flow_num);
+            remove((std::string(opts.checkpoint) + ".fields").c_str());
+        }
+
+        auto last_save = std::chrono::steady_clock::now();
+        rule_mapping block;
+        while (first < rule_db.size()) {
+            print_progress("Generating blocks", first, rule_db.size());
+            size_t last = first;
+            size_t values = 0;
+            while (last < rule_db.size() &&
+                   (last == first ||
+                    values + quota[last] <= CHECKPOINT_BLOCK)) {
+                values += quota[last++];
+            }
+            process_block(first, last, block, false);
+            size_t base = rmap.headers.size();
+            rmap.headers.insert(rmap.headers.end(), block.headers.begin(),
+                                block.headers.end());
+            for (size_t i=1; i<block.offsets.size(); ++i) {
+                rmap.offsets.push_back(base + block.offsets[i]);
+            }
+            block = rule_mapping();
+            first = last;
+
+            auto now = std::chrono::steady_clock::now();
+            if (first == rule_db.size() ||
+                now - last_save >= std::chrono::duration<double>(
+                                       opts.checkpoint_interval)) {
+                save_checkpoint(first, flow_num);
+                last_save = now;
+            }
+        }
+        print_progress("Generating blocks", 0, 0);
+    }
+
+    /**
+     * @brief Tops up "rmap" to exactly "flow_num" distinct headers when the
+     * rules fall short of their quotas, e.g., as they are saturated,
+     * shadowed or non-unique. The missing headers are divided between the
+     * unique rules in proportion to the free space of their residual
+     * regions, scaled by the share of their samples that survived
+     * deduplication and verification. Rules draw the extra values at sample
+     * positions past the ones already used, in parallel as in the first
+     * pass; extra headers that a rule already holds are skipped. Rounds
+     * repeat while any rule has free residual space; a rule that yields no
+     * new header in FILL_ROUNDS rounds in a row is exhausted. Throws when
+     * all rules are exhausted short of "flow_num".
+     */
+    void
+    fill_quota(uint64_t flow_num)
+    {
+        scoped_timer timer("fill_quota", flow_num);
+        const ruleset<F> &rule_db = *this->rule_db;
+        size_t n = rule_db.size();
+        auto size_of = [&] (size_t i) {
+            return rmap.offsets[i+1] - rmap.offsets[i];
+        };
+
+        /* Residual volume: the product of the sampled range lengths */
+        std::vector<double> volume(n, 1.0);
+        std::vector<value_range> ranges;
+        for (int f=0; f<F; ++f) {
+            std::vector<size_t> cursor = seek_ranges(segments[f], 0);
+            for (size_t i=0; i<n; ++i) {
+                collect_ranges(segments[f], i, cursor, ranges);
+                double length = 0;
+                for (const value_range &r : ranges) {
+                    length += (double)r[1] - r[0] + 1;
+                }
+                if (ranges.empty()) {
+                    length = (double)rule_db[i].fields[f].high -
+                             rule_db[i].fields[f].low + 1;
+                }
+                volume[i] *= length;
+            }
+        }
+
+        std::vector<size_t> requested = quota;
+        std::vector<size_t> saved_mismatches = mismatches;
+        std::vector<int> saved_culprits = culprits;
+        std::vector<double> yield(n);
+        std::vector<int> empty_rounds(n, 0);
+        sample_base = quota;
+        for (size_t i=0; i<n; ++i) {
+            yield[i] = quota[i] ? (double)size_of(i) / quota[i] : 1.0;
+        }
+
+        uint64_t total = rmap.headers.size();
+        int round = 0;
+        for (; total<flow_num; ++round) {
+            std::vector<double> weight(n, 0.0);
+            std::vector<size_t> extra;
+            double sum = 0;
+            for (size_t i=0; i<n; ++i) {
+                double free = volume[i] - size_of(i);
+                if (!is_non_unique[i] && empty_rounds[i] < FILL_ROUNDS &&
+                    free >= 1) {
+                    weight[i] = free * std::max(yield[i], FILL_MIN_YIELD);
+                    sum += weight[i];
+                }
+            }
+            if (!(sum > 0)) {
+                break;
+            }
+            for (double &w : weight) {
+                w /= sum;
+            }
+            split_shares(weight, flow_num - total, extra);
+
+            /* Oversample by the expected losses */
+            selected.assign(n, 0);
+            for (size_t i=0; i<n; ++i) {
+                extra[i] = std::min<double>(extra[i],
+                                            volume[i] - size_of(i));
+                quota[i] = extra[i] ?
+                           std::ceil(extra[i] / std::max(yield[i],
+                                                         FILL_MIN_YIELD)) :
+                           0;
+                selected[i] = extra[i] > 0;
+            }
+            MESSAGE("Topping up %lu flows (round %d)...\n",
+                    flow_num - total, round + 1);
+            rule_mapping block;
+            process_block(0, n, block, false);
+
+            /* Keep up to "extra[i]" new headers per rule at the front of
+             * its block range */
+            std::vector<size_t> kept(n);
+            balanced_for(n, [&] (size_t i) {
+                return block.offsets[i+1] - block.offsets[i];
+            },
+            [&] (size_t b, size_t e) {
+                std::vector<packet_hdr> existing;
+                for (size_t i=b; i<e; ++i) {
+                    packet_hdr *first = &block.headers[block.offsets[i]];
+                    size_t count = block.offsets[i+1] - block.offsets[i];
+                    /* Only the rules sampled this round update their
+                     * yield; the others stay eligible */
+                    if (!count) {
+                        if (selected[i]) {
+                            yield[i] = 0;
+                            empty_rounds[i]++;
+                        }
+                        continue;
+                    }
+                    existing.assign(&rmap.headers[rmap.offsets[i]],
+                                    &rmap.headers[rmap.offsets[i]] +
+                                    size_of(i));
+                    if (opts.keep_order) {
+                        std::sort(existing.begin(), existing.end());
+                    }
+                    size_t fresh = 0;
+                    for (size_t k=0; k<count; ++k) {
+                        if (!std::binary_search(existing.begin(),
+                                                existing.end(), first[k])) {
+                            first[fresh++] = first[k];
+                        }
+                    }
+                    yield[i] = (double)fresh / quota[i];
+                    empty_rounds[i] = fresh ? 0 : empty_rounds[i] + 1;
+                    kept[i] = std::min(fresh, extra[i]);
+                }
+            });
+
+            rule_mapping merged;
+            merged.offsets.assign(n + 1, 0);
+            for (size_t i=0; i<n; ++i) {
+                merged.offsets[i+1] = merged.offsets[i] + size_of(i) +
+                                      kept[i];
+                sample_base[i] += quota[i];
+            }
+            merged.headers.resize(merged.offsets[n]);
+            balanced_for(n, [&] (size_t i) {
+                return merged.offsets[i+1] - merged.offsets[i];
+            },
+            [&] (size_t b, size_t e) {
+                for (size_t i=b; i<e; ++i) {
+                    packet_hdr *out = &merged.headers[merged.offsets[i]];
+                    const packet_hdr *old = &rmap.headers[rmap.offsets[i]];
+                    const packet_hdr *add = &block.headers[block.offsets[i]];
+                    out = std::copy(old, old + size_of(i), out);
+                    std::copy(add, add + kept[i], out);
+                    if (!opts.keep_order) {
+                        std::sort(&merged.headers[merged.offsets[i]],
+                                  &merged.headers[merged.offsets[i+1]]);
+                    }
+                }
+            });
+            rmap = std::move(merged);
+            total = rmap.headers.size();
+        }
+
+        quota = requested;
+        selected.clear();
+        sample_base.clear();
+        mismatches = saved_mismatches;
+        culprits = saved_culprits;
+        if (total < flow_num) {
+            throw errorf("could not reach %lu flows after %d rounds: the "
+                         "residual regions hold %lu distinct headers.",
+                         flow_num, round, total);
+        }
+    }
+
+    /**
+     * @brief Generates "miss_num" distinct headers that match no rule into
+     * "misses". The complement of the union of the rules is split into
+     * disjoint boxes (see integer_box_set), and headers are sampled from
+     * the boxes by volume; headers of partial boxes that match a rule are
+     * rejected, so the misses are uniform over the complement. Sample "k"
+     * depends only on the seed and "k".
+     */
+    void
+    generate_misses(uint64_t miss_num)
+    {
+        scoped_timer timer("misses", miss_num);
+        using box_set = integer_box_set<F>;
+        const ruleset<F> &rule_db = *this->rule_db;
+
+        MESSAGE("Computing the uncovered complement of the rules...\n");
+        std::vector<typename box_set::box> covers(rule_db.size());
+        for (size_t i=0; i<rule_db.size(); ++i) {
+            for (int f=0; f<F; ++f) {
+                covers[i][f] = {rule_db[i].fields[f].low,
+                                rule_db[i].fields[f].high};
+            }
+        }
+        box_set region = box_set::complement(covers, MISS_MAX_BOXES,
+                                             MISS_MAX_WORK);
+        misses.clear();
+        if (!region.size()) {
+            MESSAGE("The rules cover the whole domain; no miss headers\n");
+            return;
+        }
+        std::vector<double> volume(region.size());
+        double total = 0;
+        double exact = 0;
+        for (size_t i=0; i<region.size(); ++i) {
+            total += region.volume(i);
+            exact += region.is_exact(i) ? region.volume(i) : 0;
+            volume[i] = total;
+        }
+        if (region.is_truncated()) {
+            MESSAGE("The complement is too fragmented to split fully; %.1f%% "
+                    "of the sampled volume is checked against the rules\n",
+                    100 * (1 - exact / total));
+        }
+
+        random_counter rng(random_core::get_seed(), STREAM_MISS);
+        header_hash_set<F> set;
+        uint64_t drawn = 0;
+        double yield = 1;
+        for (int round=0; round<MISS_ROUNDS && misses.size()<miss_num;
+             ++round) {
+            /* Oversample by the share of the last round that was kept */
+            size_t count = std::ceil((miss_num - misses.size()) /
+                                     std::max(yield, MISS_MIN_YIELD));
+            size_t start = misses.size();
+            std::vector<char> valid(count);
+            misses.resize(start + count);
+            pool.parallel_for(0, count, grain_size(count),
+            [&] (size_t b, size_t e) {
+                for (size_t k=b; k<e; ++k) {
+                    uint64_t sample = drawn + k;
+                    uint64_t r = ((uint64_t)rng(sample, 0, 0) << 32) |
+                                 rng(sample, 0, 1);
+                    double u = (r >> 11) * 0x1.0p-53 * total;
+                    size_t i = std::upper_bound(volume.begin(), volume.end(),
+                                                u) - volume.begin();
+                    const typename box_set::box &bx =
+                        region[std::min(i, region.size() - 1)];
+                    packet_hdr &hdr = misses[start + k];
+                    for (int f=0; f<F; ++f) {
+                        int word = 2 + f;
+                        hdr[f] = random_counter::uniform(
+                                     rng(sample, word / 4, word % 4),
+                                     bx[f][0], bx[f][1]);
+                    }
+                    valid[k] = index->first_match(hdr) < 0;
+                }
+            });
+            drawn += count;
+
+            size_t out = start;
+            for (size_t k=0; k<count; ++k) {
+                if (valid[k]) {
+                    misses[out++] = misses[start + k];
+                }
+            }
+            packet_hdr *end = dedupe_headers<F>(misses.data(),
+                                                misses.data() + out, set);
+            yield = (double)(end - misses.data() - start) / count;
+            misses.resize(std::min<size_t>(end - misses.data(), miss_num));
+        }
+        if (!opts.keep_order) {
+            std::sort(misses.begin(), misses.end());
+        }
+        MESSAGE("Miss headers: %lu of %lu requested\n", misses.size(),
+                miss_num);
+    }
+
+    /**
+     * @brief Writes the requested and achieved flows per rule to
+     * "opts.quota_report" when set, in format RULE-ID: REQUESTED ACHIEVED,
+     * and prints a summary.
+     */
+    void
+    report_quota()
+    {
+        size_t short_num = 0;
+        uint64_t requested = 0;
+        for (size_t i=0; i<quota.size(); ++i) {
+            size_t achieved = rmap.offsets[i+1] - rmap.offsets[i];
+            requested += quota[i];
+            short_num += achieved < quota[i];
+        }
+        MESSAGE("Flows: %lu of %lu requested; %lu rules below their "
+                "quota\n", rmap.headers.size(), requested, short_num);
+
+        if (!opts.quota_report) {
+            return;
+        }
+        FILE *file = fopen(opts.quota_report, "w");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.",
+                         opts.quota_report);
+        }
+        for (size_t i=0; i<quota.size(); ++i) {
+            fprintf(file, "%lu: %lu %lu\n", i, quota[i],
+                    rmap.offsets[i+1] - rmap.offsets[i]);
+        }
+        fclose(file);
+    }
+
+    /**
+     * @brief Reports how much of the mapping a run with a time budget
+     * completed: the rules with headers, unique and non-unique, the rules
+     * skipped at the deadline, and the flows. Written to
+     * "opts.coverage_report" as well, when set.
+     */
+    void
+    report_coverage()
+    {
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - started;
+        size_t n = quota.size();
+        size_t covered = 0;
+        size_t unique = 0;
+        size_t unique_covered = 0;
+        uint64_t requested = 0;
+        for (size_t i=0; i<n; ++i) {
+            bool has_headers = rmap.offsets[i+1] > rmap.offsets[i];
+            covered += has_headers;
+            unique += !is_non_unique[i];
+            unique_covered += has_headers && !is_non_unique[i];
+            requested += quota[i];
+        }
+        size_t non_unique = n - unique;
+        size_t skipped = skipped_rules.load();
+        MESSAGE("Coverage after %.3f of %.3f seconds: %lu of %lu rules "
+                "(%lu of %lu unique, %lu of %lu non-unique); %lu rules "
+                "skipped at the deadline\n", elapsed.count(),
+                opts.time_budget, covered, n, unique_covered, unique,
+                covered - unique_covered, non_unique, skipped);
+
+        if (!opts.coverage_report) {
+            return;
+        }
+        FILE *file = fopen(opts.coverage_report, "w");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.",
+                         opts.coverage_report);
+        }
+        fprintf(file, "seconds: %.3f\n", elapsed.count());
+        fprintf(file, "budget: %.3f\n", opts.time_budget);
+        fprintf(file, "rules: %lu %lu\n", covered, n);
+        fprintf(file, "unique_rules: %lu %lu\n", unique_covered, unique);
+        fprintf(file, "non_unique_rules: %lu %lu\n",
+                covered - unique_covered, non_unique);
+        fprintf(file, "skipped_rules: %lu\n", skipped);
+        fprintf(file, "unreachable_rules: %lu\n", unreachable_rules.load());
+        fprintf(file, "flows: %lu %lu\n", rmap.headers.size(), requested);
+        fclose(file);
+    }
+
+    /**
+     * @brief Reports unreachable rules and verification mismatches.
+     */
+    void
+    report()
+    {
+        if (unreachable_rules > 0) {
+            MESSAGE("Could not generate mapping for %lu rules.\n",
+                unreachable_rules.load());
+        }
+
+        size_t total = 0;
+        std::vector<int> failed;
+        for (size_t i=0; i<mismatches.size(); ++i) {
+            if (mismatches[i]) {
+                total += mismatches[i];
+                failed.push_back(i);
+            }
+        }
+        if (!total) {
+            return;
+        }
+
+        MESSAGE("Dropped %lu headers of %lu rules that do not match their "
+                "rule first.\n", total, failed.size());
+        std::stable_sort(failed.begin(), failed.end(), [&] (int a, int b) {
+            return mismatches[a] > mismatches[b];
+        });
+        for (size_t i=0; i<failed.size() && i<10; ++i) {
+            MESSAGE("  rule %d: %lu headers (first match: %d)\n",
+                    failed[i], mismatches[failed[i]], culprits[failed[i]]);
+        }
+
+        if (opts.verify_report) {
+            FILE *file = fopen(opts.verify_report, "w");
+            if (!file) {
+                throw errorf("cannot open \"%s\" for writing.",
+                             opts.verify_report);
+            }
+            std::sort(failed.begin(), failed.end());
+            for (int r : failed) {
+                fprintf(file, "%d: %lu %d\n", r, mismatches[r], culprits[r]);
+            }
+            fclose(file);
+        }
+    }
+
+    /**
+     * @brief Writes the rule database section of the binary format, with
+     * rules [first, last) or all rules.
+     */
+    void
+    write_ruledb(zstream &file, size_t first = 0, size_t last = SIZE_MAX)
+    {
+        last = std::min(last, rule_db->size());
+        file << "ruledb"
+             << (uint32_t)(last - first)
+             << F;
+
+        for (size_t i=first; i<last; ++i) {
+            file << rule_db->at(i).priority;
+            for (int f=0; f<F; ++f) {
+                file << rule_db->at(i).fields[f].low
+                     << rule_db->at(i).fields[f].high;
+            }
+        }
+    }
+
+    /**
+     * @brief Writes the rule weights section of the binary format, which
+     * follows the packet database. Uniform mappings omit it, and readers
+     * treat a missing section as uniform weights. Writes the weights of
+     * rules [first, last) or of all rules.
+     */
+    void
+    write_weights(zstream &file, size_t first = 0, size_t last = SIZE_MAX)
+    {
+        if (opts.distribution == flow_distribution::uniform) {
+            return;
+        }
+        last = std::min(last, weights.size());
+        file << "flowdist"
+             << (uint32_t)(last - first);
+        file.write(&weights[first], (last - first) * sizeof(double));
+    }
+
+    /**
+     * @brief Writes the multi-match section of the binary format, which
+     * follows the rule weights, if "annotate_matches" ran: the number of
+     * rules kept per header (0xffffffff for all), the header count, the
+     * number of matching rules per header, and the kept rules of all
+     * headers.
+     */
+    void
+    write_matches(zstream &file)
+    {
+        if (match_offsets.empty()) {
+            return;
+        }
+        file << "overlaps"
+             << (uint32_t)(opts.match_limit ? opts.match_limit : 0xffffffff);
+        file.write_count(match_counts.size());
+        file.write(match_counts.data(), match_counts.size() * sizeof(uint32_t));
+        file.write_count(match_rules.size());
+        file.write(match_rules.data(), match_rules.size() * sizeof(uint32_t));
+    }
+
+    /**
+     * @brief Writes the header hash section of the binary format, which
+     * follows the multi-match section: a minimal perfect hash over the
+     * "header_num" headers of the file (see perfect_hash), and the seed of
+     * its keys. Readers map an arbitrary header to its record with it.
+     * "fill_keys(seed, keys)" sets the key of each header under "seed".
+     */
+    template <typename Fn>
+    void
+    write_header_hash(zstream &file, size_t header_num, Fn fill_keys)
+    {
+        scoped_timer timer("header_hash", header_num);
+        if (!header_num) {
+            return;
+        }
+
+        MESSAGE("Building the header hash... ");
+        std::vector<uint64_t> keys(header_num);
+        perfect_hash hash;
+        uint32_t seed = 0;
+        for (;; ++seed) {
+            if (seed == HASH_SEEDS) {
+                throw errorf("cannot build the header hash: the headers are "
+                             "not distinct.");
+            }
+            fill_keys(seed, keys);
+            if (hash.build(keys)) {
+                break;
+            }
+        }
+        MESSAGE("done\n");
+        file << "perfhash" << seed;
+        hash.write(file);
+    }
+
+    /**
+     * @brief Writes the header hash section over the headers of "rmap" and
+     * "misses"
+     */
+    void
+    write_header_hash(zstream &file)
+    {
+        size_t hit_num = rmap.headers.size();
+        size_t header_num = hit_num + misses.size();
+        write_header_hash(file, header_num,
+        [&] (uint32_t seed, std::vector<uint64_t> &keys) {
+            pool.parallel_for(0, header_num, grain_size(header_num),
+            [&] (size_t b, size_t e) {
+                for (size_t k=b; k<e; ++k) {
+                    const packet_hdr &hdr = k < hit_num ? rmap.headers[k] :
+                                            misses[k - hit_num];
+                    keys[k] = perfect_hash::hash_key(hdr.data(), F, seed);
+                }
+            });
+        });
+    }
+
+    /**
+     * @brief Serializes the headers of "block", which starts at rule "first",
+     * as binary packet records (F fields followed by the rule index) into
+     * "out".
+     */
+    static void
+    pack_headers(size_t first,
+                 const rule_mapping &block,
+                 std::vector<uint32_t> &out)
+    {
+        out.clear();
+        out.reserve(block.headers.size() * (F+1));
+        for (size_t i=0; i+1<block.offsets.size(); ++i) {
+            for (size_t k=block.offsets[i]; k<block.offsets[i+1]; ++k) {
+                const packet_hdr &hdr = block.headers[k];
+                out.insert(out.end(), hdr.begin(), hdr.end());
+                out.push_back(first + i);
+            }
+        }
+    }
+
+    /**
+     * @brief Writes the headers of rules [begin, end) of "block" to "file"
+     * as binary packet records, with rule index "first" for rule "begin",
+     * packing up to RECORD_CHUNK headers at a time
+     */
+    static void
+    write_records(zstream &file,
+                  const rule_mapping &block,
+                  size_t begin,
+                  size_t end,
+                  size_t first)
+    {
+        std::vector<uint32_t> records;
+        records.reserve(RECORD_CHUNK * (F+1));
+        for (size_t i=begin; i<end; ++i) {
+            for (size_t k=block.offsets[i]; k<block.offsets[i+1]; ++k) {
+                const packet_hdr &hdr = block.headers[k];
+                records.insert(records.end(), hdr.begin(), hdr.end());
+                records.push_back(first + i - begin);
+                if (records.size() == RECORD_CHUNK * (F+1)) {
+                    file.write(records.data(),
+                               records.size() * sizeof(uint32_t));
+                    records.clear();
+                }
+            }
+        }
+        file.write(records.data(), records.size() * sizeof(uint32_t));
+    }
+
+    const ruleset<F> *rule_db;
+    rule_mapping rmap;
+    /* Headers that match no rule */
+    std::vector<packet_hdr> misses;
+    /* Multi-match annotation per header of "rmap" and "misses": the number
+     * of matching rules, and the kept rules, match_rules[match_offsets[k]]
+     * ... match_rules[match_offsets[k+1]-1] */
+    std::vector<uint32_t> match_counts;
+    std::vector<uint64_t> match_offsets;
+    std::vector<uint32_t> match_rules;
+    mapping_options opts;
+    thread_pool pool;
+
+    /* Flows and normalized weight per rule */
+    std::vector<size_t> quota;
+    std::vector<double> weights;
+    /* Exclusive ranges per field, one list per domain segment */
+    std::array<std::vector<std::vector<exclusive_range>>, F> segments;
+    std::vector<char> is_non_unique;
+    /* Rules that "process_block" generates; empty for all rules */
+    std::vector<char> selected;
+    /* Position of the first value "process_block" samples per rule; empty
+     * for zero */
+    std::vector<size_t> sample_base;
+    std::unique_ptr<rule_index<F>> index;
+
+    /* Headers of "rmap" already in the checkpoint headers file */
+    size_t saved_headers;
+
+    /* Verification state, per rule */
+    std::vector<size_t> mismatches;
+    std::vector<int> culprits;
+    std::atomic<size_t> unreachable_rules;
+
+    /* Start of "run" and the time "opts.time_budget" runs out; rules not
+     * sampled by then are skipped */
+    std::chrono::steady_clock::time_point started;
+    std::chrono::steady_clock::time_point deadline;
+    std::atomic<size_t> skipped_rules;
+
+    inline bool
+    past_deadline() const
+    {
+        return opts.time_budget > 0 &&
+               std::chrono::steady_clock::now() >= deadline;
+    }
+
+public:
+
+    /**
+     * @brief Sets [first, last) to the rules of shard "index" of "num"
+     * shards of "rule_num" rules: consecutive ranges in priority order, of
+     * equal size up to one rule
+     */
+    static void
+    shard_range(size_t rule_num, size_t index, size_t num, size_t &first,
+                size_t &last)
+    {
+        first = rule_num * index / num;
+        last = rule_num * (index + 1) / num;
+    }
+
+    /**
+     * @brief Creates a new mapping with options "opts".
+     */
+    mapping(const mapping_options &opts = mapping_options())
+    : rule_db(nullptr),
+      opts(opts),
+      pool(opts.thread_num),
+      saved_headers(0),
+      unreachable_rules(0),
+      skipped_rules(0)
+    {}
+
+    /**
+     * @brief Processes "rule_db" and generates a total "flow_num" packets.
+     * Saves checkpoints and resumes from them as set by "opts.checkpoint"
+     * and "opts.resume", and tops up the flows when "opts.exact_flows" is
+     * set. A share "opts.miss_ratio" of the flows match no rule. With
+     * "opts.shard_num", only the headers of a shard are generated. With
+     * "opts.time_budget", unique rules are sampled in rule order and then
+     * non-unique rules by their flows until the budget runs out; the
+     * headers sampled are deduplicated and verified either way, as are the
+     * misses generated, so these phases may run past the budget.
+    */
+    void
+    run(const ruleset<F> &rule_db, uint64_t flow_num)
+    {
+        started = std::chrono::steady_clock::now();
+        deadline = started + std::chrono::duration_cast<
+                   std::chrono::steady_clock::duration>(
+                   std::chrono::duration<double>(opts.time_budget));
+        skipped_rules = 0;
+        uint64_t miss_num = std::llround(flow_num * opts.miss_ratio);
+        uint64_t hit_num = flow_num - miss_num;
+        if (opts.checkpoint) {
+            run_checkpointed(rule_db, hit_num);
+        } else if (opts.shard_num) {
+            prepare(rule_db, hit_num);
+            process_shard();
+        } else {
+            prepare(rule_db, hit_num);
+            process_block(0, rule_db.size(), rmap, true);
+        }
+        if (opts.exact_flows) {
+            fill_quota(hit_num);
+        }
+        report();
+        if (opts.exact_flows || opts.quota_report) {
+            report_quota();
+        }
+        if (miss_num) {
+            generate_misses(miss_num);
+        }
+        if (opts.time_budget > 0) {
+            report_coverage();
+        }
+    }
+
+    /**
+     * @brief Processes "rule_db" in blocks of rules and generates a total
+     * "flow_num" packets. The headers of each block are written to
+     * "text_filename" and "binary_filename" (when not null) and freed before
+     * the next block starts. The block size follows "opts.stream_budget";
+     * rules that do not fit in it alone are spilled to disk next to
+     * "text_filename" (see "process_large_rule"). With "opts.pipeline_depth",
+     * blocks are written while the next ones are generated, and the blocks
+     * in flight share the budget.
+     */
+    void
+    run_streaming(const ruleset<F> &rule_db,
+                  uint64_t flow_num,
+                  const char *text_filename,
+                  const char *binary_filename)
+    {
+        prepare(rule_db, flow_num);
+
+        /* Field values and headers of a rule */
+        auto rule_bytes = [&] (size_t i) {
+            size_t values = is_non_unique[i] ? 1 : quota[i];
+            return values * (F * sizeof(uint32_t) + sizeof(packet_hdr));
+        };
+        /* A block being generated takes up to "budget"; a generated block
+         * keeps its headers only, at most half of that. Up to depth+1
+         * generated blocks wait for or are in the text stage. */
+        size_t depth = opts.pipeline_depth;
+        size_t budget = depth ? opts.stream_budget * 2 / (depth + 3) :
+                                opts.stream_budget;
+        size_t spill_batch = budget / (2 * sizeof(packet_hdr));
+        std::string spill_prefix = std::string(text_filename) + ".run";
+        MESSAGE("Streaming in blocks of up to %lu bytes\n", budget);
+
+        text_writer<F> text;
+        text.open(text_filename);
+
+        /* Packet records are spooled to a temporary file, as the binary
+         * format starts with their number */
+        spool_file spool;
+        if (binary_filename) {
+            spool.open(std::string(binary_filename) + ".spool");
+        }
+
+        std::vector<uint32_t> records;
+        size_t header_num = 0;
+
+        /* Blocks are shared by the stages and freed after both wrote them */
+        struct written_block {
+            size_t first;
+            std::shared_ptr<rule_mapping> block;
+        };
+        auto write_text = [&] (const written_block &b) {
+            scoped_timer timer("write_block", b.block->headers.size());
+            text.write_block(b.first, b.block->headers, b.block->offsets,
+                             pool);
+        };
+        std::vector<uint32_t> spool_records;
+        auto write_spool = [&] (const written_block &b) {
+            scoped_timer timer("spool_block", b.block->headers.size());
+            pack_headers(b.first, *b.block, spool_records);
+            spool.write(spool_records.data(), spool_records.size());
+            spool_records.clear();
+        };
+        std::unique_ptr<pipeline_stage<written_block>> text_stage;
+        std::unique_ptr<pipeline_stage<written_block>> spool_stage;
+        if (depth) {
+            text_stage.reset(new pipeline_stage<written_block>(depth,
+                                                                write_text));
+            if (spool.is_open()) {
+                spool_stage.reset(new pipeline_stage<written_block>(depth,
+                                                                write_spool));
+            }
+        }
+
+        for (size_t first=0; first<rule_db.size(); ) {
+            print_progress("Generating and writing blocks", first,
+                           rule_db.size());
+            if (rule_bytes(first) > budget) {
+                /* Large rules are written in place, after the blocks */
+                if (depth) {
+                    text_stage->drain();
+                    if (spool_stage) {
+                        spool_stage->drain();
+                    }
+                }
+                scoped_timer large_timer("large_rule");
+                size_t large_num = process_large_rule(first, spill_batch,
+                                                      spill_prefix,
+                [&] (const packet_hdr &hdr) {
+                    text.append(first, hdr);
+                    if (!spool.is_open()) {
+                        return;
+                    }
+                    records.insert(records.end(), hdr.begin(), hdr.end());
+                    records.push_back(first);
+                    if (records.size() >= (1 << 20)) {
+                        spool.write(records.data(), records.size());
+                        records.clear();
+                    }
+                });
+                if (spool.is_open()) {
+                    spool.write(records.data(), records.size());
+                    records.clear();
+                }
+                large_timer.add_items(large_num);
+                header_num += large_num;
+                first++;
+                continue;
+            }
+
+            size_t last = first;
+            size_t bytes = 0;
+            while (last < rule_db.size() &&
+                   bytes + rule_bytes(last) <= budget) {
+                bytes += rule_bytes(last++);
+            }
+            written_block b = {first, std::make_shared<rule_mapping>()};
+            process_block(first, last, *b.block, false);
+            header_num += b.block->headers.size();
+            if (depth) {
+                text_stage->push(b);
+                if (spool_stage) {
+                    spool_stage->push(b);
+                }
+            } else {
+                write_text(b);
+                if (spool.is_open()) {
+                    write_spool(b);
+                }
+            }
+            first = last;
+        }
+        if (depth) {
+            text_stage->finish();
+            if (spool_stage) {
+                spool_stage->finish();
+            }
+        }
+        print_progress("Generating and writing blocks", 0, 0);
+        text.close();
+        report();
+
+        if (!spool.is_open()) {
+            return;
+        }
+
+        zstream file;
+        MESSAGE("Writing bianry data to file %s... ", binary_filename);
+        MESSAGE("total packet headers: %lu \n", header_num);
+        file.open_write(binary_filename);
+        write_ruledb(file);
+        file << "packetdb";
+        file.write_count(header_num);
+
+        spool.read_all([&] (const char *data, size_t bytes) {
+            file.write(data, bytes);
+        });
+        write_weights(file);
+
+        /* The keys are read back from the spooled records */
+        write_header_hash(file, header_num,
+        [&] (uint32_t seed, std::vector<uint64_t> &keys) {
+            size_t k = 0;
+            spool.read_all([&] (const char *data, size_t bytes) {
+                const uint32_t *record = (const uint32_t*)data;
+                size_t count = bytes / ((F+1) * sizeof(uint32_t));
+                for (size_t j=0; j<count; ++j, record+=F+1) {
+                    keys[k++] = perfect_hash::hash_key(record, F, seed);
+                }
+            }, (F+1) * sizeof(uint32_t));
+        });
+        spool.close();
+    }
+
+    /**
+     * @brief Processes "rule_db", an updated version of the ruleset of the
+     * previous mapping "prev", and generates headers only for the rules whose
+     * first-match region may have changed: added rules, and rules that
+     * overlap a rule added or removed above them. The headers of all other
+     * rules are copied from "prev". Regenerated rules get their share of
+     * "flow_num", and the headers of a full run, as in "run". Besides reading
+     * the rules, diffing them and copying the headers, the work follows the
+     * number of regenerated rules and their overlaps.
+     */
+    void
+    run_incremental(const ruleset<F> &rule_db, uint64_t flow_num, reader &prev)
+    {
+        if (prev.get_field_num() != F) {
+            throw errorf("previous mapping has %lu fields, expected %d.",
+                         prev.get_field_num(), F);
+        }
+
+        size_t n = rule_db.size();
+        this->rule_db = &rule_db;
+        assign_quotas(flow_num);
+        mismatches.assign(n, 0);
+        culprits.assign(n, -1);
+        unreachable_rules = 0;
+
+        std::vector<int64_t> previous;
+        std::vector<size_t> removed = diff_rules(rule_db, prev, previous);
+        size_t added_num = std::count(previous.begin(), previous.end(), -1);
+
+        scoped_timer overlap_timer("overlap_index", n);
+        overlap_index<F> overlaps(rule_db, &pool);
+        overlap_timer.stop();
+        scoped_timer changed_timer("changed_rules", added_num + removed.size());
+        std::vector<size_t> rules = changed_rules(overlaps, prev, previous,
+                                                  removed);
+        changed_timer.stop();
+        MESSAGE("Rule diff: %lu added, %lu removed, %lu kept; regenerating "
+                "%lu rules\n", added_num, removed.size(), n - added_num,
+                rules.size());
+        /* When most rules change, the sweep over the ruleset is cheaper */
+        if (rules.size() * 2 > n) {
+            prepare(rule_db, flow_num);
+        } else {
+            prepare_rules(overlaps, rules);
+        }
+
+        /* Changed rules are generated in spans; the unchanged rules inside a
+         * span cost a few loop iterations each */
+        selected.assign(n, 0);
+        for (size_t i : rules) {
+            selected[i] = 1;
+        }
+        std::vector<size_t> span_first;
+        std::vector<rule_mapping> spans;
+        for (size_t k=0; k<rules.size(); ) {
+            print_progress("Regenerating rules", k, rules.size());
+            size_t end = k + 1;
+            while (end < rules.size() &&
+                   rules[end] - rules[end-1] <= INCREMENTAL_GAP) {
+                ++end;
+            }
+            span_first.push_back(rules[k]);
+            spans.emplace_back();
+            process_block(rules[k], rules[end-1] + 1, spans.back(), false);
+            k = end;
+        }
+        print_progress("Regenerating rules", 0, 0);
+        report();
+
+        /* Merge the regenerated headers with the reused ones */
+        auto span_of = [&] (size_t i) {
+            return std::upper_bound(span_first.begin(), span_first.end(), i) -
+                   span_first.begin() - 1;
+        };
+        rmap.offsets.assign(n + 1, 0);
+        for (size_t i=0; i<n; ++i) {
+            size_t size;
+            if (selected[i]) {
+                size_t s = span_of(i);
+                const std::vector<size_t> &offsets = spans[s].offsets;
+                size = offsets[i - span_first[s] + 1] -
+                       offsets[i - span_first[s]];
+            } else {
+                size = prev.get_rule_header_num(previous[i]);
+            }
+            rmap.offsets[i+1] = rmap.offsets[i] + size;
+        }
+        rmap.headers.resize(rmap.offsets.back());
+        balanced_for(n, [&] (size_t i) {
+            return rmap.offsets[i+1] - rmap.offsets[i];
+        },
+        [&] (size_t b, size_t e) {
+            for (size_t i=b; i<e; ++i) {
+                packet_hdr *out = &rmap.headers[rmap.offsets[i]];
+                if (selected[i]) {
+                    size_t s = span_of(i);
+                    const rule_mapping &span = spans[s];
+                    size_t r = i - span_first[s];
+                    std::copy(span.headers.data() + span.offsets[r],
+                              span.headers.data() + span.offsets[r+1], out);
+                    continue;
+                }
+                for (size_t k=0; k<rmap.offsets[i+1]-rmap.offsets[i]; ++k) {
+                    const uint32_t *hdr = prev.get_header(
+                        prev.get_rule_header(previous[i], k));
+                    std::copy(hdr, hdr + F, out[k].begin());
+                }
+            }
+        });
+        selected.clear();
+    }
+
+    /**
+     * @brief Deletes the checkpoint files of "opts.checkpoint", once the
+     * outputs of the run are written
+     */
+    void
+    remove_checkpoint()
+    {
+        if (!opts.checkpoint) {
+            return;
+        }
+        remove(opts.checkpoint);
+        remove((std::string(opts.checkpoint) + ".headers").c_str());
+        remove((std::string(opts.checkpoint) + ".fields").c_str());
+    }
+
+    /**
+     * @brief Finds all rules each header of the mapping matches, for
+     * multi-match classifiers. Keeps their count and the first
+     * "opts.match_limit" of them in priority order, which
+     * "save_binary_format" writes. Uses the bitmap intersection of the rule
+     * index; must follow "run" or "run_incremental".
+     */
+    void
+    annotate_matches()
+    {
+        /* The index of "run_incremental" covers the regenerated rules */
+        if (index->size() < rule_db->size()) {
+            MESSAGE("Building rule index...\n");
+            scoped_timer index_timer("rule_index", rule_db->size());
+            index.reset(new rule_index<F>(*rule_db, &pool));
+        }
+        size_t hit_num = rmap.headers.size();
+        size_t header_num = hit_num + misses.size();
+        scoped_timer timer("multi_match", header_num);
+        uint64_t limit = opts.match_limit ? opts.match_limit : UINT64_MAX;
+        size_t piece_num = (header_num + VALUE_CHUNK - 1) / VALUE_CHUNK;
+        std::vector<std::vector<uint32_t>> piece_rules(piece_num);
+
+        MESSAGE("Annotating the matching rules of each header...\n");
+        match_counts.resize(header_num);
+        pool.parallel_for(0, piece_num, 1, [&] (size_t b, size_t e) {
+            for (size_t p=b; p<e; ++p) {
+                size_t stop = std::min(header_num, (p + 1) * VALUE_CHUNK);
+                for (size_t k=p*VALUE_CHUNK; k<stop; ++k) {
+                    const packet_hdr &hdr = k < hit_num ? rmap.headers[k] :
+                                            misses[k - hit_num];
+                    uint32_t count = 0;
+                    index->for_each_match(hdr, [&] (size_t rule_idx) {
+                        if (count++ < limit) {
+                            piece_rules[p].push_back(rule_idx);
+                        }
+                    });
+                    match_counts[k] = count;
+                }
+            }
+        });
+
+        match_offsets.resize(header_num + 1);
+        match_offsets[0] = 0;
+        uint32_t most = 0;
+        for (size_t k=0; k<header_num; ++k) {
+            match_offsets[k+1] = match_offsets[k] +
+                                 std::min<uint64_t>(match_counts[k], limit);
+            most = std::max(most, match_counts[k]);
+        }
+        match_rules.resize(match_offsets[header_num]);
+        pool.parallel_for(0, piece_num, 1, [&] (size_t b, size_t e) {
+            for (size_t p=b; p<e; ++p) {
+                std::copy(piece_rules[p].begin(), piece_rules[p].end(),
+                          match_rules.begin() +
+                          match_offsets[p * VALUE_CHUNK]);
+                std::vector<uint32_t>().swap(piece_rules[p]);
+            }
+        });
+
+        uint64_t total = std::accumulate(match_counts.begin(),
+                                         match_counts.end(), (uint64_t)0);
+        MESSAGE("Matching rules per header: %.2f on average, at most %u\n",
+                header_num ? (double)total / header_num : 0.0, most);
+    }
+
+    /**
+     * @brief Returns the number of generated headers, including the ones
+     * that match no rule
+     */
+    size_t
+    get_header_num() const
+    {
+        return rmap.headers.size() + misses.size();
+    }
+
+    /**
+     * @brief Copies headers "first" ... "first+num-1", in the order of the
+     * text and binary files, to "headers" (F values each) and their rule
+     * indices to "rules" (reader::MISS_RULE_ID for misses). Either may be
+     * null. Headers past the last one are not copied; returns the number
+     * of headers copied.
+     */
+    size_t
+    get_headers(size_t first, size_t num, uint32_t *headers,
+                uint32_t *rules) const
+    {
+        size_t hit_num = rmap.headers.size();
+        size_t last = std::min(first + num, get_header_num());
+        if (first >= last) {
+            return 0;
+        }
+        size_t i = std::upper_bound(rmap.offsets.begin(), rmap.offsets.end(),
+                                    first) - rmap.offsets.begin() - 1;
+        for (size_t k=first; k<last; ++k) {
+            const packet_hdr &hdr = k < hit_num ? rmap.headers[k] :
+                                                  misses[k - hit_num];
+            if (headers) {
+                std::copy(hdr.begin(), hdr.end(), headers + (k - first) * F);
+            }
+            if (!rules) {
+                continue;
+            }
+            if (k >= hit_num) {
+                rules[k - first] = reader::MISS_RULE_ID;
+                continue;
+            }
+            while (rmap.offsets[i+1] <= k) {
+                i++;
+            }
+            rules[k - first] = i;
+        }
+        return last - first;
+    }
+
+    /**
+     * @brief Saves the packet mapping into a textual file in format
+     * RULE-ID: FIELD0 FIELD1 ... Headers that match no rule follow, with
+     * RULE-ID reader::MISS_RULE_ID.
+    */
+    void
+    save_text_mapping(const char *filename)
+    {
+        MESSAGE("Writing mapping to file \"%s\"...\n", filename);
+        scoped_timer timer("write_text",
+                           rmap.headers.size() + misses.size());
+        text_writer<F> file;
+        file.open(filename);
+        file.write_block(0, rmap.headers, rmap.offsets, pool);
+        for (const packet_hdr &hdr : misses) {
+            file.append(reader::MISS_RULE_ID, hdr);
+        }
+        file.close();
+    }
+
+    /**
+     * @brief Saves the rule-db and packet data into a compreseed bunary-file
+     * that can be loaded later in order to replay packets.
+     */
+    void
+    save_binary_format(const char *filename)
+    {
+        zstream file;
+        std::vector<uint32_t> records;
+
+        MESSAGE("Writing bianry data to file %s... ", filename);
+        file.open_write(filename);
+
+        /* Write rule database */
+        write_ruledb(file);
+
+        size_t header_num = rmap.headers.size() + misses.size();
+        MESSAGE("total packet headers: %lu \n", header_num);
+
+        /* Write packet database, the misses last */
+        scoped_timer timer("write_binary", header_num);
+        file << "packetdb";
+        file.write_count(header_num);
+
+        write_records(file, rmap, 0, rule_db->size(), 0);
+        records.reserve(RECORD_CHUNK * (F+1));
+        for (size_t k=0; k<misses.size(); k+=RECORD_CHUNK) {
+            records.clear();
+            for (size_t j=k; j<misses.size() && j<k+RECORD_CHUNK; ++j) {
+                records.insert(records.end(), misses[j].begin(),
+                               misses[j].end());
+                records.push_back(reader::MISS_RULE_ID);
+            }
+            file.write(records.data(), records.size() * sizeof(uint32_t));
+        }
+        timer.stop();
+
+        write_weights(file);
+        write_matches(file);
+        write_header_hash(file);
+    }
+
+    /**
+     * @brief Saves the rules of shard "opts.shard_index" and their headers
+     * into a binary file, as "save_binary_format" does with rule indices
+     * relative to the shard, followed by a "shardinf" section: the shard
+     * index, the number of shards, the first rule of the shard and the
+     * number of rules of the ruleset. See shard_merger.
+     */
+    void
+    save_shard_binary(const char *filename)
+    {
+        size_t n = rule_db->size();
+        size_t first, last;
+        shard_range(n, opts.shard_index, opts.shard_num, first, last);
+        zstream file;
+
+        MESSAGE("Writing shard binary data to file %s... ", filename);
+        MESSAGE("total packet headers: %lu \n", rmap.headers.size());
+        scoped_timer timer("write_binary", rmap.headers.size());
+        file.open_write(filename);
+
+        write_ruledb(file, first, last);
+        file << "packetdb";
+        file.write_count(rmap.headers.size());
+        write_records(file, rmap, first, last, 0);
+        write_weights(file, first, last);
+        file << "shardinf"
+             << (uint32_t)opts.shard_index
+             << (uint32_t)opts.shard_num
+             << (uint32_t)first
+             << (uint32_t)n;
     }
 
 };
@@ -0,0 +1,279 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unistd.h>
+
+#include "errorf.h"
+
+namespace cbmapper {
+
+/* Structures whose memory is accounted by "counting_allocator" */
+enum memory_category {
+    MEMORY_INTERVAL_SETS = 0,
+    MEMORY_FIELD_VALUES,
+    MEMORY_RULE_MAPPING,
+    MEMORY_READER_HEADERS,
+    MEMORY_DEDUPE_SETS,
+    MEMORY_CATEGORY_NUM
+};
+
+/**
+ * @brief Accounts the bytes the major structures hold, per category, and the
+ * resident set size of the process. Disabled by default, so that allocations
+ * cost a single branch; enabled before any accounted allocation, so that
+ * every deallocation matches an accounted allocation. With a budget, an
+ * allocation that would exceed it throws instead, with the bytes of each
+ * category, before the kernel has to kill the process.
+ */
+class memory_tracker {
+
+    /* Allocations of at least this size also check the resident set */
+    static constexpr size_t RSS_CHECK_BYTES = 16UL << 20;
+
+    struct storage {
+        bool enabled = false;
+        size_t budget = 0;
+        std::atomic<size_t> total{0};
+        std::atomic<size_t> current[MEMORY_CATEGORY_NUM];
+        std::atomic<size_t> peak[MEMORY_CATEGORY_NUM];
+    };
+
+    static inline storage &
+    get_storage()
+    {
+        static storage s;
+        return s;
+    }
+
+    /**
+     * @brief Throws the diagnostic of an allocation of "bytes" for "category"
+     * that exceeds the budget, with "what" used up already
+     */
+    [[noreturn]] static void
+    fail(memory_category category, size_t bytes, const char *what,
+         size_t used)
+    {
+        storage &s = get_storage();
+        std::string usage;
+        char buffer[128];
+        for (int c=0; c<MEMORY_CATEGORY_NUM; ++c) {
+            snprintf(buffer, sizeof(buffer), "%s%s %.1f MB",
+                     c ? ", " : "", category_name(c),
+                     s.current[c].load() / 1048576.0);
+            usage += buffer;
+        }
+        throw errorf("memory budget of %.1f MB exceeded: allocating %.1f MB "
+                     "of %s with %.1f MB %s (resident %.1f MB; %s)",
+                     s.budget / 1048576.0, bytes / 1048576.0,
+                     category_name(category), used / 1048576.0, what,
+                     rss_bytes() / 1048576.0, usage.c_str());
+    }
+
+    /**
+     * @brief Returns the value of "key" in /proc/self/status, in bytes
+     */
+    static size_t
+    read_status(const char *key)
+    {
+        FILE *file = fopen("/proc/self/status", "r");
+        if (!file) {
+            return 0;
+        }
+        char line[256];
+        size_t len = strlen(key);
+        size_t kb = 0;
+        while (fgets(line, sizeof(line), file)) {
+            if (!strncmp(line, key, len) && line[len] == ':') {
+                sscanf(line + len + 1, "%lu", &kb);
+                break;
+            }
+        }
+        fclose(file);
+        return kb << 10;
+    }
+
+public:
+
+    /**
+     * @brief Starts accounting. Allocations that would take the accounted
+     * bytes, or the resident set for large allocations, above "budget"
+     * throw. Use zero for no budget.
+     */
+    static void
+    enable(size_t budget = 0)
+    {
+        storage &s = get_storage();
+        s.enabled = true;
+        s.budget = budget;
+    }
+
+    static inline bool
+    enabled()
+    {
+        return get_storage().enabled;
+    }
+
+    static size_t
+    get_budget()
+    {
+        return get_storage().budget;
+    }
+
+    static const char *
+    category_name(int category)
+    {
+        static const char *names[MEMORY_CATEGORY_NUM] = {
+            "interval_sets", "field_values", "rule_mapping", "reader_headers",
+            "dedupe_sets"
+        };
+        return names[category];
+    }
+
+    /**
+     * @brief Accounts "bytes" more for "category", or throws if that
+     * exceeds the budget
+     */
+    static void
+    allocate(memory_category category, size_t bytes)
+    {
+        storage &s = get_storage();
+        size_t total = s.total.fetch_add(bytes) + bytes;
+        if (s.budget) {
+            if (total > s.budget) {
+                s.total.fetch_sub(bytes);
+                fail(category, bytes, "accounted", total - bytes);
+            }
+            size_t rss;
+            if (bytes >= RSS_CHECK_BYTES &&
+                (rss = rss_bytes()) + bytes > s.budget) {
+                s.total.fetch_sub(bytes);
+                fail(category, bytes, "resident", rss);
+            }
+        }
+        size_t now = s.current[category].fetch_add(bytes) + bytes;
+        size_t peak = s.peak[category].load();
+        while (now > peak &&
+               !s.peak[category].compare_exchange_weak(peak, now));
+    }
+
+    static void
+    deallocate(memory_category category, size_t bytes)
+    {
+        storage &s = get_storage();
+        s.total.fetch_sub(bytes);
+        s.current[category].fetch_sub(bytes);
+    }
+
+    /**
+     * @brief Returns the bytes "category" holds now
+     */
+    static size_t
+    current_bytes(int category)
+    {
+        return get_storage().current[category].load();
+    }
+
+    /**
+     * @brief Returns the most bytes "category" held at once
+     */
+    static size_t
+    peak_bytes(int category)
+    {
+        return get_storage().peak[category].load();
+    }
+
+    /**
+     * @brief Returns the resident set size of the process in bytes
+     */
+    static size_t
+    rss_bytes()
+    {
+        FILE *file = fopen("/proc/self/statm", "r");
+        if (!file) {
+            return 0;
+        }
+        size_t pages = 0;
+        if (fscanf(file, "%*u %lu", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(file);
+        return pages * sysconf(_SC_PAGESIZE);
+    }
+
+    /**
+     * @brief Returns the largest resident set size of the process so far
+     */
+    static size_t
+    peak_rss_bytes()
+    {
+        return read_status("VmHWM");
+    }
+};
+
+/**
+ * @brief An allocator that accounts its memory in "Category" of
+ * memory_tracker when enabled
+ */
+template <typename T, memory_category Category>
+struct counting_allocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = counting_allocator<U, Category>;
+    };
+
+    counting_allocator() = default;
+
+    template <typename U>
+    counting_allocator(const counting_allocator<U, Category>&)
+    {}
+
+    T *
+    allocate(size_t n)
+    {
+        if (!memory_tracker::enabled()) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        memory_tracker::allocate(Category, n * sizeof(T));
+        try {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        } catch (...) {
+            memory_tracker::deallocate(Category, n * sizeof(T));
+            throw;
+        }
+    }
+
+    void
+    deallocate(T *p, size_t n)
+    {
+        if (memory_tracker::enabled()) {
+            memory_tracker::deallocate(Category, n * sizeof(T));
+        }
+        ::operator delete(p);
+    }
+
+    template <typename U>
+    bool
+    operator==(const counting_allocator<U, Category>&) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool
+    operator!=(const counting_allocator<U, Category>&) const
+    {
+        return false;
+    }
+};
+
+};
+
+#endif /* MEMORY_H */
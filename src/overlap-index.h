@@ -0,0 +1,214 @@
+#ifndef OVERLAP_INDEX_H
+#define OVERLAP_INDEX_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+#include "ruleset.h"
+#include "thread-pool.h"
+
+namespace cbmapper {
+
+/**
+ * @brief Finds the rules of a ruleset whose fields overlap a range or a box.
+ * Per field, the rules are sorted by their low bound under a tree whose
+ * nodes hold the highest high bound and the lowest and highest rule index
+ * below them, so that a query only descends into subtrees that hold a
+ * match. A query visits O((k+1) log n) nodes for k matches.
+ * @tparam F Number of fields
+ */
+template <int F>
+class overlap_index {
+public:
+
+    /* An inclusive range per field */
+    using box = std::array<std::array<uint32_t, 2>, F>;
+
+private:
+
+    struct node {
+        uint32_t high;
+        uint32_t min_rule;
+        uint32_t max_rule;
+    };
+
+    /* The rules of a field in ascending order of their low bound. Node "k"
+     * covers positions [l, r); its children are "k+1" for [l, m) and
+     * "k+2*(m-l)" for [m, r), with m = (l+r)/2. */
+    struct field_tree {
+        std::vector<uint32_t> lows;
+        std::vector<uint32_t> highs;
+        std::vector<node> nodes;
+    };
+
+    const ruleset<F> *rule_db;
+    std::array<field_tree, F> trees;
+
+    /**
+     * @brief Fills node "k" of "t" over positions [l, r) of "order".
+     */
+    void
+    build_node(field_tree &t, int f, const std::vector<uint32_t> &order,
+               size_t k, size_t l, size_t r)
+    {
+        if (r - l == 1) {
+            t.nodes[k] = {(*rule_db)[order[l]].fields[f].high,
+                          order[l], order[l]};
+            return;
+        }
+        size_t m = (l + r) / 2;
+        size_t left = k + 1;
+        size_t right = k + 2 * (m - l);
+        build_node(t, f, order, left, l, m);
+        build_node(t, f, order, right, m, r);
+        t.nodes[k] = {std::max(t.nodes[left].high, t.nodes[right].high),
+                      std::min(t.nodes[left].min_rule,
+                               t.nodes[right].min_rule),
+                      std::max(t.nodes[left].max_rule,
+                               t.nodes[right].max_rule)};
+    }
+
+    /**
+     * @brief Builds the tree of field "f".
+     */
+    void
+    build_field(int f)
+    {
+        field_tree &t = trees[f];
+        size_t n = rule_db->size();
+        std::vector<uint32_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        std::stable_sort(order.begin(), order.end(), [&] (uint32_t a,
+                                                          uint32_t b) {
+            return (*rule_db)[a].fields[f].low < (*rule_db)[b].fields[f].low;
+        });
+        t.lows.resize(n);
+        t.highs.resize(n);
+        for (size_t p=0; p<n; ++p) {
+            t.lows[p] = (*rule_db)[order[p]].fields[f].low;
+            t.highs[p] = (*rule_db)[order[p]].fields[f].high;
+        }
+        std::sort(t.highs.begin(), t.highs.end());
+        t.nodes.resize(2 * n - 1);
+        build_node(t, f, order, 0, 0, n);
+    }
+
+    /**
+     * @brief Invokes "fn(rule_idx)" for the rules under node "k" of "t",
+     * over positions [l, r), with positions below "limit", a high bound of
+     * at least "low" and an index in [first, last). Returns false as soon as
+     * "fn" does.
+     */
+    template <typename Fn>
+    bool
+    visit(const field_tree &t, size_t k, size_t l, size_t r, size_t limit,
+          uint32_t low, size_t first, size_t last, Fn &fn) const
+    {
+        const node &n = t.nodes[k];
+        if (l >= limit || n.high < low || n.max_rule < first ||
+            n.min_rule >= last) {
+            return true;
+        }
+        if (r - l == 1) {
+            return fn((size_t)n.min_rule);
+        }
+        size_t m = (l + r) / 2;
+        return visit(t, k + 1, l, m, limit, low, first, last, fn) &&
+               visit(t, k + 2 * (m - l), m, r, limit, low, first, last, fn);
+    }
+
+public:
+
+    /**
+     * @brief Builds an index over "rule_db", which must outlive it. Uses
+     * "pool" when it is not null.
+     */
+    overlap_index(const ruleset<F> &rule_db, thread_pool *pool = nullptr)
+    : rule_db(&rule_db)
+    {
+        if (!rule_db.size()) {
+            return;
+        }
+        auto build = [&] (size_t first, size_t last) {
+            for (size_t f=first; f<last; ++f) {
+                build_field(f);
+            }
+        };
+        if (pool) {
+            pool->parallel_for(0, F, 1, build);
+        } else {
+            build(0, F);
+        }
+    }
+
+    /**
+     * @brief Returns the number of rules whose field "f" overlaps [low,
+     * high]
+     */
+    size_t
+    count_field_overlaps(int f, uint32_t low, uint32_t high) const
+    {
+        const field_tree &t = trees[f];
+        size_t starting = std::upper_bound(t.lows.begin(), t.lows.end(),
+                                           high) - t.lows.begin();
+        size_t ended = std::lower_bound(t.highs.begin(), t.highs.end(),
+                                        low) - t.highs.begin();
+        return starting - ended;
+    }
+
+    /**
+     * @brief Invokes "fn(rule_idx)" for each rule in [first, last) whose
+     * field "f" overlaps [low, high], in ascending order of the low bound of
+     * the field, until "fn" returns false.
+     */
+    template <typename Fn>
+    void
+    for_each_field_overlap(int f, uint32_t low, uint32_t high, size_t first,
+                           size_t last, Fn fn) const
+    {
+        const field_tree &t = trees[f];
+        if (t.lows.empty()) {
+            return;
+        }
+        size_t limit = std::upper_bound(t.lows.begin(), t.lows.end(),
+                                        high) - t.lows.begin();
+        visit(t, 0, 0, t.lows.size(), limit, low, first, last, fn);
+    }
+
+    /**
+     * @brief Invokes "fn(rule_idx)" for each rule in [first, last) that
+     * overlaps "b" in all fields, until "fn" returns false. The rules are
+     * enumerated in the field with the fewest overlaps.
+     */
+    template <typename Fn>
+    void
+    for_each_overlap(const box &b, size_t first, size_t last, Fn fn) const
+    {
+        int best = 0;
+        size_t best_num = SIZE_MAX;
+        for (int f=0; f<F; ++f) {
+            size_t num = count_field_overlaps(f, b[f][0], b[f][1]);
+            if (num < best_num) {
+                best = f;
+                best_num = num;
+            }
+        }
+        for_each_field_overlap(best, b[best][0], b[best][1], first, last,
+        [&] (size_t rule_idx) {
+            const rule<F> &r = (*rule_db)[rule_idx];
+            for (int f=0; f<F; ++f) {
+                if (r.fields[f].low > b[f][1] || b[f][0] > r.fields[f].high) {
+                    return true;
+                }
+            }
+            return fn(rule_idx);
+        });
+    }
+};
+
+};
+
+#endif /* OVERLAP_INDEX_H */
@@ -0,0 +1,179 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace cbmapper {
+
+/**
+ * @brief A group of hardware performance counters of the calling process,
+ * read with perf_event_open(2): cycles, instructions, last-level cache misses
+ * and branch mispredictions, in user space. With "inherit", threads that the
+ * process creates after the group is opened are counted as well. Events the
+ * CPU or the kernel do not support are left out; values are scaled by the
+ * share of the time each event was scheduled, as "perf stat" does.
+ */
+class perf_counters {
+public:
+
+    enum event {
+        CYCLES = 0,
+        INSTRUCTIONS,
+        LLC_MISSES,
+        BRANCH_MISSES,
+        EVENT_NUM
+    };
+
+    /**
+     * @brief Counter values, indexed by "event"; UINT64_MAX when the event
+     * is not available
+     */
+    struct sample {
+        uint64_t values[EVENT_NUM];
+    };
+
+private:
+
+    int fds[EVENT_NUM];
+    std::string error;
+
+    static long
+    open_event(perf_event_attr &attr, int group_fd)
+    {
+        return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+
+public:
+
+    perf_counters(bool inherit)
+    {
+        static const uint64_t configs[EVENT_NUM] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+        int leader = -1;
+        for (int e=0; e<EVENT_NUM; ++e) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[e];
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                               PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.disabled = leader < 0;
+            attr.inherit = inherit;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fds[e] = open_event(attr, leader);
+            if (fds[e] < 0 && error.empty()) {
+                error = strerror(errno);
+            }
+            if (leader < 0) {
+                leader = fds[e];
+            }
+        }
+        if (leader >= 0) {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    ~perf_counters()
+    {
+        for (int e=0; e<EVENT_NUM; ++e) {
+            if (fds[e] >= 0) {
+                close(fds[e]);
+            }
+        }
+    }
+
+    perf_counters(const perf_counters&) = delete;
+    perf_counters& operator=(const perf_counters&) = delete;
+
+    /**
+     * @brief Returns true if at least one of the events is counted
+     */
+    bool
+    available() const
+    {
+        for (int e=0; e<EVENT_NUM; ++e) {
+            if (fds[e] >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Returns the reason the first missing event could not be
+     * opened, or an empty string
+     */
+    const std::string &
+    get_error() const
+    {
+        return error;
+    }
+
+    /**
+     * @brief Sets "out" to the current values of the counters
+     */
+    void
+    read(sample &out) const
+    {
+        for (int e=0; e<EVENT_NUM; ++e) {
+            uint64_t data[3];
+            out.values[e] = UINT64_MAX;
+            if (fds[e] < 0 ||
+                ::read(fds[e], data, sizeof(data)) != sizeof(data)) {
+                continue;
+            }
+            if (data[2] && data[2] < data[1]) {
+                data[0] = (double)data[0] * data[1] / data[2];
+            }
+            out.values[e] = data[0];
+        }
+    }
+
+    static const char *
+    event_name(int e)
+    {
+        static const char *names[EVENT_NUM] = {
+            "cycles", "instructions", "llc_misses", "branch_misses"
+        };
+        return names[e];
+    }
+
+    /**
+     * @brief Sets "out" to "last" - "first" per event; unavailable events
+     * stay unavailable. Scaling may make a multiplexed event go back a bit;
+     * such differences are zero.
+     */
+    static void
+    difference(const sample &first, const sample &last, sample &out)
+    {
+        for (int e=0; e<EVENT_NUM; ++e) {
+            if (first.values[e] == UINT64_MAX ||
+                last.values[e] == UINT64_MAX) {
+                out.values[e] = UINT64_MAX;
+            } else if (last.values[e] < first.values[e]) {
+                out.values[e] = 0;
+            } else {
+                out.values[e] = last.values[e] - first.values[e];
+            }
+        }
+    }
+};
+
+};
+
+#endif /* PERF_COUNTERS_H */
@@ -0,0 +1,235 @@
+#ifndef PERFECT_HASH_H
+#define PERFECT_HASH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "errorf.h"
+#include "zstream.h"
+
+namespace cbmapper {
+
+/**
+ * @brief A minimal perfect hash function over a set of distinct 64-bit keys,
+ * by hash and displace. Keys are split into buckets of BUCKET_KEYS keys on
+ * average; each bucket holds a pilot that displaces its keys to free
+ * positions of a table slightly larger than the set. Positions past the set
+ * size are remapped to the free positions below it, so the keys map to
+ * [0, size()) one to one. A lookup reads a pilot and, rarely, a remap entry.
+ */
+class perfect_hash {
+
+    static constexpr size_t BUCKET_KEYS = 4;
+    /* Share of the table positions the keys take */
+    static constexpr double LOAD = 0.98;
+    /* Pilots tried per bucket before the build gives up */
+    static constexpr uint32_t MAX_PILOT = 1 << 24;
+
+    uint64_t key_num;
+    uint64_t table_size;
+    std::vector<uint32_t> pilots;
+    std::vector<uint64_t> remap;
+
+    static inline uint64_t
+    mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /**
+     * @brief Maps "h" to [0, n) by multiply-shift
+     */
+    static inline uint64_t
+    reduce(uint64_t h, uint64_t n)
+    {
+        return ((unsigned __int128)h * n) >> 64;
+    }
+
+    inline uint64_t
+    position(uint64_t key, uint32_t pilot) const
+    {
+        return reduce(mix(key ^ (pilot * 0x9e3779b97f4a7c15ULL)), table_size);
+    }
+
+public:
+
+    perfect_hash()
+    : key_num(0),
+      table_size(0)
+    {}
+
+    /**
+     * @brief Returns a 64-bit key of the "num" values at "data", under
+     * "seed". The per-value products are independent, as in "header_hash";
+     * the multipliers depend on the seed, so values that collide under one
+     * seed are unlikely to collide under the next.
+     */
+    static inline uint64_t
+    hash_key(const uint32_t *data, size_t num, uint32_t seed)
+    {
+        static constexpr uint64_t mult[8] = {
+            0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+            0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL,
+            0xff51afd7ed558ccdULL, 0xc4ceb9fe1a85ec53ULL,
+            0x85ebca77c2b2ae63ULL, 0x27d4eb2f165667c5ULL
+        };
+        uint64_t step = (uint64_t)seed << 33;
+        uint64_t h = num;
+        for (size_t i=0; i<num; ++i) {
+            h += ((uint64_t)data[i] + i + 1) * (mult[i % 8] + step);
+        }
+        return mix(h);
+    }
+
+    /**
+     * @brief Builds the function over "keys". Returns false if "keys" are
+     * not distinct.
+     */
+    bool
+    build(const std::vector<uint64_t> &keys)
+    {
+        key_num = keys.size();
+        table_size = std::max<uint64_t>(key_num, key_num / LOAD);
+        size_t bucket_num = std::max<size_t>(1, key_num / BUCKET_KEYS);
+        pilots.assign(bucket_num, 0);
+        remap.clear();
+
+        /* Group the keys by bucket */
+        std::vector<uint64_t> offsets(bucket_num + 1, 0);
+        for (uint64_t key : keys) {
+            offsets[reduce(key, bucket_num) + 1]++;
+        }
+        size_t largest = 0;
+        for (size_t b=0; b<bucket_num; ++b) {
+            largest = std::max<size_t>(largest, offsets[b+1]);
+            offsets[b+1] += offsets[b];
+        }
+        std::vector<uint64_t> grouped(key_num);
+        std::vector<uint64_t> cursor(offsets.begin(), offsets.end() - 1);
+        for (uint64_t key : keys) {
+            grouped[cursor[reduce(key, bucket_num)]++] = key;
+        }
+
+        /* Place the larger buckets first, while the table is empty */
+        std::vector<std::vector<size_t>> by_size(largest + 1);
+        for (size_t b=0; b<bucket_num; ++b) {
+            by_size[offsets[b+1] - offsets[b]].push_back(b);
+        }
+
+        std::vector<uint64_t> taken((table_size + 63) / 64, 0);
+        auto is_taken = [&] (uint64_t p) {
+            return (taken[p / 64] >> (p % 64)) & 1;
+        };
+        std::vector<uint64_t> placed;
+        for (size_t size=largest; size>0; --size) {
+            for (size_t b : by_size[size]) {
+                uint64_t *first = &grouped[offsets[b]];
+                std::sort(first, first + size);
+                if (std::adjacent_find(first, first + size) != first + size) {
+                    return false;
+                }
+                uint32_t pilot = 0;
+                for (; pilot<MAX_PILOT; ++pilot) {
+                    placed.clear();
+                    size_t k = 0;
+                    for (; k<size; ++k) {
+                        uint64_t p = position(first[k], pilot);
+                        if (is_taken(p) ||
+                            std::find(placed.begin(), placed.end(), p) !=
+                            placed.end()) {
+                            break;
+                        }
+                        placed.push_back(p);
+                    }
+                    if (k == size) {
+                        break;
+                    }
+                }
+                if (pilot == MAX_PILOT) {
+                    return false;
+                }
+                for (uint64_t p : placed) {
+                    taken[p / 64] |= 1ULL << (p % 64);
+                }
+                pilots[b] = pilot;
+            }
+        }
+
+        /* Positions past the set size take the free ones below it */
+        remap.assign(table_size - key_num, 0);
+        uint64_t free = 0;
+        for (uint64_t p=key_num; p<table_size; ++p) {
+            if (!is_taken(p)) {
+                continue;
+            }
+            while (is_taken(free)) {
+                free++;
+            }
+            remap[p - key_num] = free++;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Returns the number of keys
+     */
+    uint64_t
+    size() const
+    {
+        return key_num;
+    }
+
+    /**
+     * @brief Returns the position of "key" in [0, size()). Keys outside of
+     * the set map to arbitrary positions.
+     */
+    inline uint64_t
+    lookup(uint64_t key) const
+    {
+        uint64_t p = position(key, pilots[reduce(key, pilots.size())]);
+        return p < key_num ? p : remap[p - key_num];
+    }
+
+    /**
+     * @brief Writes this to "file": the key count, the table size, and the
+     * pilots and remap entries with their counts
+     */
+    void
+    write(zstream &file) const
+    {
+        file.write_count(key_num);
+        file.write_count(table_size);
+        file.write_count(pilots.size());
+        file.write(pilots.data(), pilots.size() * sizeof(uint32_t));
+        file.write_count(remap.size());
+        file.write(remap.data(), remap.size() * sizeof(uint64_t));
+    }
+
+    /**
+     * @brief Reads this from "file", as written by "write"
+     */
+    void
+    read(zstream &file)
+    {
+        key_num = file.read_count();
+        table_size = file.read_count();
+        pilots.resize(file.read_count());
+        size_t bytes = pilots.size() * sizeof(uint32_t);
+        if (pilots.empty() || file.read(pilots.data(), bytes) != bytes) {
+            throw errorf("Cannot read file: invalid perfect hash");
+        }
+        remap.resize(file.read_count());
+        bytes = remap.size() * sizeof(uint64_t);
+        if (remap.size() != table_size - key_num ||
+            file.read(remap.data(), bytes) != bytes) {
+            throw errorf("Cannot read file: invalid perfect hash");
+        }
+    }
+};
+
+};
+
+#endif /* PERFECT_HASH_H */
@@ -0,0 +1,163 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace cbmapper {
+
+/**
+ * @brief A stage of a pipeline: a dedicated thread that invokes "fn(item)"
+ * on the items pushed to it, in order. Items wait in a bounded queue, so
+ * the producer blocks once it runs "capacity" items ahead of the stage,
+ * which bounds the memory of the items in flight. The first exception
+ * thrown by "fn" stops the stage; later items are dropped and the
+ * exception is rethrown to the producer by the next "push", "drain" or
+ * "finish".
+ * @tparam T Item type
+ */
+template <typename T>
+class pipeline_stage {
+
+    std::function<void(T&)> fn;
+    std::deque<T> queue;
+    size_t capacity;
+    /* Items pushed and items done, either processed or dropped */
+    size_t pushed;
+    size_t done;
+    bool closed;
+    std::exception_ptr error;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread worker;
+
+    /**
+     * @brief Main loop of the stage thread
+     */
+    void
+    worker_loop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            cv.wait(guard, [&] { return closed || !queue.empty(); });
+            if (queue.empty()) {
+                return;
+            }
+            T item = std::move(queue.front());
+            queue.pop_front();
+            /* A slot is free for the producer */
+            cv.notify_all();
+            if (!error) {
+                guard.unlock();
+                try {
+                    fn(item);
+                } catch (...) {
+                    guard.lock();
+                    error = std::current_exception();
+                    guard.unlock();
+                }
+                /* Items are released outside the lock */
+                item = T();
+                guard.lock();
+            }
+            done++;
+            cv.notify_all();
+        }
+    }
+
+    /**
+     * @brief Rethrows the exception of the stage, if any. Holds "lock".
+     */
+    void
+    check_error()
+    {
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+public:
+
+    /**
+     * @brief Starts a stage that invokes "fn" on each item, with up to
+     * "capacity" items waiting (at least one)
+     */
+    pipeline_stage(size_t capacity, std::function<void(T&)> fn)
+    : fn(std::move(fn)),
+      capacity(capacity ? capacity : 1),
+      pushed(0),
+      done(0),
+      closed(false)
+    {
+        worker = std::thread(&pipeline_stage::worker_loop, this);
+    }
+
+    /**
+     * @brief Stops the stage after the items already pushed. Exceptions
+     * are discarded; call "finish" to receive them.
+     */
+    ~pipeline_stage()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        cv.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    pipeline_stage(const pipeline_stage&) = delete;
+    pipeline_stage& operator=(const pipeline_stage&) = delete;
+
+    /**
+     * @brief Enqueues "item", waiting while the queue is full
+     */
+    void
+    push(T item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&] { return queue.size() < capacity || error; });
+        check_error();
+        queue.push_back(std::move(item));
+        pushed++;
+        cv.notify_all();
+    }
+
+    /**
+     * @brief Waits until the stage has processed all items pushed so far
+     */
+    void
+    drain()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard, [&] { return done == pushed; });
+        check_error();
+    }
+
+    /**
+     * @brief Processes the remaining items and stops the stage
+     */
+    void
+    finish()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        cv.notify_all();
+        worker.join();
+        check_error();
+    }
+};
+
+};
+
+#endif /* PIPELINE_H */
@@ -1,8 +1,13 @@
 #ifndef RANDOM_H
 #define RANDOM_H
 
+#include <cstdint>
 #include <random>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 namespace cbmapper {
 
 class random_core {
@@ -11,9 +16,26 @@ public:
     static void
     set_seed(int seed = 0)
     {
+        get_seed_storage() = seed;
         get_random_generator().seed(seed);
     }
 
+    /**
+     * @brief Returns the seed that was set last
+     */
+    static int
+    get_seed()
+    {
+        return get_seed_storage();
+    }
+
+    static inline int &
+    get_seed_storage()
+    {
+        static int seed = 0;
+        return seed;
+    }
+
     static inline std::mt19937 &
     get_random_generator()
     {
@@ -45,6 +67,234 @@ public:
     }
 };
 
+/**
+ * @brief An independent random number generator (SplitMix64). Streams are
+ * derived deterministically from a seed and a (domain, index) pair, so
+ * different threads can produce the same values regardless of how work is
+ * divided. Cheap to create, one per rule is fine.
+ */
+class random_stream {
+    uint64_t state;
+
+    static inline uint64_t
+    mix(uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+public:
+
+    /**
+     * @brief Creates the stream of ("domain", "index") under "seed". A
+     * non-zero "sub" selects an independent sub-stream, e.g., per chunk of a
+     * long sequence.
+     */
+    random_stream(int seed, uint32_t domain, uint64_t index, uint64_t sub = 0)
+    {
+        state = mix(((uint64_t)(uint32_t)seed << 32) | domain);
+        state = mix(state ^ index);
+        if (sub) {
+            state = mix(state ^ sub);
+        }
+    }
+
+    inline uint32_t
+    random_uint32()
+    {
+        state += 0x9e3779b97f4a7c15ULL;
+        return mix(state) >> 32;
+    }
+
+    inline uint64_t
+    random_uint64()
+    {
+        state += 0x9e3779b97f4a7c15ULL;
+        return mix(state);
+    }
+
+    /**
+     * @brief Same semantics as random_core::random_uint32(low, high)
+     */
+    inline uint32_t
+    random_uint32(uint32_t low, uint32_t high)
+    {
+        if (low == high) {
+            return low;
+        }
+        return random_uint32() % (high-low) + low;
+    }
+};
+
+/**
+ * @brief A counter-based random number generator (Philox4x32-10). Each
+ * (index, sample) counter maps to four random words that depend only on the
+ * seed and the domain, so samples can be generated in any order and split
+ * between threads arbitrarily with bit-identical results. "generate" fills
+ * consecutive samples eight at a time with AVX2 when available.
+ */
+class random_counter {
+    uint32_t key0;
+    uint32_t key1;
+
+    static constexpr uint32_t MULT0 = 0xD2511F53;
+    static constexpr uint32_t MULT1 = 0xCD9E8D57;
+    static constexpr uint32_t WEYL0 = 0x9E3779B9;
+    static constexpr uint32_t WEYL1 = 0xBB67AE85;
+    static constexpr int ROUNDS = 10;
+    /* Independent groups of eight lanes per step of "generate" */
+    static constexpr int GROUPS = 2;
+
+    /**
+     * @brief Applies the Philox rounds to the counter "c0...c3".
+     */
+    inline void
+    rounds(uint32_t &c0, uint32_t &c1, uint32_t &c2, uint32_t &c3) const
+    {
+        uint32_t k0 = key0;
+        uint32_t k1 = key1;
+        for (int r=0; r<ROUNDS; ++r) {
+            uint64_t p0 = (uint64_t)MULT0 * c0;
+            uint64_t p1 = (uint64_t)MULT1 * c2;
+            uint32_t n0 = (p1 >> 32) ^ c1 ^ k0;
+            uint32_t n2 = (p0 >> 32) ^ c3 ^ k1;
+            c1 = p1;
+            c3 = p0;
+            c0 = n0;
+            c2 = n2;
+            k0 += WEYL0;
+            k1 += WEYL1;
+        }
+    }
+
+#ifdef __AVX2__
+    /**
+     * @brief Sets "lo" and "hi" to the low and high words of the 32-bit
+     * products "a * mult" of eight lanes
+     */
+    static inline void
+    vector_mulhilo(__m256i a, __m256i mult, __m256i &lo, __m256i &hi)
+    {
+        __m256i even = _mm256_mul_epu32(a, mult);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), mult);
+        lo = _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0xaa);
+        hi = _mm256_blend_epi32(_mm256_srli_epi64(even, 32), odd, 0xaa);
+    }
+
+    /**
+     * @brief Applies the Philox rounds to GROUPS independent counters of
+     * eight lanes each; interleaving them hides the multiply latency
+     */
+    inline void
+    vector_rounds(__m256i c0[GROUPS], __m256i c1[GROUPS],
+                  __m256i c2[GROUPS], __m256i c3[GROUPS]) const
+    {
+        const __m256i mult0 = _mm256_set1_epi32(MULT0);
+        const __m256i mult1 = _mm256_set1_epi32(MULT1);
+        uint32_t k0 = key0;
+        uint32_t k1 = key1;
+        for (int r=0; r<ROUNDS; ++r) {
+            __m256i key_lo = _mm256_set1_epi32(k0);
+            __m256i key_hi = _mm256_set1_epi32(k1);
+            for (int g=0; g<GROUPS; ++g) {
+                __m256i lo0, hi0, lo1, hi1;
+                vector_mulhilo(c0[g], mult0, lo0, hi0);
+                vector_mulhilo(c2[g], mult1, lo1, hi1);
+                c0[g] = _mm256_xor_si256(_mm256_xor_si256(hi1, c1[g]), key_lo);
+                c2[g] = _mm256_xor_si256(_mm256_xor_si256(hi0, c3[g]), key_hi);
+                c1[g] = lo1;
+                c3[g] = lo0;
+            }
+            k0 += WEYL0;
+            k1 += WEYL1;
+        }
+    }
+#endif
+
+public:
+
+    /**
+     * @brief Creates the generator of "domain" under "seed".
+     */
+    random_counter(int seed, uint32_t domain)
+    : key0(seed),
+      key1(domain)
+    {}
+
+    /**
+     * @brief Returns word "word" (0 to 3) of sample "sample" of "index"
+     */
+    inline uint32_t
+    operator()(uint64_t index, uint64_t sample, int word = 0) const
+    {
+        uint32_t c[4] = {(uint32_t)sample, (uint32_t)(sample >> 32),
+                         (uint32_t)index, (uint32_t)(index >> 32)};
+        rounds(c[0], c[1], c[2], c[3]);
+        return c[word & 3];
+    }
+
+    /**
+     * @brief Sets "out[w][j]" to word "w" of sample "first+j" of "index",
+     * for "j" < "n" and each "w" whose "out[w]" is not null.
+     */
+    void
+    generate(uint64_t index, uint64_t first, size_t n, uint32_t *out[4]) const
+    {
+        size_t j = 0;
+#ifdef __AVX2__
+        const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m256i index_lo = _mm256_set1_epi32((uint32_t)index);
+        const __m256i index_hi = _mm256_set1_epi32((uint32_t)(index >> 32));
+        for (; j+8*GROUPS<=n; j+=8*GROUPS) {
+            uint64_t sample = first + j;
+            if ((sample >> 32) != ((sample + 8*GROUPS - 1) >> 32)) {
+                break;
+            }
+            __m256i c[4][GROUPS];
+            for (int g=0; g<GROUPS; ++g) {
+                c[0][g] = _mm256_add_epi32(
+                    _mm256_set1_epi32((uint32_t)sample + 8*g), lanes);
+                c[1][g] = _mm256_set1_epi32((uint32_t)(sample >> 32));
+                c[2][g] = index_lo;
+                c[3][g] = index_hi;
+            }
+            vector_rounds(c[0], c[1], c[2], c[3]);
+            for (int w=0; w<4; ++w) {
+                if (!out[w]) {
+                    continue;
+                }
+                for (int g=0; g<GROUPS; ++g) {
+                    _mm256_storeu_si256((__m256i*)(out[w] + j + 8*g), c[w][g]);
+                }
+            }
+        }
+#endif
+        for (; j<n; ++j) {
+            uint64_t sample = first + j;
+            uint32_t c[4] = {(uint32_t)sample, (uint32_t)(sample >> 32),
+                             (uint32_t)index, (uint32_t)(index >> 32)};
+            rounds(c[0], c[1], c[2], c[3]);
+            for (int w=0; w<4; ++w) {
+                if (out[w]) {
+                    out[w][j] = c[w];
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Maps the random word "word" to [low, high], inclusive, by
+     * multiply-shift
+     */
+    static inline uint32_t
+    uniform(uint32_t word, uint32_t low, uint32_t high)
+    {
+        uint64_t span = (uint64_t)high - low + 1;
+        return low + (uint32_t)((word * span) >> 32);
+    }
+};
+
 };
 
 #endif
@@ -1,13 +1,15 @@
 #ifndef READER_H
 #define READER_H
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
+#include <string>
 #include <vector>
-#include <set>
-#include <unordered_map>
 
 #include "errorf.h"
+#include "memory.h"
+#include "perfect-hash.h"
 #include "random.h"
 #include "zstream.h"
 
@@ -17,19 +19,54 @@ class reader {
 public:
     using field  = std::array<uint32_t, 2>;
     using rule   = std::vector<field>;
-    using header = std::vector<uint32_t>;
+
+    /* Position of a shard file in its ruleset (see --shard) */
+    struct shard_info {
+        uint32_t index;
+        uint32_t num;
+        uint32_t first_rule;
+        uint32_t rule_num;
+    };
+
+    /* The rule-id of headers that match no rule */
+    static constexpr uint32_t MISS_RULE_ID = 0xffffffff;
 
 private:
     std::vector<rule> rules;
 
-    /* A lsit of headers. Does not change. */
-    std::vector<header> headers;
+    /* A lsit of headers, "field_num" values each. Does not change. */
+    std::vector<uint32_t,
+                counting_allocator<uint32_t, MEMORY_READER_HEADERS>> headers;
     /* The rule-id that matches each header. Does not change. */
     std::vector<int> header_matching_rule_ids;
     /* Rule priorities */
     std::vector<int> rule_priorities;
-    /* Mapping between rule-id to header index. Does not change. */
-    std::unordered_map<int, std::vector<int>> rule_id_to_hdr_idx;
+    /* Mapping between rule-id to header indices: the headers of rule "r"
+     * are rule_hdr_idx[rule_hdr_offsets[r] ... rule_hdr_offsets[r+1]-1].
+     * Does not change. */
+    std::vector<size_t> rule_hdr_offsets;
+    std::vector<size_t> rule_hdr_idx;
+    /* Indices of the headers that match no rule. Does not change. */
+    std::vector<size_t> miss_hdr_idx;
+    /* Normalized rule weights of the flow distribution, empty if uniform */
+    std::vector<double> rule_weights;
+    /* Multi-match annotation, empty if the file has none: the number of
+     * rules each header matches, and the first of them in priority order,
+     * header_match_rules[header_match_offsets[h] ...
+     * header_match_offsets[h+1]-1]. Does not change. */
+    std::vector<uint32_t> header_match_counts;
+    std::vector<size_t> header_match_offsets;
+    std::vector<uint32_t> header_match_rules;
+    /* Minimal perfect hash over the headers, and the index of the header at
+     * each of its positions. Empty if the file has none. Does not
+     * change. */
+    perfect_hash header_hash;
+    uint32_t header_hash_seed;
+    std::vector<uint64_t,
+                counting_allocator<uint64_t, MEMORY_READER_HEADERS>>
+        header_hash_index;
+    /* Shard of the file; "num" is zero if the file is not a shard */
+    shard_info shard;
 
     size_t field_num;
     size_t header_num;
@@ -50,24 +87,134 @@ private:
     }
 
     /**
-     * @brief Reads a header from "file", updates "headers" and
-     * "header_matching_rule_ids" in index "idx". Also updates
-     * "rule_id_to_hdr_idx".
-    */
+     * @brief Reads the packet records from "file", "field_num" values and a
+     * rule-id each, into "headers" and "header_matching_rule_ids". Then
+     * builds the rule-id to header index mapping. Headers with rule-id
+     * MISS_RULE_ID match no rule; their rule-id is kept as -1.
+     */
     void
-    read_header(zstream &file, int idx)
+    read_headers(zstream &file)
     {
-        int idx_num, rule_idx;
+        static constexpr size_t CHUNK = 1 << 16;
+        size_t record = field_num + 1;
+        std::vector<uint32_t> buffer(CHUNK * record);
 
-        headers[idx].resize(field_num);
+        headers.resize(header_num * field_num);
+        header_matching_rule_ids.resize(header_num);
+        rule_hdr_offsets.assign(rules.size() + 1, 0);
+        miss_hdr_idx.clear();
 
-        for (int i=0; i<field_num; ++i) {
-            headers[idx][i] = file.read_u32();
+        for (size_t first=0; first<header_num; first+=CHUNK) {
+            size_t count = std::min(CHUNK, header_num - first);
+            size_t bytes = count * record * sizeof(uint32_t);
+            if (file.read(buffer.data(), bytes) != bytes) {
+                throw errorf("Cannot read file: unexpected end of file");
+            }
+            for (size_t i=0; i<count; ++i) {
+                const uint32_t *rec = &buffer[i * record];
+                uint32_t rule_idx = rec[field_num];
+                std::copy(rec, rec + field_num,
+                          &headers[(first + i) * field_num]);
+                if (rule_idx == MISS_RULE_ID) {
+                    header_matching_rule_ids[first + i] = -1;
+                    miss_hdr_idx.push_back(first + i);
+                    continue;
+                }
+                if (rule_idx >= rules.size()) {
+                    throw errorf("Cannot read file: invalid rule id %u",
+                                 rule_idx);
+                }
+                header_matching_rule_ids[first + i] = rule_idx;
+                rule_hdr_offsets[rule_idx + 1]++;
+            }
+        }
+
+        for (size_t r=0; r<rules.size(); ++r) {
+            rule_hdr_offsets[r+1] += rule_hdr_offsets[r];
+        }
+        std::vector<size_t> cursor(rule_hdr_offsets.begin(),
+                                   rule_hdr_offsets.end() - 1);
+        rule_hdr_idx.resize(header_num - miss_hdr_idx.size());
+        for (size_t i=0; i<header_num; ++i) {
+            if (header_matching_rule_ids[i] >= 0) {
+                rule_hdr_idx[cursor[header_matching_rule_ids[i]]++] = i;
+            }
+        }
+    }
+
+    /**
+     * @brief Reads the rule weights section from "file"
+     */
+    void
+    read_weights(zstream &file)
+    {
+        if (file.read_u32() != rules.size()) {
+            throw errorf("Cannot read file: rule weights mismatch");
         }
+        rule_weights.resize(rules.size());
+        size_t bytes = rules.size() * sizeof(double);
+        if (file.read(rule_weights.data(), bytes) != bytes) {
+            throw errorf("Cannot read file: unexpected end of file");
+        }
+    }
 
-        rule_idx = file.read_u32();
-        header_matching_rule_ids[idx] = rule_idx;
-        rule_id_to_hdr_idx[rule_idx].push_back(idx);
+    /**
+     * @brief Reads the multi-match section from "file": the number of rules
+     * kept per header, the number of matching rules per header and the kept
+     * rules of all headers.
+     */
+    void
+    read_matches(zstream &file)
+    {
+        uint32_t limit = file.read_u32();
+        if (file.read_count() != header_num) {
+            throw errorf("Cannot read file: multi-match mismatch");
+        }
+        header_match_counts.resize(header_num);
+        size_t bytes = header_num * sizeof(uint32_t);
+        if (file.read(header_match_counts.data(), bytes) != bytes) {
+            throw errorf("Cannot read file: unexpected end of file");
+        }
+        header_match_offsets.resize(header_num + 1);
+        header_match_offsets[0] = 0;
+        for (size_t i=0; i<header_num; ++i) {
+            header_match_offsets[i+1] = header_match_offsets[i] +
+                std::min(header_match_counts[i], limit);
+        }
+        if (file.read_count() != header_match_offsets[header_num]) {
+            throw errorf("Cannot read file: multi-match mismatch");
+        }
+        header_match_rules.resize(header_match_offsets[header_num]);
+        bytes = header_match_rules.size() * sizeof(uint32_t);
+        if (file.read(header_match_rules.data(), bytes) != bytes) {
+            throw errorf("Cannot read file: unexpected end of file");
+        }
+    }
+
+    /**
+     * @brief Reads the header hash section from "file", and places the
+     * index of each header at its hash position
+     */
+    void
+    read_header_hash(zstream &file)
+    {
+        header_hash_seed = file.read_u32();
+        header_hash.read(file);
+        if (header_hash.size() != header_num) {
+            throw errorf("Cannot read file: header hash mismatch");
+        }
+        std::vector<char> placed(header_num, 0);
+        header_hash_index.resize(header_num);
+        for (size_t i=0; i<header_num; ++i) {
+            const uint32_t *hdr = &headers[i * field_num];
+            uint64_t p = header_hash.lookup(
+                perfect_hash::hash_key(hdr, field_num, header_hash_seed));
+            if (p >= header_num || placed[p]) {
+                throw errorf("Cannot read file: header hash mismatch");
+            }
+            placed[p] = 1;
+            header_hash_index[p] = i;
+        }
     }
 
 public:
@@ -98,12 +245,33 @@ public:
             throw errorf("Cannot read file: header mismatch");
         }
 
-        header_num = file.read_u32();
-        headers.resize(header_num);
-        header_matching_rule_ids.resize(header_num);
+        header_num = file.read_count();
+        read_headers(file);
 
-        for (int i=0; i<header_num; ++i) {
-            read_header(file, i);
+        /* Optional sections */
+        rule_weights.clear();
+        header_match_counts.clear();
+        header_match_offsets.clear();
+        header_match_rules.clear();
+        header_hash_index.clear();
+        shard = shard_info();
+        for (std::string section = file.read_string(8); !section.empty();
+             section = file.read_string(8)) {
+            if (section == "flowdist") {
+                read_weights(file);
+            } else if (section == "overlaps") {
+                read_matches(file);
+            } else if (section == "perfhash") {
+                read_header_hash(file);
+            } else if (section == "shardinf") {
+                shard.index = file.read_u32();
+                shard.num = file.read_u32();
+                shard.first_rule = file.read_u32();
+                shard.rule_num = file.read_u32();
+            } else {
+                throw errorf("Cannot read file: unknown section \"%s\"",
+                             section.c_str());
+            }
         }
     }
 
@@ -153,16 +321,40 @@ public:
     }
 
     /**
-     * @brief Returns packet header with ID "idx"
+     * @brief Returns true iff the file holds rule weights, i.e., the flows
+     * were not divided uniformly between the rules
      */
-    const header&
+    bool
+    has_rule_weights()
+    {
+        return !rule_weights.empty();
+    }
+
+    /**
+     * @brief Returns the normalized weight of rule with ID "idx" in the flow
+     * distribution the file was generated with
+     */
+    double
+    get_rule_weight(size_t idx)
+    {
+        if (rule_weights.empty()) {
+            return 1.0 / rules.size();
+        }
+        return rule_weights[idx];
+    }
+
+    /**
+     * @brief Returns packet header with ID "idx", "get_field_num()" values
+     */
+    const uint32_t *
     get_header(size_t idx)
     {
-        return headers[idx];
+        return &headers[idx * field_num];
     }
 
     /**
-     * @brief Returns the rule ID that match header ID "idx"
+     * @brief Returns the rule ID that match header ID "idx", or -1 if the
+     * header matches no rule
      */
     int
     get_header_match(size_t idx)
@@ -170,20 +362,145 @@ public:
         return header_matching_rule_ids[idx];
     }
 
+    /**
+     * @brief Returns the number of headers that match rule ID "idx"
+     */
+    size_t
+    get_rule_header_num(size_t idx)
+    {
+        return rule_hdr_offsets[idx + 1] - rule_hdr_offsets[idx];
+    }
+
+    /**
+     * @brief Returns the ID of the "k"-th header that matches rule ID "idx",
+     * in file order
+     */
+    size_t
+    get_rule_header(size_t idx, size_t k)
+    {
+        return rule_hdr_idx[rule_hdr_offsets[idx] + k];
+    }
+
+    /**
+     * @brief Returns true iff the file holds the multi-match annotation of
+     * the headers
+     */
+    bool
+    has_header_matches()
+    {
+        return !header_match_offsets.empty();
+    }
+
+    /**
+     * @brief Returns the number of rules header ID "idx" matches. Requires
+     * "has_header_matches()".
+     */
+    size_t
+    get_header_match_count(size_t idx)
+    {
+        return header_match_counts[idx];
+    }
+
+    /**
+     * @brief Returns the rule IDs header ID "idx" matches in priority order,
+     * and sets "num" to their number. Files may keep only the first rules,
+     * so "num" can be below "get_header_match_count(idx)". Requires
+     * "has_header_matches()".
+     */
+    const uint32_t *
+    get_header_matches(size_t idx, size_t &num)
+    {
+        num = header_match_offsets[idx+1] - header_match_offsets[idx];
+        return header_match_rules.data() + header_match_offsets[idx];
+    }
+
+    /**
+     * @brief Returns true iff the file holds the header hash, which
+     * "lookup_header" requires
+     */
+    bool
+    has_header_hash()
+    {
+        return !header_hash_index.empty();
+    }
+
+    /**
+     * @brief Returns the position of this shard file in its ruleset; "num"
+     * is zero if the file is not a shard. Rule IDs of a shard file are
+     * relative to "first_rule".
+     */
+    const shard_info &
+    get_shard_info() const
+    {
+        return shard;
+    }
+
+    /**
+     * @brief Sets "rule" to the rule ID that matches header "hdr",
+     * "get_field_num()" values, or to MISS_RULE_ID if it matches no rule.
+     * Returns false if the file has no such header. Requires
+     * "has_header_hash()". Thread safe.
+     */
+    bool
+    lookup_header(const uint32_t *hdr, uint32_t &rule) const
+    {
+        uint64_t p = header_hash.lookup(
+            perfect_hash::hash_key(hdr, field_num, header_hash_seed));
+        if (p >= header_hash_index.size()) {
+            return false;
+        }
+        uint64_t idx = header_hash_index[p];
+        if (!std::equal(hdr, hdr + field_num, &headers[idx * field_num])) {
+            return false;
+        }
+        rule = header_matching_rule_ids[idx];
+        return true;
+    }
+
+    /**
+     * @brief Returns the number of headers that match no rule
+     */
+    size_t
+    get_miss_num()
+    {
+        return miss_hdr_idx.size();
+    }
+
+    /**
+     * @brief Returns the ID of a random header that matches no rule, or -1
+     * if there is none.
+     */
+    int64_t
+    get_miss_index()
+    {
+        if (miss_hdr_idx.empty()) {
+            return -1;
+        }
+        return miss_hdr_idx[random_core::random_uint32() %
+                            miss_hdr_idx.size()];
+    }
+
     /**
      * @brief Returns a header ID that match rule ID "idx", or -1 if no such
      * was found.
      */
-    int
+    int64_t
     get_header_index(size_t matching_rule_id)
     {
-        auto it = rule_id_to_hdr_idx.find(matching_rule_id);
-        if (it == rule_id_to_hdr_idx.end()) {
+        if (matching_rule_id >= rules.size()) {
             return -1;
         }
-        const std::vector<int> &vec = it->second;
-        int i = random_core::random_uint32() % vec.size();
-        return vec[i];
+        size_t first = rule_hdr_offsets[matching_rule_id];
+        size_t count = rule_hdr_offsets[matching_rule_id + 1] - first;
+        if (!count) {
+            return -1;
+        }
+        uint64_t r = random_core::random_uint32();
+        /* A second draw covers rules with more than 2^32 headers */
+        if (count >> 32) {
+            r = (r << 32) | random_core::random_uint32();
+        }
+        return rule_hdr_idx[first + r % count];
     }
 };
 
@@ -0,0 +1,424 @@
+#ifndef RULE_INDEX_H
+#define RULE_INDEX_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "ruleset.h"
+#include "thread-pool.h"
+
+namespace cbmapper {
+
+/**
+ * @brief A bit-vector classification index over a ruleset. Rules are grouped
+ * into chunks of CHUNK_RULES rules in priority order. Per chunk and field,
+ * the field domain is split into elementary intervals, each holding a bitmap
+ * of the chunk rules that cover it; a lookup intersects the F bitmaps.
+ * A coarse index with one bit per chunk selects the chunks worth visiting,
+ * when it fits in COARSE_MAX_BYTES. An index may cover a subset of the
+ * ruleset, and then answers for the rules of the subset.
+ * @tparam F Number of fields
+ */
+template <int F>
+class rule_index {
+public:
+
+    static constexpr size_t CHUNK_RULES = 256;
+    static constexpr size_t COARSE_MAX_BYTES = 256 << 20;
+
+private:
+
+    static constexpr size_t WORDS = CHUNK_RULES / 64;
+
+    struct alignas(32) bitmap {
+        uint64_t words[WORDS];
+    };
+
+    /* Elementary intervals of a field; "bounds" holds their low values */
+    struct field_table {
+        std::vector<uint32_t> bounds;
+        std::vector<bitmap> bitmaps;
+    };
+
+    /* Coarse chunk bitmaps of a field, "coarse_words" words per interval */
+    struct coarse_table {
+        std::vector<uint32_t> bounds;
+        std::vector<uint64_t> bits;
+    };
+
+    std::vector<std::array<field_table, F>> chunks;
+    std::array<coarse_table, F> coarse;
+    /* Fields in lookup order, most selective first */
+    std::array<int, F> order;
+    size_t coarse_words;
+    size_t rule_num;
+    /* Ruleset indices of the indexed rules; empty if all are indexed */
+    std::vector<size_t> ids;
+
+    /**
+     * @brief Returns the ruleset index of indexed rule "r"
+     */
+    inline size_t
+    rule_id(size_t r) const
+    {
+        return ids.empty() ? r : ids[r];
+    }
+
+    /**
+     * @brief Returns the index of the elementary interval in "bounds" that
+     * contains "value".
+     */
+    static inline size_t
+    interval_of(const std::vector<uint32_t> &bounds, uint32_t value)
+    {
+        return std::upper_bound(bounds.begin(), bounds.end(), value) -
+               bounds.begin() - 1;
+    }
+
+    /**
+     * @brief Collects the elementary interval bounds of indexed rules
+     * [first, last) in field "f".
+     */
+    std::vector<uint32_t>
+    collect_bounds(const ruleset<F> &rule_db, size_t first, size_t last,
+                   int f) const
+    {
+        std::vector<uint32_t> bounds(1, 0);
+        for (size_t r=first; r<last; ++r) {
+            const rule_field &field = rule_db[rule_id(r)].fields[f];
+            bounds.push_back(field.low);
+            if (field.high != 0xffffffff) {
+                bounds.push_back(field.high + 1);
+            }
+        }
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+        return bounds;
+    }
+
+    /**
+     * @brief Builds the tables of chunk "c".
+     */
+    void
+    build_chunk(const ruleset<F> &rule_db, size_t c)
+    {
+        size_t first = c * CHUNK_RULES;
+        size_t last = std::min(rule_num, first + CHUNK_RULES);
+
+        for (int f=0; f<F; ++f) {
+            field_table &t = chunks[c][f];
+            t.bounds = collect_bounds(rule_db, first, last, f);
+            t.bitmaps.assign(t.bounds.size() + 1, bitmap{});
+
+            /* Each rule covers a contiguous run of intervals: toggle its bit
+             * at both ends of the run, then XOR-accumulate */
+            for (size_t r=first; r<last; ++r) {
+                size_t bit = r - first;
+                uint64_t mask = 1ULL << (bit % 64);
+                const rule_field &field = rule_db[rule_id(r)].fields[f];
+                size_t s = interval_of(t.bounds, field.low);
+                size_t e = interval_of(t.bounds, field.high);
+                t.bitmaps[s].words[bit / 64] ^= mask;
+                t.bitmaps[e + 1].words[bit / 64] ^= mask;
+            }
+            for (size_t k=1; k<t.bounds.size(); ++k) {
+                for (size_t w=0; w<WORDS; ++w) {
+                    t.bitmaps[k].words[w] ^= t.bitmaps[k-1].words[w];
+                }
+            }
+            t.bitmaps.pop_back();
+        }
+    }
+
+    /**
+     * @brief Builds the coarse table of field "f".
+     */
+    void
+    build_coarse(const ruleset<F> &rule_db, int f)
+    {
+        coarse_table &t = coarse[f];
+        t.bounds = collect_bounds(rule_db, 0, rule_num, f);
+        t.bits.assign(t.bounds.size() * coarse_words, 0);
+
+        std::vector<std::array<size_t, 2>> runs;
+        for (size_t c=0; c<chunks.size(); ++c) {
+            size_t first = c * CHUNK_RULES;
+            size_t last = std::min(rule_num, first + CHUNK_RULES);
+
+            /* Merge the interval runs of the chunk rules */
+            runs.clear();
+            for (size_t r=first; r<last; ++r) {
+                const rule_field &field = rule_db[rule_id(r)].fields[f];
+                runs.push_back({
+                    interval_of(t.bounds, field.low),
+                    interval_of(t.bounds, field.high)
+                });
+            }
+            std::sort(runs.begin(), runs.end());
+
+            size_t cursor = 0;
+            for (auto &run : runs) {
+                for (size_t k=std::max(cursor, run[0]); k<=run[1]; ++k) {
+                    t.bits[k * coarse_words + c / 64] |= 1ULL << (c % 64);
+                }
+                cursor = std::max(cursor, run[1] + 1);
+            }
+        }
+    }
+
+    /**
+     * @brief Sets "acc" to the chunk "c" rules that match "hdr". Returns false
+     * if there are none.
+     */
+    inline bool
+    match_chunk(size_t c, const packet_header<F> &hdr, bitmap &acc) const
+    {
+        const std::array<field_table, F> &tables = chunks[c];
+#ifdef __AVX2__
+        const field_table &t0 = tables[order[0]];
+        __m256i v = _mm256_loadu_si256((const __m256i*)
+                    &t0.bitmaps[interval_of(t0.bounds, hdr[order[0]])]);
+        for (int i=1; i<F; ++i) {
+            const field_table &t = tables[order[i]];
+            __m256i b = _mm256_loadu_si256((const __m256i*)
+                        &t.bitmaps[interval_of(t.bounds, hdr[order[i]])]);
+            v = _mm256_and_si256(v, b);
+            if (_mm256_testz_si256(v, v)) {
+                return false;
+            }
+        }
+        _mm256_storeu_si256((__m256i*)&acc, v);
+        return true;
+#else
+        const field_table &t0 = tables[order[0]];
+        acc = t0.bitmaps[interval_of(t0.bounds, hdr[order[0]])];
+        for (int i=1; i<F; ++i) {
+            const field_table &t = tables[order[i]];
+            const bitmap &b = t.bitmaps[interval_of(t.bounds, hdr[order[i]])];
+            uint64_t any = 0;
+            for (size_t w=0; w<WORDS; ++w) {
+                acc.words[w] &= b.words[w];
+                any |= acc.words[w];
+            }
+            if (!any) {
+                return false;
+            }
+        }
+        return true;
+#endif
+    }
+
+    /**
+     * @brief Invokes "fn(c)" for every chunk "c" < "chunk_limit" that may
+     * hold a rule matching "hdr", in ascending order, until "fn" returns
+     * false.
+     */
+    template <typename Fn>
+    inline void
+    for_each_candidate(const packet_header<F> &hdr,
+                       size_t chunk_limit,
+                       Fn fn) const
+    {
+        chunk_limit = std::min(chunk_limit, chunks.size());
+        if (!coarse_words) {
+            for (size_t c=0; c<chunk_limit; ++c) {
+                if (!fn(c)) {
+                    return;
+                }
+            }
+            return;
+        }
+
+        const uint64_t *rows[F];
+        for (int f=0; f<F; ++f) {
+            size_t k = interval_of(coarse[f].bounds, hdr[f]);
+            rows[f] = &coarse[f].bits[k * coarse_words];
+        }
+        size_t word_limit = (chunk_limit + 63) / 64;
+        for (size_t w=0; w<word_limit; ++w) {
+            uint64_t word = rows[0][w];
+            for (int f=1; f<F; ++f) {
+                word &= rows[f][w];
+            }
+            while (word) {
+                size_t c = w * 64 + __builtin_ctzll(word);
+                if (c >= chunk_limit || !fn(c)) {
+                    return;
+                }
+                word &= word - 1;
+            }
+        }
+    }
+
+    /**
+     * @brief Builds the tables of the indexed rules of "rule_db". Uses
+     * "pool" when it is not null.
+     */
+    void
+    build_tables(const ruleset<F> &rule_db, thread_pool *pool)
+    {
+        chunks.resize((rule_num + CHUNK_RULES - 1) / CHUNK_RULES);
+
+        /* Fields with more distinct ranges reject mismatching chunks
+         * sooner */
+        std::array<size_t, F> distinct;
+        for (int f=0; f<F; ++f) {
+            distinct[f] = collect_bounds(rule_db, 0, rule_num, f).size();
+            order[f] = f;
+        }
+        std::stable_sort(order.begin(), order.end(), [&] (int a, int b) {
+            return distinct[a] > distinct[b];
+        });
+
+        size_t words = (chunks.size() + 63) / 64;
+        size_t coarse_bytes = 0;
+        for (int f=0; f<F; ++f) {
+            coarse_bytes += (rule_num * 2 + 1) * words * sizeof(uint64_t);
+        }
+        if (chunks.size() > 1 && coarse_bytes <= COARSE_MAX_BYTES) {
+            coarse_words = words;
+        }
+
+        auto build = [&] (size_t first, size_t last) {
+            for (size_t i=first; i<last; ++i) {
+                if (i < chunks.size()) {
+                    build_chunk(rule_db, i);
+                } else {
+                    build_coarse(rule_db, i - chunks.size());
+                }
+            }
+        };
+        size_t tasks = chunks.size() + (coarse_words ? F : 0);
+        if (pool) {
+            pool->parallel_for(0, tasks, 1, build);
+        } else {
+            build(0, tasks);
+        }
+    }
+
+public:
+
+    /**
+     * @brief Builds an index over "rule_db". Rule priority is the rule
+     * index (lower index wins). Uses "pool" when it is not null.
+     */
+    rule_index(const ruleset<F> &rule_db, thread_pool *pool = nullptr)
+    : coarse_words(0),
+      rule_num(rule_db.size())
+    {
+        build_tables(rule_db, pool);
+    }
+
+    /**
+     * @brief Builds an index over the rules "rules" of "rule_db", in
+     * ascending order. Lookups return ruleset indices, and see only these
+     * rules. Uses "pool" when it is not null.
+     */
+    rule_index(const ruleset<F> &rule_db, std::vector<size_t> rules,
+               thread_pool *pool = nullptr)
+    : coarse_words(0),
+      rule_num(rules.size()),
+      ids(std::move(rules))
+    {
+        build_tables(rule_db, pool);
+    }
+
+    /**
+     * @brief Returns the number of indexed rules
+     */
+    size_t
+    size() const
+    {
+        return rule_num;
+    }
+
+    /**
+     * @brief Returns the index of the first rule that matches "hdr" among
+     * rules [0, limit), or -1 if there is none.
+     */
+    int
+    first_match(const packet_header<F> &hdr, size_t limit = SIZE_MAX) const
+    {
+        int out = -1;
+        if (!ids.empty()) {
+            limit = std::lower_bound(ids.begin(), ids.end(), limit) -
+                    ids.begin();
+        }
+        limit = std::min(limit, rule_num);
+        size_t chunk_limit = (limit + CHUNK_RULES - 1) / CHUNK_RULES;
+        bitmap acc;
+
+        for_each_candidate(hdr, chunk_limit, [&] (size_t c) {
+            if (!match_chunk(c, hdr, acc)) {
+                return true;
+            }
+            for (size_t w=0; w<WORDS; ++w) {
+                if (acc.words[w]) {
+                    size_t r = c * CHUNK_RULES + w * 64 +
+                               __builtin_ctzll(acc.words[w]);
+                    if (r < limit) {
+                        out = rule_id(r);
+                    }
+                    return false;
+                }
+            }
+            return true;
+        });
+        return out;
+    }
+
+    /**
+     * @brief Invokes "fn(rule_idx)" for each rule that matches "hdr", in
+     * priority order.
+     */
+    template <typename Fn>
+    void
+    for_each_match(const packet_header<F> &hdr, Fn fn) const
+    {
+        bitmap acc;
+        for_each_candidate(hdr, chunks.size(), [&] (size_t c) {
+            if (!match_chunk(c, hdr, acc)) {
+                return true;
+            }
+            for (size_t w=0; w<WORDS; ++w) {
+                uint64_t word = acc.words[w];
+                while (word) {
+                    fn(rule_id(c * CHUNK_RULES + w * 64 +
+                               __builtin_ctzll(word)));
+                    word &= word - 1;
+                }
+            }
+            return true;
+        });
+    }
+
+    /**
+     * @brief Returns the number of rules that match "hdr"
+     */
+    size_t
+    match_count(const packet_header<F> &hdr) const
+    {
+        size_t out = 0;
+        bitmap acc;
+        for_each_candidate(hdr, chunks.size(), [&] (size_t c) {
+            if (match_chunk(c, hdr, acc)) {
+                for (size_t w=0; w<WORDS; ++w) {
+                    out += __builtin_popcountll(acc.words[w]);
+                }
+            }
+            return true;
+        });
+        return out;
+    }
+};
+
+};
+
+#endif /* RULE_INDEX_H */
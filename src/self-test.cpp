@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+#include "integer-interval-set.h"
+#include "overlap-index.h"
+#include "perfect-hash.h"
+#include "pipeline.h"
+#include "random.h"
+
+using namespace cbmapper;
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                                        \
+    do {                                                        \
+        if (!(cond)) {                                          \
+            fprintf(stderr, "%s:%d: check failed: %s: ",        \
+                    __FILE__, __LINE__, #cond);                 \
+            fprintf(stderr, __VA_ARGS__);                       \
+            fprintf(stderr, "\n");                              \
+            failures++;                                         \
+        }                                                       \
+    } while (0)
+
+/**
+ * @brief Checks random_counter against the Philox4x32-10 known-answer
+ * vectors of Random123, and "generate" against single samples
+ */
+static void
+test_philox()
+{
+    struct vector {
+        uint32_t ctr[4];
+        uint32_t key[2];
+        uint32_t out[4];
+    };
+    const vector vectors[] = {
+        {{0x00000000, 0x00000000, 0x00000000, 0x00000000},
+         {0x00000000, 0x00000000},
+         {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8}},
+        {{0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+         {0xffffffff, 0xffffffff},
+         {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd}},
+        {{0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+         {0xa4093822, 0x299f31d0},
+         {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1}},
+    };
+    for (const vector &v : vectors) {
+        /* The counter is (sample, index), low words first */
+        random_counter rng((int)v.key[0], v.key[1]);
+        uint64_t sample = v.ctr[0] | (uint64_t)v.ctr[1] << 32;
+        uint64_t index = v.ctr[2] | (uint64_t)v.ctr[3] << 32;
+        for (int w=0; w<4; ++w) {
+            uint32_t out = rng(index, sample, w);
+            CHECK(out == v.out[w], "key %08x: word %d is %08x, expected %08x",
+                  v.key[0], w, out, v.out[w]);
+        }
+    }
+
+    /* Vector and scalar samples agree, also across the 2^32 sample carry */
+    random_counter rng(7, 3);
+    const size_t n = 100;
+    const uint64_t firsts[] = {0, 5, 0xffffffffULL - 40};
+    for (uint64_t first : firsts) {
+        std::vector<uint32_t> words[4];
+        uint32_t *out[4];
+        for (int w=0; w<4; ++w) {
+            words[w].resize(n);
+            out[w] = words[w].data();
+        }
+        rng.generate(11, first, n, out);
+        for (size_t j=0; j<n; ++j) {
+            for (int w=0; w<4; ++w) {
+                CHECK(words[w][j] == rng(11, first + j, w),
+                      "sample %lu word %d", first + j, w);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Checks that perfect_hash maps its keys to [0, size()) one to one
+ */
+static void
+test_perfect_hash()
+{
+    random_stream rng(1, 0, 0);
+    const size_t sizes[] = {1, 2, 3, 100, 1000, 100000};
+    for (size_t n : sizes) {
+        std::vector<uint64_t> keys(n);
+        for (uint64_t &k : keys) {
+            k = rng.random_uint64();
+        }
+        perfect_hash hash;
+        CHECK(hash.build(keys), "build of %lu keys failed", n);
+        CHECK(hash.size() == n, "size %lu, expected %lu", hash.size(), n);
+        std::vector<char> seen(n);
+        size_t bad = 0;
+        for (uint64_t k : keys) {
+            uint64_t p = hash.lookup(k);
+            if (p >= n || seen[p]) {
+                bad++;
+            } else {
+                seen[p] = 1;
+            }
+        }
+        CHECK(!bad, "%lu of %lu keys collide or map out of range", bad, n);
+    }
+
+    std::vector<uint64_t> keys = {5, 9, 5};
+    perfect_hash hash;
+    CHECK(!hash.build(keys), "build of duplicate keys succeeded");
+}
+
+/**
+ * @brief Checks integer_box_set::complement against brute force on random
+ * covers: every point of the domain lies in exactly one box iff no cover
+ * holds it. Boxes and covers are bounded by the cover bounds, so it is
+ * enough to test the points whose coordinates are bounds or next to them.
+ */
+static void
+test_box_complement()
+{
+    constexpr int F = 3;
+    using box = integer_box_set<F>::box;
+    random_stream rng(2, 0, 0);
+
+    for (int trial=0; trial<200; ++trial) {
+        std::vector<box> covers(rng.random_uint32(1, 8));
+        for (box &c : covers) {
+            for (int d=0; d<F; ++d) {
+                uint32_t a = rng.random_uint32(0, 20);
+                uint32_t b = rng.random_uint32(0, 20);
+                c[d] = {std::min(a, b), std::max(a, b)};
+            }
+            /* Some covers span a whole dimension */
+            if (rng.random_uint32(0, 3) == 0) {
+                c[rng.random_uint32(0, F - 1)] = {0, 0xffffffff};
+            }
+        }
+        integer_box_set<F> set = integer_box_set<F>::complement(covers,
+                                                                1 << 20,
+                                                                1 << 20);
+        CHECK(!set.is_truncated(), "trial %d truncated", trial);
+
+        std::array<std::vector<uint32_t>, F> coords;
+        for (int d=0; d<F; ++d) {
+            coords[d] = {0, 0xffffffff};
+            for (const box &c : covers) {
+                for (uint32_t v : c[d]) {
+                    coords[d].push_back(v);
+                    if (v > 0) {
+                        coords[d].push_back(v - 1);
+                    }
+                    if (v < 0xffffffff) {
+                        coords[d].push_back(v + 1);
+                    }
+                }
+            }
+            std::sort(coords[d].begin(), coords[d].end());
+            coords[d].erase(std::unique(coords[d].begin(), coords[d].end()),
+                            coords[d].end());
+        }
+
+        auto holds = [] (const box &b, const std::array<uint32_t, F> &p) {
+            for (int d=0; d<F; ++d) {
+                if (p[d] < b[d][0] || p[d] > b[d][1]) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        size_t bad = 0;
+        std::array<uint32_t, F> p;
+        for (uint32_t x : coords[0]) {
+            for (uint32_t y : coords[1]) {
+                for (uint32_t z : coords[2]) {
+                    p = {x, y, z};
+                    bool covered = false;
+                    for (const box &c : covers) {
+                        covered |= holds(c, p);
+                    }
+                    size_t in = 0;
+                    for (size_t i=0; i<set.size(); ++i) {
+                        in += set.is_exact(i) && holds(set[i], p);
+                    }
+                    bad += in != (covered ? 0 : 1);
+                }
+            }
+        }
+        CHECK(!bad, "trial %d: %lu points misplaced", trial, bad);
+    }
+}
+
+/**
+ * @brief Checks that pipeline_stage processes items in order and passes
+ * the first exception to the producer
+ */
+static void
+test_pipeline_stage()
+{
+    std::vector<int> seen;
+    {
+        pipeline_stage<int> stage(2, [&] (int &item) {
+            seen.push_back(item);
+        });
+        for (int i=0; i<1000; ++i) {
+            stage.push(i);
+        }
+        stage.drain();
+        CHECK(seen.size() == 1000, "%lu items after drain", seen.size());
+        stage.push(1000);
+        stage.finish();
+    }
+    bool ordered = seen.size() == 1001;
+    for (size_t i=0; ordered && i<seen.size(); ++i) {
+        ordered = seen[i] == (int)i;
+    }
+    CHECK(ordered, "items out of order");
+
+    bool thrown = false;
+    try {
+        pipeline_stage<int> stage(1, [&] (int &item) {
+            if (item == 3) {
+                throw std::runtime_error("stage failed");
+            }
+        });
+        for (int i=0; i<10; ++i) {
+            stage.push(i);
+        }
+        stage.finish();
+    } catch (std::runtime_error &e) {
+        thrown = true;
+    }
+    CHECK(thrown, "the exception of the stage was lost");
+}
+
+/**
+ * @brief Checks overlap_index against brute force on random rules, small
+ * enough that many of them overlap
+ */
+static void
+test_overlap_index()
+{
+    constexpr int F = 3;
+    random_stream rng(3, 0, 0);
+    ruleset<F> rule_db;
+    for (uint32_t i=0; i<300; ++i) {
+        rule<F> r;
+        r.unique_id = i;
+        for (int f=0; f<F; ++f) {
+            uint32_t a = rng.random_uint32(0, 100);
+            uint32_t b = rng.random_uint32(0, 100);
+            r.fields[f].low = std::min(a, b);
+            r.fields[f].high = std::max(a, b);
+        }
+        rule_db.push_back(r);
+    }
+    overlap_index<F> index(rule_db);
+
+    for (int trial=0; trial<200; ++trial) {
+        overlap_index<F>::box b;
+        for (int f=0; f<F; ++f) {
+            uint32_t x = rng.random_uint32(0, 100);
+            uint32_t y = rng.random_uint32(0, 100);
+            b[f] = {std::min(x, y), std::max(x, y)};
+        }
+        size_t first = rng.random_uint32(0, 150);
+        size_t last = rng.random_uint32(150, 300);
+
+        std::vector<size_t> expected;
+        size_t field_num = 0;
+        for (size_t i=0; i<rule_db.size(); ++i) {
+            const rule<F> &r = rule_db[i];
+            field_num += r.fields[0].low <= b[0][1] &&
+                         b[0][0] <= r.fields[0].high;
+            bool overlaps = true;
+            for (int f=0; f<F; ++f) {
+                overlaps &= r.fields[f].low <= b[f][1] &&
+                            b[f][0] <= r.fields[f].high;
+            }
+            if (overlaps && i >= first && i < last) {
+                expected.push_back(i);
+            }
+        }
+        size_t num = index.count_field_overlaps(0, b[0][0], b[0][1]);
+        CHECK(num == field_num, "trial %d: %lu field overlaps, expected %lu",
+              trial, num, field_num);
+
+        std::vector<size_t> found;
+        index.for_each_overlap(b, first, last, [&] (size_t rule_idx) {
+            found.push_back(rule_idx);
+            return true;
+        });
+        std::sort(found.begin(), found.end());
+        CHECK(found == expected, "trial %d: %lu overlaps, expected %lu",
+              trial, found.size(), expected.size());
+
+        /* Field overlaps come in ascending order of the low bound */
+        uint32_t previous = 0;
+        bool ordered = true;
+        size_t visited = 0;
+        index.for_each_field_overlap(1, b[1][0], b[1][1], 0, rule_db.size(),
+                                     [&] (size_t rule_idx) {
+            ordered &= rule_db[rule_idx].fields[1].low >= previous;
+            previous = rule_db[rule_idx].fields[1].low;
+            return ++visited < 5;
+        });
+        CHECK(ordered, "trial %d: field overlaps out of order", trial);
+        CHECK(visited <= 5, "trial %d: %lu overlaps after stopping", trial,
+              visited);
+    }
+}
+
+int
+main()
+{
+    test_philox();
+    test_perfect_hash();
+    test_box_complement();
+    test_pipeline_stage();
+    test_overlap_index();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,227 @@
+#ifndef SHARD_MERGE_H
+#define SHARD_MERGE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "errorf.h"
+#include "log.h"
+#include "reader.h"
+#include "stats.h"
+#include "zstream.h"
+
+namespace cbmapper {
+
+/**
+ * @brief Merges the binary files of the shards of a mapping (see
+ * mapping::save_shard_binary) into the binary file of the whole ruleset.
+ * The rules are concatenated and the rule IDs of the packet records are
+ * offset by the first rule of their shard, in a single streaming pass over
+ * the records; only the rules and their weights are held in memory. The
+ * result equals the binary file of an unsharded run with the same
+ * arguments, less the header hash.
+ */
+class shard_merger {
+
+    /* Packet records per read */
+    static constexpr size_t CHUNK = 1 << 16;
+
+    struct shard_file {
+        std::string name;
+        uint32_t rule_num;
+        uint64_t header_num;
+    };
+
+    std::vector<shard_file> shards;
+    std::vector<uint32_t> rule_data;
+    std::vector<double> weights;
+    size_t weighted_shards;
+    uint32_t field_num;
+
+    /**
+     * @brief Opens "name" and reads its rules, appending them to
+     * "rule_data" if "keep" is set, up to its packet records
+     */
+    void
+    open_shard(zstream &file, shard_file &shard, bool keep)
+    {
+        file.open_read(shard.name.c_str());
+        if (file.read_string(6) != "ruledb") {
+            throw errorf("Cannot read file \"%s\": header mismatch",
+                         shard.name.c_str());
+        }
+        shard.rule_num = file.read_u32();
+        uint32_t fields = file.read_u32();
+        if (field_num && fields != field_num) {
+            throw errorf("Shard \"%s\" has %u fields, expected %u",
+                         shard.name.c_str(), fields, field_num);
+        }
+        field_num = fields;
+        std::vector<uint32_t> rules((size_t)shard.rule_num *
+                                    (1 + 2 * field_num));
+        size_t bytes = rules.size() * sizeof(uint32_t);
+        if (file.read(rules.data(), bytes) != bytes ||
+            file.read_string(8) != "packetdb") {
+            throw errorf("Cannot read file \"%s\": header mismatch",
+                         shard.name.c_str());
+        }
+        shard.header_num = file.read_count();
+        if (keep) {
+            rule_data.insert(rule_data.end(), rules.begin(), rules.end());
+        }
+    }
+
+    /**
+     * @brief Copies the packet records of shard "s" from "file" to "out",
+     * offsetting their rule IDs by "first_rule", then reads its sections
+     */
+    void
+    copy_shard(zstream &file, zstream &out, size_t s, uint32_t first_rule,
+               uint32_t total_rules)
+    {
+        const shard_file &shard = shards[s];
+        size_t record = field_num + 1;
+        std::vector<uint32_t> buffer(CHUNK * record);
+        for (uint64_t done=0; done<shard.header_num; ) {
+            size_t count = std::min<uint64_t>(CHUNK, shard.header_num - done);
+            size_t bytes = count * record * sizeof(uint32_t);
+            if (file.read(buffer.data(), bytes) != bytes) {
+                throw errorf("Cannot read file \"%s\": unexpected end of "
+                             "file", shard.name.c_str());
+            }
+            for (size_t i=0; i<count; ++i) {
+                uint32_t &rule_idx = buffer[i * record + field_num];
+                if (rule_idx == reader::MISS_RULE_ID) {
+                    continue;
+                }
+                if (rule_idx >= shard.rule_num) {
+                    throw errorf("Cannot read file \"%s\": invalid rule id "
+                                 "%u", shard.name.c_str(), rule_idx);
+                }
+                rule_idx += first_rule;
+            }
+            out.write(buffer.data(), bytes);
+            done += count;
+        }
+
+        bool has_info = false;
+        for (std::string section = file.read_string(8); !section.empty();
+             section = file.read_string(8)) {
+            if (section == "flowdist") {
+                if (file.read_u32() != shard.rule_num) {
+                    throw errorf("Cannot read file \"%s\": rule weights "
+                                 "mismatch", shard.name.c_str());
+                }
+                size_t offset = weights.size();
+                weights.resize(offset + shard.rule_num);
+                size_t bytes = shard.rule_num * sizeof(double);
+                if (file.read(&weights[offset], bytes) != bytes) {
+                    throw errorf("Cannot read file \"%s\": unexpected end "
+                                 "of file", shard.name.c_str());
+                }
+                weighted_shards++;
+            } else if (section == "shardinf") {
+                reader::shard_info info;
+                info.index = file.read_u32();
+                info.num = file.read_u32();
+                info.first_rule = file.read_u32();
+                info.rule_num = file.read_u32();
+                if (info.index != s || info.num != shards.size() ||
+                    info.first_rule != first_rule ||
+                    info.rule_num != total_rules) {
+                    throw errorf("File \"%s\" is shard %u of %u from rule %u "
+                                 "of %u; expected shard %lu of %lu from rule "
+                                 "%u of %u", shard.name.c_str(), info.index,
+                                 info.num, info.first_rule, info.rule_num, s,
+                                 shards.size(), first_rule, total_rules);
+                }
+                has_info = true;
+            } else {
+                throw errorf("Cannot merge file \"%s\": unexpected section "
+                             "\"%s\"", shard.name.c_str(), section.c_str());
+            }
+        }
+        if (!has_info) {
+            throw errorf("File \"%s\" is not a shard", shard.name.c_str());
+        }
+    }
+
+public:
+
+    shard_merger()
+    : weighted_shards(0),
+      field_num(0)
+    {}
+
+    /**
+     * @brief Merges the shard files "names", in shard order, into the
+     * binary file "filename". The output is removed on error.
+     */
+    void
+    merge(const std::vector<std::string> &names, const char *filename)
+    {
+        if (names.empty()) {
+            throw errorf("No shard files to merge.");
+        }
+        shards.clear();
+        rule_data.clear();
+        weights.clear();
+        weighted_shards = 0;
+        field_num = 0;
+        for (const std::string &name : names) {
+            shards.push_back({name, 0, 0});
+        }
+
+        /* The rules and the header counts precede the records */
+        uint64_t header_num = 0;
+        for (shard_file &shard : shards) {
+            zstream file;
+            open_shard(file, shard, true);
+            header_num += shard.header_num;
+        }
+        uint32_t total_rules = rule_data.size() / (1 + 2 * field_num);
+
+        try {
+            zstream out;
+            MESSAGE("Merging %lu shards with %u rules and %lu headers into "
+                    "%s...\n", shards.size(), total_rules, header_num,
+                    filename);
+            scoped_timer timer("merge", header_num);
+            out.open_write(filename);
+            out << "ruledb"
+                << total_rules
+                << field_num;
+            out.write(rule_data.data(), rule_data.size() * sizeof(uint32_t));
+            out << "packetdb";
+            out.write_count(header_num);
+
+            uint32_t first_rule = 0;
+            for (size_t s=0; s<shards.size(); ++s) {
+                zstream file;
+                open_shard(file, shards[s], false);
+                copy_shard(file, out, s, first_rule, total_rules);
+                first_rule += shards[s].rule_num;
+                print_progress("Merging shards", s + 1, shards.size());
+            }
+            print_progress("Merging shards", 0, 0);
+
+            if (weighted_shards && weighted_shards != shards.size()) {
+                throw errorf("Shards differ in their flow distribution");
+            }
+            if (weighted_shards) {
+                out << "flowdist"
+                    << total_rules;
+                out.write(weights.data(), weights.size() * sizeof(double));
+            }
+        } catch (...) {
+            remove(filename);
+            throw;
+        }
+    }
+};
+
+};
+
+#endif /* SHARD_MERGE_H */
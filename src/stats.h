@@ -0,0 +1,450 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "errorf.h"
+#include "memory.h"
+#include "perf-counters.h"
+
+namespace cbmapper {
+
+/**
+ * @brief Statistics of a run: the wall time, calls and items of named
+ * phases, and the busy time of the threads of each thread pool. Disabled
+ * by default; when disabled, recording costs a single branch. Optionally,
+ * the hardware counters of the whole process (see perf_counters) are
+ * accumulated per phase as well. When memory_tracker is enabled, each phase
+ * holds the resident set and the accounted bytes at the end of its last
+ * call.
+ */
+class run_stats {
+
+    struct phase {
+        std::string name;
+        uint64_t calls;
+        double seconds;
+        uint64_t items;
+        bool counted;
+        perf_counters::sample counters;
+        bool sized;
+        size_t rss;
+        size_t peak_rss;
+        size_t tracked[MEMORY_CATEGORY_NUM];
+    };
+
+    struct pool {
+        double seconds;
+        std::vector<double> busy;
+    };
+
+    struct storage {
+        bool enabled = false;
+        std::chrono::steady_clock::time_point start;
+        std::mutex lock;
+        std::vector<phase> phases;
+        std::vector<pool> pools;
+        std::unique_ptr<perf_counters> counters;
+    };
+
+    static inline storage &
+    get_storage()
+    {
+        static storage s;
+        return s;
+    }
+
+    /**
+     * @brief Writes "str" to "file" as a JSON string
+     */
+    static void
+    write_string(FILE *file, const std::string &str)
+    {
+        fputc('"', file);
+        for (char c : str) {
+            if (c == '"' || c == '\\') {
+                fputc('\\', file);
+            }
+            fputc(c, file);
+        }
+        fputc('"', file);
+    }
+
+    /**
+     * @brief Returns "num" per thousand instructions of "p", or a negative
+     * value if either is not available
+     */
+    static double
+    per_kilo_instruction(const phase &p, uint64_t num)
+    {
+        uint64_t instructions = p.counters.values[perf_counters::INSTRUCTIONS];
+        if (num == UINT64_MAX || instructions == UINT64_MAX || !instructions) {
+            return -1;
+        }
+        return 1000.0 * num / instructions;
+    }
+
+    /**
+     * @brief Returns the instructions per cycle of "p", or a negative value
+     * if not available
+     */
+    static double
+    ipc(const phase &p)
+    {
+        uint64_t cycles = p.counters.values[perf_counters::CYCLES];
+        uint64_t instructions = p.counters.values[perf_counters::INSTRUCTIONS];
+        if (cycles == UINT64_MAX || instructions == UINT64_MAX || !cycles) {
+            return -1;
+        }
+        return (double)instructions / cycles;
+    }
+
+    static void
+    write_number(FILE *file, double value)
+    {
+        if (value < 0) {
+            fprintf(file, "null");
+        } else {
+            fprintf(file, "%.4f", value);
+        }
+    }
+
+public:
+
+    /**
+     * @brief Starts collecting statistics; the run time counts from here
+     */
+    static void
+    enable()
+    {
+        get_storage().enabled = true;
+        get_storage().start = std::chrono::steady_clock::now();
+    }
+
+    static inline bool
+    enabled()
+    {
+        return get_storage().enabled;
+    }
+
+    /**
+     * @brief Starts counting the hardware events of this process and its
+     * threads created from now on, per phase. Returns false and sets "error"
+     * if none of the events can be counted, e.g., when perf_event_paranoid
+     * forbids it or in a virtual machine without a PMU.
+     */
+    static bool
+    enable_counters(std::string &error)
+    {
+        storage &s = get_storage();
+        s.counters.reset(new perf_counters(true));
+        if (!s.counters->available()) {
+            error = s.counters->get_error();
+            s.counters.reset();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sets "out" to the current values of the hardware counters.
+     * Returns false if the counters are not enabled.
+     */
+    static inline bool
+    read_counters(perf_counters::sample &out)
+    {
+        storage &s = get_storage();
+        if (!s.counters) {
+            return false;
+        }
+        s.counters->read(out);
+        return true;
+    }
+
+    /**
+     * @brief Adds a call of phase "name" that took "seconds" and handled
+     * "items" items, and the hardware "counters" of the call when not null.
+     * Phases are reported in the order they first ran. Thread safe.
+     */
+    static void
+    record(const char *name, double seconds, uint64_t items,
+           const perf_counters::sample *counters = nullptr)
+    {
+        storage &s = get_storage();
+        std::lock_guard<std::mutex> guard(s.lock);
+        phase *p = nullptr;
+        for (phase &other : s.phases) {
+            if (other.name == name) {
+                p = &other;
+                break;
+            }
+        }
+        if (!p) {
+            s.phases.push_back(phase());
+            p = &s.phases.back();
+            p->name = name;
+            p->calls = 0;
+            p->seconds = 0;
+            p->items = 0;
+            p->counted = false;
+            for (uint64_t &value : p->counters.values) {
+                value = 0;
+            }
+            p->sized = false;
+        }
+        p->calls++;
+        p->seconds += seconds;
+        p->items += items;
+        if (memory_tracker::enabled()) {
+            p->sized = true;
+            p->rss = memory_tracker::rss_bytes();
+            p->peak_rss = memory_tracker::peak_rss_bytes();
+            for (int c=0; c<MEMORY_CATEGORY_NUM; ++c) {
+                p->tracked[c] = memory_tracker::current_bytes(c);
+            }
+        }
+        if (!counters) {
+            return;
+        }
+        p->counted = true;
+        for (int e=0; e<perf_counters::EVENT_NUM; ++e) {
+            if (counters->values[e] == UINT64_MAX) {
+                p->counters.values[e] = UINT64_MAX;
+            } else if (p->counters.values[e] != UINT64_MAX) {
+                p->counters.values[e] += counters->values[e];
+            }
+        }
+    }
+
+    /**
+     * @brief Adds a thread pool that existed for "seconds", whose threads
+     * executed tasks for "busy[i]" seconds each. Thread safe.
+     */
+    static void
+    record_pool(double seconds, const std::vector<double> &busy)
+    {
+        storage &s = get_storage();
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.pools.push_back({seconds, busy});
+    }
+
+    /**
+     * @brief Writes the statistics as JSON to "filename", with "mode" and
+     * "status" (e.g., "ok" or the error) of the run.
+     */
+    static void
+    write_json(const char *filename,
+               const std::string &mode,
+               const std::string &status)
+    {
+        storage &s = get_storage();
+        std::lock_guard<std::mutex> guard(s.lock);
+        FILE *file = fopen(filename, "w");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.", filename);
+        }
+        std::chrono::duration<double> wall =
+            std::chrono::steady_clock::now() - s.start;
+
+        fprintf(file, "{\n  \"mode\": ");
+        write_string(file, mode);
+        fprintf(file, ",\n  \"status\": ");
+        write_string(file, status);
+        fprintf(file, ",\n  \"wall_seconds\": %.6f,\n  \"phases\": [",
+                wall.count());
+        for (size_t i=0; i<s.phases.size(); ++i) {
+            const phase &p = s.phases[i];
+            fprintf(file, "%s\n    {\"name\": ", i ? "," : "");
+            write_string(file, p.name);
+            fprintf(file, ", \"calls\": %lu, \"seconds\": %.6f, "
+                    "\"items\": %lu, \"items_per_second\": %.1f",
+                    p.calls, p.seconds, p.items,
+                    p.seconds > 0 ? p.items / p.seconds : 0.0);
+            if (p.sized) {
+                fprintf(file, ", \"memory\": {\"rss_bytes\": %lu, "
+                        "\"peak_rss_bytes\": %lu", p.rss, p.peak_rss);
+                for (int c=0; c<MEMORY_CATEGORY_NUM; ++c) {
+                    fprintf(file, ", \"%s_bytes\": %lu",
+                            memory_tracker::category_name(c), p.tracked[c]);
+                }
+                fputc('}', file);
+            }
+            if (!p.counted) {
+                fputc('}', file);
+                continue;
+            }
+            fprintf(file, ", \"counters\": {");
+            for (int e=0; e<perf_counters::EVENT_NUM; ++e) {
+                fprintf(file, "\"%s\": ", perf_counters::event_name(e));
+                if (p.counters.values[e] == UINT64_MAX) {
+                    fprintf(file, "null, ");
+                } else {
+                    fprintf(file, "%lu, ", p.counters.values[e]);
+                }
+            }
+            fprintf(file, "\"ipc\": ");
+            write_number(file, ipc(p));
+            fprintf(file, ", \"llc_mpki\": ");
+            write_number(file, per_kilo_instruction(p,
+                p.counters.values[perf_counters::LLC_MISSES]));
+            fprintf(file, ", \"branch_mpki\": ");
+            write_number(file, per_kilo_instruction(p,
+                p.counters.values[perf_counters::BRANCH_MISSES]));
+            fprintf(file, "}}");
+        }
+        fprintf(file, "\n  ],\n  \"thread_pools\": [");
+        for (size_t i=0; i<s.pools.size(); ++i) {
+            const pool &p = s.pools[i];
+            double busy = 0;
+            fprintf(file, "%s\n    {\"threads\": %lu, \"seconds\": %.6f, "
+                    "\"busy_seconds\": [", i ? "," : "", p.busy.size(),
+                    p.seconds);
+            for (size_t t=0; t<p.busy.size(); ++t) {
+                fprintf(file, "%s%.6f", t ? ", " : "", p.busy[t]);
+                busy += p.busy[t];
+            }
+            double capacity = p.seconds * p.busy.size();
+            fprintf(file, "], \"utilization\": %.4f}",
+                    capacity > 0 ? busy / capacity : 0.0);
+        }
+        fprintf(file, "\n  ]");
+        if (memory_tracker::enabled()) {
+            fprintf(file, ",\n  \"memory\": {\"budget_bytes\": %lu, "
+                    "\"peak_rss_bytes\": %lu",
+                    memory_tracker::get_budget(),
+                    memory_tracker::peak_rss_bytes());
+            for (int c=0; c<MEMORY_CATEGORY_NUM; ++c) {
+                fprintf(file, ", \"%s_peak_bytes\": %lu",
+                        memory_tracker::category_name(c),
+                        memory_tracker::peak_bytes(c));
+            }
+            fputc('}', file);
+        }
+        fprintf(file, "\n}\n");
+        if (fclose(file)) {
+            throw errorf("cannot write to \"%s\".", filename);
+        }
+    }
+
+    /**
+     * @brief Returns a table of the instructions per cycle and the cache and
+     * branch misses per thousand instructions of the phases with hardware
+     * counters, or an empty string if there are none
+     */
+    static std::string
+    counter_table()
+    {
+        storage &s = get_storage();
+        std::lock_guard<std::mutex> guard(s.lock);
+        std::string table;
+        char line[256];
+        for (const phase &p : s.phases) {
+            if (!p.counted) {
+                continue;
+            }
+            if (table.empty()) {
+                snprintf(line, sizeof(line), "%-20s %10s %8s %10s %12s\n",
+                         "Phase", "Seconds", "IPC", "LLC MPKI",
+                         "Branch MPKI");
+                table += line;
+            }
+            double values[3] = {
+                ipc(p),
+                per_kilo_instruction(p,
+                    p.counters.values[perf_counters::LLC_MISSES]),
+                per_kilo_instruction(p,
+                    p.counters.values[perf_counters::BRANCH_MISSES])
+            };
+            snprintf(line, sizeof(line), "%-20s %10.3f", p.name.c_str(),
+                     p.seconds);
+            table += line;
+            const int widths[3] = {8, 10, 12};
+            for (int i=0; i<3; ++i) {
+                if (values[i] < 0) {
+                    snprintf(line, sizeof(line), " %*s", widths[i], "-");
+                } else {
+                    snprintf(line, sizeof(line), " %*.3f", widths[i],
+                             values[i]);
+                }
+                table += line;
+            }
+            table += "\n";
+        }
+        return table;
+    }
+};
+
+/**
+ * @brief Records the time from its creation to its destruction as a call
+ * of phase "name" (see run_stats::record), with the items added by
+ * "add_items" and the hardware counters when enabled. Does nothing when the
+ * statistics are disabled.
+ */
+class scoped_timer {
+    const char *name;
+    uint64_t items;
+    bool active;
+    bool counted;
+    std::chrono::steady_clock::time_point start;
+    perf_counters::sample first;
+
+public:
+
+    scoped_timer(const char *name, uint64_t items = 0)
+    : name(name),
+      items(items),
+      active(run_stats::enabled()),
+      counted(false)
+    {
+        if (active) {
+            counted = run_stats::read_counters(first);
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~scoped_timer()
+    {
+        stop();
+    }
+
+    scoped_timer(const scoped_timer&) = delete;
+    scoped_timer& operator=(const scoped_timer&) = delete;
+
+    void
+    add_items(uint64_t num)
+    {
+        items += num;
+    }
+
+    /**
+     * @brief Records the call now rather than on destruction
+     */
+    void
+    stop()
+    {
+        if (!active) {
+            return;
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        active = false;
+        perf_counters::sample last;
+        if (!counted || !run_stats::read_counters(last)) {
+            run_stats::record(name, elapsed.count(), items);
+            return;
+        }
+        perf_counters::sample delta;
+        perf_counters::difference(first, last, delta);
+        run_stats::record(name, elapsed.count(), items, &delta);
+    }
+};
+
+};
+
+#endif /* STATS_H */
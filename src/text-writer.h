@@ -0,0 +1,276 @@
+#ifndef TEXT_WRITER_H
+#define TEXT_WRITER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "errorf.h"
+#include "ruleset.h"
+#include "thread-pool.h"
+
+namespace cbmapper {
+
+/**
+ * @brief Writes the decimal representation of "value" at "out", without a
+ * terminating null. Returns a pointer past the last digit. The digit count
+ * is computed up front from the bit length, and digits are emitted two at a
+ * time from a table.
+ */
+static inline char*
+format_decimal(char *out, uint64_t value)
+{
+    static constexpr uint64_t powers[20] = {
+        0, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL,
+        10000000000000000000ULL
+    };
+    static constexpr char pairs[201] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+
+    /* floor(log10(2^bits)) approximated as bits * 1233 / 4096 */
+    unsigned bits = 64 - __builtin_clzll(value | 1);
+    unsigned t = (bits * 1233) >> 12;
+    unsigned digits = t + (value >= powers[t]);
+
+    char *end = out + digits;
+    char *p = end;
+    while (value >= 100) {
+        p -= 2;
+        memcpy(p, &pairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        memcpy(p - 2, &pairs[value * 2], 2);
+    } else {
+        p[-1] = '0' + value;
+    }
+    return end;
+}
+
+/**
+ * @brief Writes a textual mapping in format RULE-ID: FIELD0 FIELD1 ...
+ * Lines are formatted into large buffers, without stdio, and written to the
+ * file descriptor in large chunks. Blocks of headers are formatted by the
+ * thread pool in pieces that are written in order as they complete.
+ * @tparam F Number of fields
+ */
+template <int F>
+class text_writer {
+
+    using packet_hdr = packet_header<F>;
+
+    /* Maximal bytes per line: a 64-bit rule index and colon, F 32-bit
+     * fields with a leading space each, and a newline */
+    static constexpr size_t LINE_BYTES = 21 + F * 11 + 1;
+    /* Headers per piece formatted by a single task */
+    static constexpr size_t PIECE_HEADERS = 1 << 15;
+    /* Bytes collected by "append" before they are written */
+    static constexpr size_t BUFFER_BYTES = 1 << 22;
+
+    int fd;
+    std::string filename;
+    std::vector<char> buffer;
+    size_t buffer_used;
+    /* Piece buffers of "write_block", reused between blocks */
+    std::vector<std::vector<char>> pieces;
+
+    /**
+     * @brief Writes "hdr" of rule "rule_idx" at "out". Returns a pointer past
+     * the line.
+     */
+    static inline char*
+    format_line(char *out, size_t rule_idx, const packet_hdr &hdr)
+    {
+        out = format_decimal(out, rule_idx);
+        *out++ = ':';
+        for (int f=0; f<F; ++f) {
+            *out++ = ' ';
+            out = format_decimal(out, hdr[f]);
+        }
+        *out++ = '\n';
+        return out;
+    }
+
+    /**
+     * @brief Writes all "size" bytes of "data" to the file
+     */
+    void
+    write_all(const char *data, size_t size)
+    {
+        while (size > 0) {
+            ssize_t bytes = ::write(fd, data, size);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw errorf("cannot write to \"%s\": %s", filename.c_str(),
+                             strerror(errno));
+            }
+            data += bytes;
+            size -= bytes;
+        }
+    }
+
+    /**
+     * @brief Writes the lines collected by "append"
+     */
+    void
+    flush()
+    {
+        write_all(buffer.data(), buffer_used);
+        buffer_used = 0;
+    }
+
+public:
+
+    text_writer()
+    : fd(-1),
+      buffer_used(0)
+    {}
+
+    ~text_writer()
+    {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    text_writer(const text_writer&) = delete;
+    text_writer& operator=(const text_writer&) = delete;
+
+    /**
+     * @brief Creates (or truncates) "filename" for writing.
+     */
+    void
+    open(const char *filename)
+    {
+        this->filename = filename;
+        fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            throw errorf("cannot open output filename for writing.");
+        }
+        buffer.resize(BUFFER_BYTES);
+        buffer_used = 0;
+    }
+
+    /**
+     * @brief Writes pending lines and closes the file.
+     */
+    void
+    close()
+    {
+        if (fd < 0) {
+            return;
+        }
+        flush();
+        int status = ::close(fd);
+        fd = -1;
+        if (status) {
+            throw errorf("cannot write to \"%s\": %s", filename.c_str(),
+                         strerror(errno));
+        }
+    }
+
+    /**
+     * @brief Writes "hdr" of rule "rule_idx" after the lines written so far.
+     * Lines are buffered; not thread-safe.
+     */
+    void
+    append(size_t rule_idx, const packet_hdr &hdr)
+    {
+        if (buffer_used + LINE_BYTES > buffer.size()) {
+            flush();
+        }
+        buffer_used = format_line(&buffer[buffer_used], rule_idx, hdr) -
+                      buffer.data();
+    }
+
+    /**
+     * @brief Writes "headers" of rules "first", "first+1", ... after the
+     * lines written so far. The headers of rule "first+i" are
+     * headers[offsets[i]] ... headers[offsets[i+1]-1]. Pieces of the block
+     * are formatted in parallel on "pool" and written in order.
+     */
+    template <typename Alloc>
+    void
+    write_block(size_t first,
+                const std::vector<packet_hdr, Alloc> &headers,
+                const std::vector<size_t> &offsets,
+                thread_pool &pool)
+    {
+        flush();
+        size_t piece_num = (headers.size() + PIECE_HEADERS - 1) /
+                           PIECE_HEADERS;
+        if (!piece_num) {
+            return;
+        }
+
+        /* Pieces in flight, two per thread so that formatting continues
+         * while a piece is written */
+        size_t window = std::min(piece_num, pool.size() * 2);
+        if (pieces.size() < window) {
+            pieces.resize(window);
+        }
+        std::unique_ptr<std::atomic<size_t>[]> lengths(
+            new std::atomic<size_t>[window]);
+
+        auto format_piece = [&] (size_t p) {
+            size_t k = p * PIECE_HEADERS;
+            size_t end = std::min(headers.size(), k + PIECE_HEADERS);
+            size_t i = std::upper_bound(offsets.begin(), offsets.end(), k) -
+                       offsets.begin() - 1;
+            std::vector<char> &buf = pieces[p % window];
+            char *out = buf.data();
+            for (; k<end; ++k) {
+                while (offsets[i+1] <= k) {
+                    i++;
+                }
+                out = format_line(out, first + i, headers[k]);
+            }
+            lengths[p % window].store(out - buf.data());
+        };
+        auto submit_piece = [&] (size_t p) {
+            pieces[p % window].resize(PIECE_HEADERS * LINE_BYTES);
+            lengths[p % window].store(SIZE_MAX);
+            pool.submit([&format_piece, p] { format_piece(p); });
+        };
+
+        for (size_t p=0; p<window; ++p) {
+            submit_piece(p);
+        }
+        for (size_t p=0; p<piece_num; ++p) {
+            std::atomic<size_t> &length = lengths[p % window];
+            pool.wait_until([&] { return length.load() != SIZE_MAX; });
+            try {
+                write_all(pieces[p % window].data(), length.load());
+            } catch (...) {
+                /* Let pieces in flight finish before unwinding */
+                for (size_t q=p+1; q<std::min(piece_num, p+window); ++q) {
+                    std::atomic<size_t> &l = lengths[q % window];
+                    pool.wait_until([&] { return l.load() != SIZE_MAX; });
+                }
+                throw;
+            }
+            if (p + window < piece_num) {
+                submit_piece(p + window);
+            }
+        }
+    }
+};
+
+};
+
+#endif /* TEXT_WRITER_H */
@@ -0,0 +1,282 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+
+namespace cbmapper {
+
+/**
+ * @brief A work-stealing thread pool. Each worker owns a task queue; it
+ * executes its own tasks in LIFO order and steals from the other queues in
+ * FIFO order when idle. The calling thread participates in the work while
+ * waiting, so a pool of N threads spawns N-1 workers. When run statistics
+ * are enabled, the time each thread spends in tasks is recorded.
+ */
+class thread_pool {
+
+    using task = std::function<void()>;
+
+    struct task_queue {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<task_queue>> queues;
+    std::atomic<size_t> pending;
+    std::atomic<size_t> next_queue;
+    std::atomic<bool> stop;
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cv;
+    /* Nanoseconds in tasks per queue, for run_stats */
+    std::unique_ptr<std::atomic<uint64_t>[]> busy_ns;
+    std::chrono::steady_clock::time_point created;
+
+    /**
+     * @brief Executes "t" for the thread of queue "self" (external threads
+     * count as queue 0). Tasks run by a waiting task are part of its time.
+     */
+    void
+    execute(int self, task &t)
+    {
+        thread_local int depth = 0;
+        if (!run_stats::enabled() || depth) {
+            t();
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        depth++;
+        try {
+            t();
+        } catch (...) {
+            depth--;
+            throw;
+        }
+        depth--;
+        std::chrono::nanoseconds elapsed =
+            std::chrono::steady_clock::now() - start;
+        busy_ns[self >= 0 ? self : 0].fetch_add(elapsed.count());
+    }
+
+    /**
+     * @brief Returns the queue index of the current thread in "pool", or -1
+     * if the current thread is not one of its workers.
+     */
+    static int &
+    worker_index(const thread_pool *pool)
+    {
+        thread_local const thread_pool *owner = nullptr;
+        thread_local int index = -1;
+        if (owner != pool) {
+            owner = pool;
+            index = -1;
+        }
+        return index;
+    }
+
+    /**
+     * @brief Pops a task from the queue of worker "self", or steals one from
+     * any of the other queues. Returns false if all queues are empty.
+     */
+    bool
+    try_pop(int self, task &out)
+    {
+        size_t qnum = queues.size();
+        if (self >= 0) {
+            task_queue &q = *queues[self];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                out = std::move(q.tasks.back());
+                q.tasks.pop_back();
+                return true;
+            }
+        }
+        size_t start = self >= 0 ? self + 1 : 0;
+        for (size_t i=0; i<qnum; ++i) {
+            task_queue &q = *queues[(start + i) % qnum];
+            std::lock_guard<std::mutex> guard(q.lock);
+            if (!q.tasks.empty()) {
+                out = std::move(q.tasks.front());
+                q.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Main loop of worker "self".
+     */
+    void
+    worker_loop(int self)
+    {
+        worker_index(this) = self;
+        task t;
+        while (!stop.load()) {
+            if (try_pop(self, t)) {
+                execute(self, t);
+                t = nullptr;
+                pending.fetch_sub(1);
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(sleep_lock);
+            sleep_cv.wait_for(guard, std::chrono::milliseconds(10), [&] {
+                return stop.load() || pending.load() > 0;
+            });
+        }
+    }
+
+public:
+
+    /**
+     * @brief Creates a pool with "thread_num" threads, including the calling
+     * thread. Use 0 for the number of hardware threads.
+     */
+    thread_pool(int thread_num = 0)
+    : pending(0),
+      next_queue(0),
+      stop(false),
+      created(std::chrono::steady_clock::now())
+    {
+        if (thread_num <= 0) {
+            thread_num = std::thread::hardware_concurrency();
+        }
+        if (thread_num <= 0) {
+            thread_num = 1;
+        }
+        /* Queue 0 belongs to external threads (e.g., the caller) */
+        for (int i=0; i<thread_num; ++i) {
+            queues.emplace_back(new task_queue);
+        }
+        busy_ns.reset(new std::atomic<uint64_t>[thread_num]);
+        for (int i=0; i<thread_num; ++i) {
+            busy_ns[i].store(0);
+        }
+        for (int i=1; i<thread_num; ++i) {
+            workers.emplace_back(&thread_pool::worker_loop, this, i);
+        }
+    }
+
+    ~thread_pool()
+    {
+        stop.store(true);
+        sleep_cv.notify_all();
+        for (auto &w : workers) {
+            w.join();
+        }
+        if (run_stats::enabled()) {
+            std::chrono::duration<double> lifetime =
+                std::chrono::steady_clock::now() - created;
+            std::vector<double> busy(queues.size());
+            for (size_t i=0; i<queues.size(); ++i) {
+                busy[i] = busy_ns[i].load() * 1e-9;
+            }
+            run_stats::record_pool(lifetime.count(), busy);
+        }
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    /**
+     * @brief Returns the number of threads that execute tasks, including
+     * the waiting thread.
+     */
+    size_t
+    size() const
+    {
+        return queues.size();
+    }
+
+    /**
+     * @brief Enqueues "t" for execution. Tasks submitted from a worker go to
+     * its own queue; others are spread between the queues.
+     */
+    void
+    submit(task t)
+    {
+        int self = worker_index(this);
+        size_t q = self >= 0 ? self : next_queue.fetch_add(1) % queues.size();
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> guard(queues[q]->lock);
+            queues[q]->tasks.push_back(std::move(t));
+        }
+        sleep_cv.notify_one();
+    }
+
+    /**
+     * @brief Executes pending tasks on the calling thread until "done"
+     * returns true.
+     */
+    template <typename P>
+    void
+    wait_until(P done)
+    {
+        int self = worker_index(this);
+        task t;
+        while (!done()) {
+            if (try_pop(self, t)) {
+                execute(self, t);
+                t = nullptr;
+                pending.fetch_sub(1);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    /**
+     * @brief Invokes "fn(begin, end)" over sub-ranges of [first, last) of at
+     * most "grain" elements each, and returns once all have completed.
+     * Rethrows the first exception thrown by "fn", if any.
+     */
+    template <typename Fn>
+    void
+    parallel_for(size_t first, size_t last, size_t grain, Fn fn)
+    {
+        if (first >= last) {
+            return;
+        }
+        if (grain == 0) {
+            grain = 1;
+        }
+        std::atomic<size_t> remaining((last - first + grain - 1) / grain);
+        std::exception_ptr error;
+        std::mutex error_lock;
+        for (size_t b=first; b<last; b+=grain) {
+            size_t e = std::min(last, b + grain);
+            submit([&fn, &remaining, &error, &error_lock, b, e] {
+                try {
+                    fn(b, e);
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(error_lock);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                remaining.fetch_sub(1);
+            });
+        }
+        wait_until([&] { return remaining.load() == 0; });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+};
+
+#endif /* THREAD_POOL_H */
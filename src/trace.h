@@ -0,0 +1,641 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+#include "errorf.h"
+#include "random.h"
+
+/* Trace file format (native byte order, not compressed):
+ *   "cbtrace1"                  magic
+ *   u32 F                       fields per header
+ *   u64 U                       headers in the pool
+ *   U x (F x u32, u32 rule-id)  the header pool
+ *   u64 L                       packets in the trace
+ *   L x u32                     pool index of each packet, in order */
+
+namespace cbmapper {
+
+/**
+ * @brief Temporal locality model of a packet trace
+ */
+enum class trace_locality {
+    /// Each packet is drawn from the pool independently
+    uniform,
+    /// LRU stack distance model: a packet either starts a new flow or
+    /// repeats the flow at a random depth of the LRU stack of recent flows.
+    /// Exact, and several times slower than the other models when deep
+    /// accesses are common
+    lru,
+    /// ON/OFF model: a fixed number of flows are active at a time, each for
+    /// a Pareto distributed number of packets; then it turns OFF and a flow
+    /// drawn from the pool takes its place. The default
+    burst
+};
+
+/**
+ * @brief Tunables of a trace
+ */
+struct trace_options {
+    trace_locality locality = trace_locality::burst;
+    /// (lru) Probability that a packet starts a new flow
+    double new_flow_prob = 0.1;
+    /// (lru) Depth of the LRU stack, at most 65535
+    size_t stack_size = 1024;
+    /// (lru) Stack depth "d" is drawn with probability proportional to
+    /// d^-stack_exponent
+    double stack_exponent = 1.5;
+    /// (burst) Number of concurrently active flows
+    size_t active_flows = 64;
+    /// (burst) Mean ON period, in packets
+    double burst_mean = 16;
+    /// (burst) Pareto shape of the ON periods, above 1
+    double burst_shape = 1.5;
+};
+
+/**
+ * @brief Samples values in [1, N] from a discrete distribution in O(1) with
+ * Walker's alias method. Takes 8 bytes per value.
+ */
+class alias_sampler {
+
+    struct column {
+        /* Fraction of the column that keeps its own value, out of 2^32 */
+        uint32_t threshold;
+        uint32_t alias;
+    };
+
+    std::vector<column> columns;
+
+public:
+
+    /**
+     * @brief Builds a sampler over [1, "size"] whose probability mass is
+     * proportional to "weight(v)"
+     */
+    template <typename W>
+    void
+    build(size_t size, W weight)
+    {
+        std::vector<double> mass(size);
+        double total = 0;
+        for (size_t v=0; v<size; ++v) {
+            mass[v] = weight(v + 1);
+            total += mass[v];
+        }
+
+        std::vector<size_t> small, large;
+        for (size_t v=0; v<size; ++v) {
+            mass[v] *= size / total;
+            (mass[v] < 1 ? small : large).push_back(v);
+        }
+        columns.resize(size);
+        while (!small.empty() && !large.empty()) {
+            size_t s = small.back();
+            size_t l = large.back();
+            small.pop_back();
+            columns[s].threshold = std::min(mass[s] * 4294967296.0,
+                                            4294967295.0);
+            columns[s].alias = l + 1;
+            mass[l] -= 1 - mass[s];
+            if (mass[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+        /* Leftovers are full columns, up to rounding */
+        for (size_t v : small) {
+            columns[v] = {0xffffffff, (uint32_t)v + 1};
+        }
+        for (size_t v : large) {
+            columns[v] = {0xffffffff, (uint32_t)v + 1};
+        }
+    }
+
+    /**
+     * @brief Returns a value drawn with 32 random bits
+     */
+    inline uint32_t
+    sample(uint32_t bits) const
+    {
+        /* The high half picks a column, the low half is uniform within it */
+        uint64_t x = (uint64_t)bits * columns.size();
+        const column &c = columns[x >> 32];
+        return (uint32_t)x < c.threshold ? (x >> 32) + 1 : c.alias;
+    }
+};
+
+/**
+ * @brief An LRU stack of pool indices that reaches any depth without moving
+ * entries. Every entry occupies the time slot of its last access and a bitmap
+ * marks the occupied slots, so the entry at depth "d" holds the d-th set bit
+ * below the newest slot, found by popcounts. Slots are compacted once they
+ * run out, which is O(1) amortized.
+ */
+class lru_stack {
+    std::vector<uint64_t> bits;
+    std::vector<uint32_t> slots;
+    size_t max_depth;
+    /* Next free slot, lowest possibly occupied slot and number of entries */
+    size_t now;
+    size_t tail;
+    size_t live;
+
+    /**
+     * @brief Returns the position of the "k"-th (from 1) highest set bit of
+     * "word", which must have at least "k" set bits
+     */
+    static inline int
+    select_high(uint64_t word, int k)
+    {
+        int skip = __builtin_popcountll(word) - k;
+#ifdef __BMI2__
+        return __builtin_ctzll(_pdep_u64(1ULL << skip, word));
+#else
+        for (int i=0; i<skip; ++i) {
+            word &= word - 1;
+        }
+        return __builtin_ctzll(word);
+#endif
+    }
+
+    /**
+     * @brief Moves the entries to the lowest slots, keeping their order
+     */
+    void
+    compact()
+    {
+        size_t out = 0;
+        for (size_t w=tail/64; w<(now+63)/64; ++w) {
+            uint64_t word = bits[w];
+            bits[w] = 0;
+            while (word) {
+                slots[out++] = slots[w * 64 + __builtin_ctzll(word)];
+                word &= word - 1;
+            }
+        }
+        for (size_t s=0; s<out; ++s) {
+            bits[s / 64] |= 1ULL << (s % 64);
+        }
+        now = out;
+        tail = 0;
+    }
+
+    /**
+     * @brief Occupies the next slot with "hdr"
+     */
+    inline void
+    append(uint32_t hdr)
+    {
+        if (now == slots.size()) {
+            compact();
+        }
+        slots[now] = hdr;
+        bits[now / 64] |= 1ULL << (now % 64);
+        now++;
+    }
+
+public:
+
+    /**
+     * @brief Creates an empty stack of at most "max_depth" entries
+     */
+    lru_stack(size_t max_depth)
+    : max_depth(max_depth),
+      now(0),
+      tail(0),
+      live(0)
+    {
+        size_t size = std::max<size_t>(4096, max_depth * 16);
+        size = (size + 63) / 64 * 64;
+        slots.resize(size);
+        bits.resize(size / 64);
+    }
+
+    size_t
+    size() const
+    {
+        return live;
+    }
+
+    /**
+     * @brief Pushes "hdr" to the top. Drops the bottom entry when the stack
+     * is full.
+     */
+    inline void
+    push(uint32_t hdr)
+    {
+        append(hdr);
+        if (++live <= max_depth) {
+            return;
+        }
+        /* Clear the lowest set bit */
+        size_t w = tail / 64;
+        uint64_t word = bits[w] & (~0ULL << (tail % 64));
+        while (!word) {
+            word = bits[++w];
+        }
+        size_t slot = w * 64 + __builtin_ctzll(word);
+        bits[w] &= ~(1ULL << (slot % 64));
+        tail = slot + 1;
+        live--;
+    }
+
+    /**
+     * @brief Returns the top entry, which accessing leaves in place
+     */
+    inline uint32_t
+    top() const
+    {
+        return slots[now - 1];
+    }
+
+    /**
+     * @brief Moves the entry at depth "d" (1 is the top, at most "size()")
+     * to the top and returns it
+     */
+    inline uint32_t
+    access(size_t d)
+    {
+        size_t w = (now - 1) / 64;
+        uint64_t word = bits[w] & (~0ULL >> (63 - (now - 1) % 64));
+        int count = __builtin_popcountll(word);
+        while ((size_t)count < d) {
+            d -= count;
+            word = bits[--w];
+            count = __builtin_popcountll(word);
+        }
+        size_t slot = w * 64 + select_high(word, d);
+        uint32_t hdr = slots[slot];
+        bits[w] &= ~(1ULL << (slot % 64));
+        append(hdr);
+        return hdr;
+    }
+};
+
+/**
+ * @brief Generates a sequence of pool indices by a locality model. The
+ * sequence depends only on the options, the pool size and the seed.
+ */
+class trace_generator {
+
+    /* The ON period quantile table maps 16 random bits to a value */
+    static constexpr size_t TABLE_BITS = 16;
+    static constexpr size_t TABLE_SIZE = 1 << TABLE_BITS;
+    /* Longest ON period, in packets */
+    static constexpr double MAX_BURST = 1 << 30;
+
+    struct active_flow {
+        uint32_t hdr;
+        uint32_t left;
+    };
+
+    trace_options opts;
+    uint64_t pool_size;
+    random_stream rng;
+    uint32_t new_flow_threshold;
+
+    /* ON periods (burst) per quantile */
+    std::vector<uint32_t> table;
+    /* Stack depths (lru) */
+    alias_sampler depths;
+    lru_stack stack;
+
+    std::vector<active_flow> flows;
+
+    /**
+     * @brief Returns a pool index drawn uniformly
+     */
+    inline uint32_t
+    new_flow()
+    {
+        return ((unsigned __int128)rng.random_uint64() * pool_size) >> 64;
+    }
+
+    /**
+     * @brief Returns an ON period from 16 random bits
+     */
+    inline uint32_t
+    burst_length(uint64_t bits)
+    {
+        return table[bits & (TABLE_SIZE - 1)];
+    }
+
+    void
+    generate_lru(uint32_t *out, size_t n)
+    {
+        for (size_t i=0; i<n; ++i) {
+            uint64_t r = rng.random_uint64();
+            size_t depth = stack.size();
+            if ((uint32_t)(r >> 32) >= new_flow_threshold && depth) {
+                size_t d = std::min<size_t>(depths.sample(r), depth);
+                out[i] = d == 1 ? stack.top() : stack.access(d);
+            } else {
+                out[i] = new_flow();
+                stack.push(out[i]);
+            }
+        }
+    }
+
+    void
+    generate_burst(uint32_t *out, size_t n)
+    {
+        size_t active = flows.size();
+        for (size_t i=0; i<n; ++i) {
+            uint64_t r = rng.random_uint64();
+            active_flow &flow = flows[((unsigned __int128)r * active) >> 64];
+            out[i] = flow.hdr;
+            if (--flow.left == 0) {
+                flow.hdr = new_flow();
+                flow.left = burst_length(r);
+            }
+        }
+    }
+
+public:
+
+    /**
+     * @brief Creates a generator over a pool of "pool_size" headers
+     */
+    trace_generator(const trace_options &opts, uint64_t pool_size, int seed)
+    : opts(opts),
+      pool_size(pool_size),
+      rng(seed, 0, 0),
+      new_flow_threshold(0),
+      stack(std::min<size_t>(opts.stack_size, 0xffff))
+    {
+        if (!pool_size) {
+            throw errorf("cannot generate a trace from an empty pool.");
+        }
+        if (pool_size > 0xffffffffULL) {
+            throw errorf("trace pools are limited to 2^32-1 headers.");
+        }
+
+        if (opts.locality == trace_locality::lru) {
+            if (opts.stack_size < 1 || opts.stack_size > 0xffff) {
+                throw errorf("LRU stack size must be in [1, 65535].");
+            }
+            if (!(opts.new_flow_prob >= 0 && opts.new_flow_prob <= 1)) {
+                throw errorf("new flow probability must be in [0, 1].");
+            }
+            new_flow_threshold = std::min(opts.new_flow_prob * 4294967296.0,
+                                          4294967295.0);
+            depths.build(opts.stack_size, [&] (size_t d) {
+                return std::pow((double)d, -opts.stack_exponent);
+            });
+        } else if (opts.locality == trace_locality::burst) {
+            if (!opts.active_flows) {
+                throw errorf("number of active flows must be positive.");
+            }
+            if (!(opts.burst_shape > 1) || !(opts.burst_mean >= 1)) {
+                throw errorf("burst shape must be above 1 and burst mean "
+                             "at least 1.");
+            }
+            /* Pareto quantiles: x = xm * u^(-1/shape) */
+            double xm = opts.burst_mean * (opts.burst_shape - 1) /
+                        opts.burst_shape;
+            table.resize(TABLE_SIZE);
+            for (size_t k=0; k<TABLE_SIZE; ++k) {
+                double u = 1.0 - (k + 0.5) / TABLE_SIZE;
+                double x = xm * std::pow(u, -1.0 / opts.burst_shape);
+                table[k] = std::max(1.0, std::min(std::round(x), MAX_BURST));
+            }
+            flows.resize(opts.active_flows);
+            for (active_flow &flow : flows) {
+                flow.hdr = new_flow();
+                flow.left = burst_length(rng.random_uint64());
+            }
+        }
+    }
+
+    /**
+     * @brief Writes the next "n" pool indices of the trace to "out"
+     */
+    void
+    generate(uint32_t *out, size_t n)
+    {
+        switch (opts.locality) {
+        case trace_locality::lru:
+            generate_lru(out, n);
+            break;
+        case trace_locality::burst:
+            generate_burst(out, n);
+            break;
+        default:
+            for (size_t i=0; i<n; ++i) {
+                out[i] = new_flow();
+            }
+        }
+    }
+};
+
+/**
+ * @brief Writes a trace file. The pool is written first by "open", then
+ * the packets are appended by "write", and "close" sets the packet count.
+ */
+class trace_writer {
+    FILE *file;
+    long count_offset;
+    uint64_t packet_num;
+    std::string filename;
+
+    void
+    put(const void *data, size_t size)
+    {
+        if (fwrite(data, 1, size, file) != size) {
+            throw errorf("cannot write to \"%s\".", filename.c_str());
+        }
+    }
+
+public:
+
+    trace_writer()
+    : file(nullptr),
+      count_offset(0),
+      packet_num(0)
+    {}
+
+    ~trace_writer()
+    {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    /**
+     * @brief Creates "filename" with a pool of "pool_size" headers of
+     * "field_num" fields. "get(i, record)" fills "record" with the fields and
+     * rule-id of header "i".
+     */
+    template <typename Get>
+    void
+    open(const char *filename, uint32_t field_num, uint64_t pool_size,
+         Get get)
+    {
+        this->filename = filename;
+        file = fopen(filename, "wb");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for writing.", filename);
+        }
+        put("cbtrace1", 8);
+        put(&field_num, sizeof(field_num));
+        put(&pool_size, sizeof(pool_size));
+
+        std::vector<uint32_t> buffer;
+        std::vector<uint32_t> record(field_num + 1);
+        for (uint64_t i=0; i<pool_size; ++i) {
+            get(i, record.data());
+            buffer.insert(buffer.end(), record.begin(), record.end());
+            if (buffer.size() >= (1 << 20) || i + 1 == pool_size) {
+                put(buffer.data(), buffer.size() * sizeof(uint32_t));
+                buffer.clear();
+            }
+        }
+
+        count_offset = ftell(file);
+        put(&packet_num, sizeof(packet_num));
+    }
+
+    /**
+     * @brief Appends "n" packets with the pool indices "indices"
+     */
+    void
+    write(const uint32_t *indices, size_t n)
+    {
+        put(indices, n * sizeof(uint32_t));
+        packet_num += n;
+    }
+
+    /**
+     * @brief Sets the packet count and closes the file
+     */
+    void
+    close()
+    {
+        fseek(file, count_offset, SEEK_SET);
+        put(&packet_num, sizeof(packet_num));
+        fclose(file);
+        file = nullptr;
+    }
+};
+
+/**
+ * @brief Reads a trace file. The pool is loaded by "open"; packets are
+ * streamed by "read".
+ */
+class trace_reader {
+    FILE *file;
+    uint32_t field_num;
+    uint64_t packet_num;
+    uint64_t packets_left;
+    /* F fields and a rule-id per pool header */
+    std::vector<uint32_t> pool;
+
+public:
+
+    trace_reader()
+    : file(nullptr),
+      field_num(0),
+      packet_num(0),
+      packets_left(0)
+    {}
+
+    ~trace_reader()
+    {
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    /**
+     * @brief Opens trace file "filename" and reads its pool
+     */
+    void
+    open(const char *filename)
+    {
+        char magic[8];
+        uint64_t pool_size;
+        file = fopen(filename, "rb");
+        if (!file) {
+            throw errorf("cannot open \"%s\" for reading.", filename);
+        }
+        if (fread(magic, 1, 8, file) != 8 || memcmp(magic, "cbtrace1", 8) ||
+            fread(&field_num, sizeof(field_num), 1, file) != 1 ||
+            fread(&pool_size, sizeof(pool_size), 1, file) != 1) {
+            throw errorf("Cannot read trace: header mismatch");
+        }
+        pool.resize(pool_size * (field_num + 1));
+        if (fread(pool.data(), sizeof(uint32_t), pool.size(), file) !=
+                pool.size() ||
+            fread(&packet_num, sizeof(packet_num), 1, file) != 1) {
+            throw errorf("Cannot read trace: unexpected end of file");
+        }
+        packets_left = packet_num;
+    }
+
+    uint32_t
+    get_field_num() const
+    {
+        return field_num;
+    }
+
+    uint64_t
+    get_pool_size() const
+    {
+        return pool.size() / (field_num + 1);
+    }
+
+    uint64_t
+    get_packet_num() const
+    {
+        return packet_num;
+    }
+
+    /**
+     * @brief Returns the fields of pool header "idx"
+     */
+    const uint32_t *
+    get_header(uint64_t idx) const
+    {
+        return &pool[idx * (field_num + 1)];
+    }
+
+    /**
+     * @brief Returns the rule-id of pool header "idx"
+     */
+    uint32_t
+    get_header_match(uint64_t idx) const
+    {
+        return pool[idx * (field_num + 1) + field_num];
+    }
+
+    /**
+     * @brief Reads the pool indices of up to "n" next packets into "out".
+     * Returns the number of packets read.
+     */
+    size_t
+    read(uint32_t *out, size_t n)
+    {
+        n = std::min<uint64_t>(n, packets_left);
+        size_t count = fread(out, sizeof(uint32_t), n, file);
+        if (count != n) {
+            throw errorf("Cannot read trace: unexpected end of file");
+        }
+        packets_left -= count;
+        return count;
+    }
+};
+
+};
+
+#endif /* TRACE_H */
@@ -49,6 +49,60 @@ public:
         return *this;
     }
 
+    /**
+     * @brief Writes "size" raw bytes from "data"
+     */
+    void
+    write(const void *data, size_t size)
+    {
+        /* gzwrite takes an unsigned length */
+        const char *ptr = (const char*)data;
+        while (size > 0) {
+            unsigned chunk = size > (1u << 30) ? (1u << 30) : size;
+            gzwrite(f, ptr, chunk);
+            ptr += chunk;
+            size -= chunk;
+        }
+    }
+
+    /**
+     * @brief Writes a 64-bit element count. Counts below 0xffffffff take a
+     * single u32, as in files written before counts were 64-bit; larger
+     * counts are escaped with 0xffffffff and followed by a u64.
+     */
+    void
+    write_count(uint64_t count)
+    {
+        if (count < 0xffffffff) {
+            *this << (uint32_t)count;
+            return;
+        }
+        *this << (uint32_t)0xffffffff;
+        gzwrite(f, &count, sizeof(count));
+    }
+
+    /**
+     * @brief Reads "size" raw bytes into "data". Returns the number of bytes
+     * read.
+     */
+    size_t
+    read(void *data, size_t size)
+    {
+        char *ptr = (char*)data;
+        size_t out = 0;
+        while (size > 0) {
+            unsigned chunk = size > (1u << 30) ? (1u << 30) : size;
+            int bytes = gzread(f, ptr, chunk);
+            if (bytes <= 0) {
+                break;
+            }
+            ptr += bytes;
+            out += bytes;
+            size -= bytes;
+        }
+        return out;
+    }
+
     uint32_t
     read_u32()
     {
@@ -57,6 +111,19 @@ public:
         return b;
     }
 
+    /**
+     * @brief Reads a count written by "write_count"
+     */
+    uint64_t
+    read_count()
+    {
+        uint64_t count = read_u32();
+        if (count == 0xffffffff) {
+            gzread(f, &count, sizeof(count));
+        }
+        return count;
+    }
+
     std::string
     read_string(int length)
     {
@@ -0,0 +1,131 @@
+#!/bin/bash
+# Checks that runs which should write the same mapping write identical
+# files. Usage: check-output.sh UTIL RULESET CHECK
+
+set -e
+util=$(realpath "$1")
+rules=$(realpath "$2")
+check=$3
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+# A skewed distribution gives a few rules most of the flows
+map() {
+    "$util" --mode-mapping --ruleset "$rules" --num-of-flows 100000 \
+            --seed 3 --flow-dist zipf --zipf-exponent 2 "$@" > /dev/null
+}
+
+same() {
+    if ! cmp "$1" "$2"; then
+        echo "$check: $1 and $2 differ"
+        exit 1
+    fi
+}
+
+fails() {
+    if map "$@" 2> /dev/null; then
+        echo "$check: the run did not fail"
+        exit 1
+    fi
+}
+
+case $check in
+threads)
+    map --threads 1 --out a.txt --out-binary a.bin
+    map --threads 4 --out b.txt --out-binary b.bin
+    same a.txt b.txt
+    same a.bin b.bin
+    ;;
+streaming)
+    # The rules with the most flows do not fit the budget and are spilled
+    map --out a.txt --out-binary a.bin
+    map --stream-budget 1 --out b.txt --out-binary b.bin
+    same a.txt b.txt
+    same a.bin b.bin
+    map --stream-budget 1 --pipeline-depth 2 --out c.txt --out-binary c.bin
+    same a.txt c.txt
+    same a.bin c.bin
+    ;;
+text)
+    # The text file holds the headers of the binary file, formatted by
+    # iostreams in mode-read-binary; it prints the miss rule id as -1
+    map --miss-ratio 0.1 --out a.txt --out-binary a.bin
+    "$util" --mode-read-binary a.bin |
+        sed -n 's/^idx [0-9]* matches \([-0-9]*\) : \(.*\) $/\1: \2/p' |
+        sed 's/^-1:/4294967295:/' | LC_ALL=C sort > b.txt
+    LC_ALL=C sort a.txt > c.txt
+    same b.txt c.txt
+    ;;
+resume)
+    map --out a.txt --out-binary a.bin
+    # A directory in place of the output stops the run after the mapping,
+    # with the checkpoint of all rules saved
+    mkdir b.txt
+    fails --threads 4 --checkpoint-interval 1 --out b.txt --out-binary b.bin
+    rmdir b.txt
+    test -f b.txt.ckpt
+    map --threads 1 --resume --out b.txt --out-binary b.bin
+    same a.txt b.txt
+    same a.bin b.bin
+    # One in place of the first checkpoint leaves only the swept fields
+    mkdir c.txt.ckpt.tmp
+    fails --checkpoint-interval 1 --out c.txt --out-binary c.bin
+    rmdir c.txt.ckpt.tmp
+    test -f c.txt.ckpt.fields -a ! -f c.txt.ckpt
+    map --resume --out c.txt --out-binary c.bin
+    same a.txt c.txt
+    same a.bin c.bin
+    ;;
+shards)
+    map --out a.txt --out-binary a.bin
+    for i in 0 1 2; do
+        map --shard $i/3 --out s$i.txt --out-binary s$i.bin
+    done
+    cat s0.txt s1.txt s2.txt > b.txt
+    same a.txt b.txt
+    # The merged file lacks only the header hash, which is not printed
+    "$util" --mode-merge-shards s0.bin,s1.bin,s2.bin --out b.bin > /dev/null
+    "$util" --mode-read-binary a.bin > a.out
+    "$util" --mode-read-binary b.bin > b.out
+    same a.out b.out
+    ;;
+incremental)
+    # An unchanged ruleset reuses all headers
+    map --out a.txt --out-binary a.bin
+    map --previous-binary a.bin --out b.txt
+    same a.txt b.txt
+    # Rules appended below the others change no region above them. With as
+    # many flows per rule, a full run maps the rules above as before, and
+    # the rules appended as the incremental run does. Of these, the ones
+    # with swapped addresses are unique, and the ones with wildcards are
+    # mostly not.
+    head -n 200 "$rules" > first.rules
+    awk -F '\t' -v OFS='\t' \
+        'NR <= 100 { d = $2; $2 = substr($1, 2); $1 = "@" d; print }' \
+        "$rules" > other.rules
+    sed -n 201,280p "$rules" >> other.rules
+    cat first.rules other.rules > appended.rules
+    uniform() {
+        "$util" --mode-mapping --seed 3 --flow-dist uniform "$@" > /dev/null
+    }
+    uniform --ruleset first.rules --num-of-flows 20000 --out c.txt \
+            --out-binary c.bin
+    uniform --ruleset appended.rules --num-of-flows 38000 --out d.txt
+    uniform --ruleset appended.rules --num-of-flows 38000 \
+            --previous-binary c.bin --out e.txt
+    same d.txt e.txt
+    # A mapping of other rules regenerates all of them
+    uniform --ruleset other.rules --num-of-flows 18000 --out f.txt \
+            --out-binary f.bin
+    uniform --ruleset first.rules --num-of-flows 20000 \
+            --previous-binary f.bin --out g.txt
+    same c.txt g.txt
+    ;;
+*)
+    echo "unknown check $check"
+    exit 1
+    ;;
+esac
+echo "$check: identical"